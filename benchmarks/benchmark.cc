@@ -0,0 +1,99 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "benchmark.h"
+
+#include <cmath>
+#include <cstdlib>
+
+#include "block_builder.h"
+#include "world_builder.h"
+
+namespace {
+
+const int kDefaultDimension = 9;
+const int kNumNoiseColors = 200;
+
+volatile uint64_t kept_results;
+
+uint32_t Hash(uint32_t x, uint32_t y, uint32_t z) {
+  uint32_t hash = x * 0x8da6b343u ^ y * 0xd8163841u ^ z * 0xcb1ab31fu;
+  hash ^= hash >> 15;
+  hash *= 0x2c1b3c6du;
+  hash ^= hash >> 12;
+  return hash;
+}
+
+int GetTerrainColor(const glm::uvec3 &voxel, uint32_t size) {
+  float x = static_cast<float>(voxel.x) / size;
+  float z = static_cast<float>(voxel.z) / size;
+  float height = size * (0.4f + 0.1f * std::sin(x * 17.0f) *
+                                    std::cos(z * 13.0f) +
+                         0.05f * std::sin((x + z) * 41.0f));
+  float y = static_cast<float>(voxel.y);
+  if (y >= height) {
+    return 0;
+  }
+  if (y + 2.0f >= height) {
+    return 0x3a9d23;
+  }
+  return y + 8.0f >= height ? 0x7b5534 : 0x808080;
+}
+
+int GetNoiseColor(const glm::uvec3 &voxel) {
+  uint32_t hash = Hash(voxel.x, voxel.y, voxel.z);
+  if (hash & 1) {
+    return 0;
+  }
+  return 0x010101 * (1 + (hash >> 8) % kNumNoiseColors);
+}
+
+}  // namespace
+
+const char *GetBenchmarkWorldName(BenchmarkWorld kind) {
+  return kind == BenchmarkWorld::kTerrain ? "terrain" : "noise";
+}
+
+void GenerateBenchmarkWorld(World *world, BenchmarkWorld kind,
+                            int dimension) {
+  world->Clear();
+  world->SetDeduplicates(true);
+  world->SetBrickDimension(dimension - Block::kBrickDimension);
+  uint32_t size = 1u << dimension;
+  BuildWorldBlock(
+      world, LocationalCode(), dimension,
+      [&](LocationalCode block, BlockBuilder *builder) {
+        uint32_t x;
+        uint32_t y;
+        uint32_t z;
+        block.GetCoordinates(&x, &y, &z);
+        glm::uvec3 corner =
+            glm::uvec3(x, y, z) * (1u << builder->levels());
+        builder->AddGrid([&](const glm::uvec3 &voxel) {
+          return kind == BenchmarkWorld::kTerrain
+                     ? GetTerrainColor(corner + voxel, size)
+                     : GetNoiseColor(corner + voxel);
+        });
+        return true;
+      });
+}
+
+int GetBenchmarkDimension(int argc, char **argv) {
+  return argc > 1 ? std::atoi(argv[1]) : kDefaultDimension;
+}
+
+void KeepResult(uint64_t result) {
+  kept_results = kept_results + result;
+}
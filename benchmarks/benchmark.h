@@ -0,0 +1,65 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include <chrono>
+#include <cstdint>
+
+#include "world.h"
+
+// Helpers shared by the benchmarks, which run on generated worlds so that
+// their numbers can be reproduced anywhere.
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+
+  double ElapsedMs() const {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// The kinds of worlds to benchmark on.
+enum class BenchmarkWorld {
+  // Rolling hills in a few colors by height, with the bricks along the
+  // surface, which is what players mostly build on.
+  kTerrain,
+  // Every voxel filled or not at random in one of 200 colors, which is the
+  // worst case for the size of the tree.
+  kNoise,
+};
+
+const char *GetBenchmarkWorldName(BenchmarkWorld kind);
+
+// Replaces the world with one of the given kind, in voxels of the given
+// dimension, configured like the world of the game: deduplicated, with
+// bricks at the deepest dimension they can be at.
+void GenerateBenchmarkWorld(World *world, BenchmarkWorld kind, int dimension);
+
+// Returns the dimension given as the first argument of a benchmark, or the
+// default one, which is the dimension of the smallest blocks of the game.
+int GetBenchmarkDimension(int argc, char **argv);
+
+// Keeps the compiler from dropping computations whose results are unused.
+void KeepResult(uint64_t result);
+
+#endif  // BENCHMARK_H_
@@ -0,0 +1,129 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Measures how much a full traversal of a world that was edited for a long
+// time speeds up when the world is defragmented, and how much memory it
+// gives back.
+//
+// Usage: defragment-benchmark [dimension]
+
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "benchmark.h"
+#include "block_traversal.h"
+#include "world.h"
+
+namespace {
+
+const int kNumEdits = 100000;
+// Edits are grouped into undo steps of this many edits, of which the last
+// kNumSnapshots are kept like the history of the game keeps them.
+const int kEditsPerSnapshot = 100;
+const int kNumSnapshots = 100;
+const int kNumTraversals = 5;
+
+// Edits the world at random places along the terrain, which copies the
+// blocks along each edited path to wherever the pool has room.
+void FragmentWorld(World *world, int dimension, std::deque<Block> *snapshots) {
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> coordinate(0.0f, world->size());
+  std::uniform_int_distribution<int> color(1, 0xffffff);
+  for (int i = 0; i < kNumEdits; ++i) {
+    if (i % kEditsPerSnapshot == 0) {
+      snapshots->push_back(world->TakeSnapshot());
+      if (snapshots->size() > kNumSnapshots) {
+        world->ReleaseSnapshot(&snapshots->front());
+        snapshots->pop_front();
+      }
+    }
+    float height = world->size() * (0.3f + 0.2f * coordinate(random) /
+                                                world->size());
+    world->SetBlock(coordinate(random), height, coordinate(random),
+                    dimension, random() % 4 ? color(random) : -1);
+  }
+}
+
+// Returns the time of a traversal of every block and voxel in milliseconds,
+// the fastest of a few.
+double MeasureTraversal(const World &world) {
+  double best_ms = 0.0;
+  for (int i = 0; i < kNumTraversals; ++i) {
+    uint64_t sum = 0;
+    Timer timer;
+    TraverseBlocks(
+        &world.root(), glm::vec3(0.0f), world.size(),
+        [&sum](const TraversalNode<const Block> &node) {
+          if (node.block->is_brick()) {
+            VisitVoxels(*node.block, node.corner, node.size,
+                        [&sum](uint16_t value, glm::vec3, float) {
+                          sum += value;
+                        });
+          } else {
+            sum += node.block->value();
+          }
+          return TraversalResult::kContinue;
+        });
+    double elapsed_ms = timer.ElapsedMs();
+    KeepResult(sum);
+    if (i == 0 || elapsed_ms < best_ms) {
+      best_ms = elapsed_ms;
+    }
+  }
+  return best_ms;
+}
+
+void PrintPool(const char *name, const World &world, double traversal_ms) {
+  const BlockPool &pool = world.pool();
+  std::printf("  %s: traversal %.1f ms, %.1f MB used of %.1f MB\n", name,
+              traversal_ms, pool.num_used_bytes() / 1e6,
+              pool.num_reserved_bytes() / 1e6);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int dimension = GetBenchmarkDimension(argc, argv);
+  World world(1.0f);
+  for (BenchmarkWorld kind : {BenchmarkWorld::kTerrain,
+                              BenchmarkWorld::kNoise}) {
+    GenerateBenchmarkWorld(&world, kind, dimension);
+    std::printf("%s %d^3:\n", GetBenchmarkWorldName(kind), 1 << dimension);
+    PrintPool("generated", world, MeasureTraversal(world));
+
+    std::deque<Block> snapshots;
+    FragmentWorld(&world, dimension, &snapshots);
+    PrintPool("edited", world, MeasureTraversal(world));
+
+    std::vector<Block *> moved_snapshots;
+    for (Block &snapshot : snapshots) {
+      moved_snapshots.push_back(&snapshot);
+    }
+    Timer timer;
+    world.Defragment(moved_snapshots);
+    double defragment_ms = timer.ElapsedMs();
+    PrintPool("defragmented", world, MeasureTraversal(world));
+    std::printf("  defragmenting took %.1f ms\n", defragment_ms);
+
+    for (Block &snapshot : snapshots) {
+      world.ReleaseSnapshot(&snapshot);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,116 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Measures point lookups of blocks, which the game makes for every ray cast
+// and collision check, through each of the ways the world can look them up.
+//
+// Usage: lookup-benchmark [dimension]
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "benchmark.h"
+#include "world.h"
+
+namespace {
+
+const int kNumLookups = 2000000;
+
+// Returns points spread over the whole world, and points along rays at the
+// height of the terrain, which is where lookups of the game end up.
+std::vector<glm::vec3> GetLookupPoints(float size, bool along_rays) {
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> coordinate(0.0f, size);
+  std::vector<glm::vec3> points;
+  points.reserve(kNumLookups);
+  while (points.size() < kNumLookups) {
+    glm::vec3 point(coordinate(random), coordinate(random),
+                    coordinate(random));
+    if (!along_rays) {
+      points.push_back(point);
+      continue;
+    }
+    point.y = size * 0.4f;
+    glm::vec3 step = glm::normalize(glm::vec3(
+        coordinate(random) - size / 2, 0.0f, coordinate(random) - size / 2));
+    for (int i = 0; i < 1000 && points.size() < kNumLookups; ++i) {
+      points.push_back(glm::clamp(point + step * (i * size / 4096),
+                                  glm::vec3(0.0f), glm::vec3(size * 0.999f)));
+    }
+  }
+  return points;
+}
+
+// Returns the time per lookup in nanoseconds.
+template <typename LookupFunction>
+double MeasureLookups(const std::vector<glm::vec3> &points,
+                      const LookupFunction &look_up) {
+  uint64_t sum = 0;
+  Timer timer;
+  for (const glm::vec3 &point : points) {
+    int dimension = 0;
+    const Block *block = look_up(point, &dimension);
+    sum += dimension + (block ? block->value() : 0);
+  }
+  double elapsed_ms = timer.ElapsedMs();
+  KeepResult(sum);
+  return elapsed_ms * 1e6 / points.size();
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int dimension = GetBenchmarkDimension(argc, argv);
+  World world(1.0f);
+  for (BenchmarkWorld kind : {BenchmarkWorld::kTerrain,
+                              BenchmarkWorld::kNoise}) {
+    GenerateBenchmarkWorld(&world, kind, dimension);
+    world.SetIndexed(true);
+    world.SetUsesWideTree(false);
+    for (bool along_rays : {false, true}) {
+      std::vector<glm::vec3> points =
+          GetLookupPoints(world.size(), along_rays);
+      double octree_ns = MeasureLookups(
+          points, [&](const glm::vec3 &point, int *block_dimension) {
+            return world.GetBlock(point.x, point.y, point.z,
+                                  block_dimension);
+          });
+      // GetBlock() descends the wide tree instead once it's kept.
+      world.SetUsesWideTree(true);
+      double wide_tree_ns = MeasureLookups(
+          points, [&](const glm::vec3 &point, int *block_dimension) {
+            return world.GetBlock(point.x, point.y, point.z,
+                                  block_dimension);
+          });
+      world.SetUsesWideTree(false);
+      double index_ns = MeasureLookups(
+          points, [&](const glm::vec3 &point, int *block_dimension) {
+            LocationalCode code;
+            world.GetCode(point.x, point.y, point.z, World::kMaxDimension,
+                          &code);
+            return world.FindBlock(code, block_dimension);
+          });
+      std::printf(
+          "%s %d^3, %s: octree %.0f ns, wide tree %.0f ns, index %.0f ns\n",
+          GetBenchmarkWorldName(kind), 1 << dimension,
+          along_rays ? "along rays" : "uniform", octree_ns, wide_tree_ns,
+          index_ns);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Measures the frames of an editing thread while a WorldSaver saves the
+// world in the background, against the same frames without a save. Each
+// frame makes a few edits and then sleeps for the rest of a 60 Hz frame,
+// like the game waiting for the next one.
+//
+// Usage: save-benchmark [dimension]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "world.h"
+#include "world_saver.h"
+
+namespace {
+
+const char kPath[] = "save-benchmark.sbi";
+const int kNumEditsPerFrame = 20;
+const double kFrameMs = 1000.0 / 60.0;
+const int kNumBaselineFrames = 120;
+
+// Makes the edits of a frame, which copy the blocks a running save still
+// reads, and finishes a save that is done. Returns the time the frame took
+// before it would wait for the next one.
+double RunFrame(World *world, WorldSaver *saver, int dimension,
+                std::mt19937 *random) {
+  std::uniform_real_distribution<float> coordinate(0.0f, world->size());
+  std::uniform_int_distribution<int> color(1, 0xffffff);
+  Timer timer;
+  for (int i = 0; i < kNumEditsPerFrame; ++i) {
+    world->SetBlock(coordinate(*random), coordinate(*random),
+                    coordinate(*random), dimension, color(*random));
+  }
+  world->NotifyListeners();
+  saver->Update();
+  double elapsed_ms = timer.ElapsedMs();
+  if (elapsed_ms < kFrameMs) {
+    std::this_thread::sleep_for(
+        std::chrono::duration<double, std::milli>(kFrameMs - elapsed_ms));
+  }
+  return elapsed_ms;
+}
+
+void PrintFrames(const char *name, std::vector<double> frame_ms) {
+  std::sort(frame_ms.begin(), frame_ms.end());
+  std::printf("  %s: %zu frames, median %.2f ms, 99th percentile %.2f ms, "
+              "max %.2f ms\n",
+              name, frame_ms.size(), frame_ms[frame_ms.size() / 2],
+              frame_ms[frame_ms.size() * 99 / 100], frame_ms.back());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int dimension = GetBenchmarkDimension(argc, argv);
+  World world(1.0f);
+  WorldSaver saver(&world);
+  std::mt19937 random(1);
+  for (BenchmarkWorld kind : {BenchmarkWorld::kTerrain,
+                              BenchmarkWorld::kNoise}) {
+    GenerateBenchmarkWorld(&world, kind, dimension);
+    std::printf("%s %d^3:\n", GetBenchmarkWorldName(kind), 1 << dimension);
+
+    std::vector<double> baseline_ms;
+    for (int i = 0; i < kNumBaselineFrames; ++i) {
+      baseline_ms.push_back(RunFrame(&world, &saver, dimension, &random));
+    }
+
+    // The frame that starts the save includes starting it.
+    std::vector<double> saving_ms;
+    Timer start_timer;
+    saver.Save(kPath);
+    double start_ms = start_timer.ElapsedMs();
+    saving_ms.push_back(start_ms +
+                        RunFrame(&world, &saver, dimension, &random));
+    while (saver.is_saving()) {
+      saving_ms.push_back(RunFrame(&world, &saver, dimension, &random));
+    }
+
+    const WorldSaver::Stats &stats = saver.last_stats();
+    if (!stats.succeeded) {
+      std::fprintf(stderr, "Failed to save %s\n", kPath);
+      std::remove(kPath);
+      return 1;
+    }
+    PrintFrames("without a save", baseline_ms);
+    PrintFrames("while saving", saving_ms);
+    std::printf("  saved %.1f MB, started in %.2f ms, written in %.0f ms\n",
+                stats.num_bytes / 1e6, stats.start_ms, stats.write_ms);
+  }
+  std::remove(kPath);
+  return 0;
+}
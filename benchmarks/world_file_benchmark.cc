@@ -0,0 +1,220 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Measures how fast worlds are saved to and loaded from files in the format
+// of world_file.h, uncompressed and compressed, and how much smaller
+// compression makes them. The file is read back from the page cache, so
+// loading measures the parsing rather than the disk, and it's compared with
+// just reading the bytes of the file, which is the least loading can take.
+// The streams of the compressed file are also decompressed on their own, to
+// measure the codec of lz_codec.h apart from building the blocks.
+//
+// Usage: world-file-benchmark [dimension]
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "lz_codec.h"
+#include "world.h"
+
+namespace {
+
+const char kPath[] = "world-file-benchmark.sbw";
+const int kNumRepetitions = 3;
+
+long GetFileSize(const std::string &path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  return file ? static_cast<long>(file.tellg()) : -1;
+}
+
+// Reads the whole file without parsing it. Returns false if it can't be
+// read.
+bool ReadFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> buffer(1 << 16);
+  uint64_t sum = 0;
+  while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+    sum += static_cast<unsigned char>(buffer[0]);
+  }
+  KeepResult(sum);
+  return file.eof();
+}
+
+uint32_t ReadUint32(const uint8_t *data) {
+  return data[0] | data[1] << 8 | data[2] << 16 |
+         static_cast<uint32_t>(data[3]) << 24;
+}
+
+// The streams of each frame of a compressed file, as in world_file.h.
+const char *const kStreamNames[] = {"masks", "values", "voxels",
+                                    "references"};
+const int kNumStreams = 4;
+
+// Decompresses every stream of the frames of a compressed file a few times,
+// and prints the fastest throughput of each kind of stream in megabytes of
+// decompressed data per second. Returns false if the file can't be read or
+// isn't a compressed file of the current version.
+bool MeasureDecompression(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  // The magic, version, compression, brick dimension and palette size come
+  // before the colors, and the number of shared blocks after them.
+  if (data.size() < 20 || ReadUint32(&data[4]) != kWorldFileVersion ||
+      ReadUint32(&data[8]) != static_cast<uint32_t>(WorldCompression::kLz)) {
+    return false;
+  }
+  size_t position = 20 + 4 * (ReadUint32(&data[16]) - 1) + 4;
+
+  double best_ms[kNumStreams];
+  uint64_t sizes[kNumStreams] = {};
+  std::vector<uint8_t> output;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    double ms[kNumStreams] = {};
+    for (size_t frame = position; frame < data.size();) {
+      if (data.size() - frame < 8 * kNumStreams) {
+        return false;
+      }
+      const uint8_t *compressed = &data[frame + 8 * kNumStreams];
+      for (int stream = 0; stream < kNumStreams; ++stream) {
+        uint32_t size = ReadUint32(&data[frame + 4 * stream]);
+        uint32_t compressed_size =
+            ReadUint32(&data[frame + 4 * (kNumStreams + stream)]);
+        if (compressed + compressed_size > data.data() + data.size()) {
+          return false;
+        }
+        output.resize(size);
+        Timer timer;
+        if (!LzDecompress(compressed, compressed_size, output.data(),
+                          size)) {
+          return false;
+        }
+        ms[stream] += timer.ElapsedMs();
+        KeepResult(size ? output[size - 1] : 0);
+        if (i == 0) {
+          sizes[stream] += size;
+        }
+        compressed += compressed_size;
+      }
+      frame = compressed - data.data();
+    }
+    for (int stream = 0; stream < kNumStreams; ++stream) {
+      if (i == 0 || ms[stream] < best_ms[stream]) {
+        best_ms[stream] = ms[stream];
+      }
+    }
+  }
+
+  for (int stream = 0; stream < kNumStreams; ++stream) {
+    if (sizes[stream] == 0) {
+      continue;
+    }
+    std::printf("  lz decompression of %s: %.2f MB in %.2f ms (%.0f MB/s)\n",
+                kStreamNames[stream], sizes[stream] / 1e6, best_ms[stream],
+                sizes[stream] / 1e3 / std::max(best_ms[stream], 1e-3));
+  }
+  return true;
+}
+
+struct FileMeasurement {
+  long size;
+  double save_ms;
+  double load_ms;
+  double read_ms;
+};
+
+// Saves and loads the world a few times and keeps the fastest times.
+// Returns false if the file can't be written or read.
+bool MeasureFile(World *world, WorldCompression compression,
+                 FileMeasurement *measurement) {
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    Timer save_timer;
+    if (!world->Save(kPath, compression)) {
+      return false;
+    }
+    double save_ms = save_timer.ElapsedMs();
+    Timer load_timer;
+    if (!world->Load(kPath)) {
+      return false;
+    }
+    double load_ms = load_timer.ElapsedMs();
+    Timer read_timer;
+    if (!ReadFile(kPath)) {
+      return false;
+    }
+    double read_ms = read_timer.ElapsedMs();
+    if (i == 0 || save_ms < measurement->save_ms) {
+      measurement->save_ms = save_ms;
+    }
+    if (i == 0 || load_ms < measurement->load_ms) {
+      measurement->load_ms = load_ms;
+    }
+    if (i == 0 || read_ms < measurement->read_ms) {
+      measurement->read_ms = read_ms;
+    }
+  }
+  measurement->size = GetFileSize(kPath);
+  return measurement->size >= 0;
+}
+
+// Prints the throughput in megabytes of the uncompressed world per second,
+// so that both kinds of files are compared on the same amount of world.
+void PrintMeasurement(const char *name, const FileMeasurement &measurement,
+                      long world_size) {
+  double megabytes = world_size / 1e6;
+  std::printf("  %s: %.1f MB, save %.0f ms (%.0f MB/s), "
+              "load %.0f ms (%.0f MB/s), read alone %.1f ms\n",
+              name, measurement.size / 1e6, measurement.save_ms,
+              megabytes * 1e3 / measurement.save_ms, measurement.load_ms,
+              megabytes * 1e3 / measurement.load_ms, measurement.read_ms);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int dimension = GetBenchmarkDimension(argc, argv);
+  World world(1.0f);
+  for (BenchmarkWorld kind : {BenchmarkWorld::kTerrain,
+                              BenchmarkWorld::kNoise}) {
+    GenerateBenchmarkWorld(&world, kind, dimension);
+    std::printf("%s %d^3, %zu blocks:\n", GetBenchmarkWorldName(kind),
+                1 << dimension, world.pool().num_live_blocks());
+    FileMeasurement uncompressed;
+    FileMeasurement compressed;
+    if (!MeasureFile(&world, WorldCompression::kNone, &uncompressed) ||
+        !MeasureFile(&world, WorldCompression::kLz, &compressed)) {
+      std::fprintf(stderr, "Failed to save or load %s\n", kPath);
+      std::remove(kPath);
+      return 1;
+    }
+    PrintMeasurement("uncompressed", uncompressed, uncompressed.size);
+    PrintMeasurement("lz", compressed, uncompressed.size);
+    std::printf("  compressed to %.1f%%\n",
+                100.0 * compressed.size / uncompressed.size);
+    // The file was last saved compressed.
+    if (!MeasureDecompression(kPath)) {
+      std::fprintf(stderr, "Failed to decompress %s\n", kPath);
+      std::remove(kPath);
+      return 1;
+    }
+  }
+  std::remove(kPath);
+  return 0;
+}
@@ -15,40 +15,264 @@
 
 #include "block.h"
 
-void Block::Simplify() {
-  if (is_leaf()) {
+#include <algorithm>
+
+#include "block_pool.h"
+#include "block_traversal.h"
+
+void Block::SetValue(uint16_t value, BlockPool *pool) {
+  ReleaseChildren(pool);
+  value_ = value;
+}
+
+Block Block::Share(BlockPool *pool) const {
+  if (brick_) {
+    pool->RetainBrick(voxel_data());
+  } else if (run()) {
+    pool->RetainRun(run());
+  }
+  return *this;
+}
+
+Block *Block::AddChild(int index, BlockPool *pool) {
+  assert(index >= 0 && index < kNumChildren);
+  if (brick_) {
+    ExpandVoxels(pool);
+  }
+  if (is_leaf() && value_) {
+    Subdivide(pool);
+  }
+  if (run()) {
+    set_contents(pool->UnshareRun(run()));
+  }
+
+  Block *existing_child = child(index);
+  if (existing_child) {
+    return existing_child;
+  }
+
+  // Move the run into a new one with room for the child.
+  int num_old_children = num_children();
+  int position = CountChildren(child_mask_ & ((1u << index) - 1));
+  Block *children = pool->AllocateRun(num_old_children + 1);
+  for (int i = 0; i < position; ++i) {
+    children[i] = run()[i];
+  }
+  for (int i = position; i < num_old_children; ++i) {
+    children[i + 1] = run()[i];
+  }
+  if (run()) {
+    pool->FreeRun(run());
+  }
+
+  set_contents(children);
+  child_mask_ |= 1u << index;
+  return &run()[position];
+}
+
+Block *Block::SetChildren(uint8_t child_mask, BlockPool *pool) {
+  assert(child_mask);
+  ReleaseChildren(pool);
+  value_ = 0;
+  set_contents(pool->AllocateRun(CountChildren(child_mask)));
+  child_mask_ = child_mask;
+  return run();
+}
+
+void Block::Simplify(BlockPool *pool) {
+  // Shared subtrees are already simplified.
+  TraverseBlocksPostOrder(
+      this, glm::vec3(0.0f), 1.0f,
+      [pool](const TraversalNode<Block> &node) {
+        if (node.block->is_brick()) {
+          node.block->SimplifyVoxels(pool);
+          return TraversalResult::kSkipChildren;
+        }
+        if (node.block->is_leaf() ||
+            pool->IsRunShared(node.block->run())) {
+          return TraversalResult::kSkipChildren;
+        }
+        return TraversalResult::kContinue;
+      },
+      [pool](const TraversalNode<Block> &node) {
+        node.block->SimplifyChildren(pool);
+      });
+}
+
+void Block::SimplifyChildren(BlockPool *pool) {
+  if (is_leaf() || brick_) {
     return;
   }
 
-  for (int i = 0; i < kNumChildren; ++i) {
-    if (children_[i]) {
-      children_[i]->Simplify();
+  int num_children = this->num_children();
+  uint8_t empty_mask = 0;
+  for (int i = 0, position = 0; i < kNumChildren; ++i) {
+    if (child_mask_ & (1u << i)) {
+      const Block &child = run()[position++];
+      if (child.is_leaf() && !child.value_) {
+        empty_mask |= 1u << i;
+      }
     }
   }
 
-  // Check whether the children can be merged into a single block.
-  for (int i = 0; i < kNumChildren; ++i) {
-    if (!children_[i] || !children_[i]->is_leaf()) {
+  if (empty_mask) {
+    // Move the remaining children into a smaller run.
+    int num_remaining_children = num_children - CountChildren(empty_mask);
+    if (num_remaining_children == 0) {
+      ReleaseChildren(pool);
       return;
     }
+    Block *children = pool->AllocateRun(num_remaining_children);
+    for (int i = 0, position = 0, remaining = 0; i < kNumChildren; ++i) {
+      if (child_mask_ & (1u << i)) {
+        if (!(empty_mask & (1u << i))) {
+          children[remaining++] = run()[position];
+        }
+        ++position;
+      }
+    }
+    pool->FreeRun(run());
+    set_contents(children);
+    child_mask_ &= ~empty_mask;
+    num_children = num_remaining_children;
   }
-  for (int i = 0; i < kNumChildren; ++i) {
-    if (children_[i]->value_ != children_[0]->value_) {
+
+  // Check whether the children can be merged into a single block.
+  if (num_children == kNumChildren) {
+    uint16_t value = run()[0].value_;
+    bool mergeable = true;
+    for (int i = 0; i < kNumChildren; ++i) {
+      if (!run()[i].is_leaf() || run()[i].value_ != value) {
+        mergeable = false;
+        break;
+      }
+    }
+    if (mergeable) {
+      ReleaseChildren(pool);
+      value_ = value;
       return;
     }
   }
 
-  value_ = children_[0]->value_;
-  for (int i = 0; i < kNumChildren; ++i) {
-    delete children_[i];
-    children_[i] = nullptr;
+  pool->UpdateAggregate(*this);
+  if (pool->deduplicates()) {
+    set_contents(pool->InternRun(run()));
   }
 }
 
-void Block::Subdivide() {
+void Block::Subdivide(BlockPool *pool) {
   assert(is_leaf());
+  set_contents(pool->AllocateRun(kNumChildren));
   for (int i = 0; i < kNumChildren; ++i) {
-    children_[i] = new Block(value_);
+    run()[i].value_ = value_;
+  }
+  child_mask_ = 0xff;
+  value_ = 0;
+}
+
+uint16_t *Block::MutableVoxels(BlockPool *pool) {
+  if (brick_) {
+    set_contents(pool->UnshareBrick(voxel_data()));
+    return voxel_data();
   }
+
+  uint16_t *voxels = pool->AllocateBrick();
+  if (is_leaf()) {
+    std::fill(voxels, voxels + kBrickVolume, value_);
+  } else {
+    for (int z = 0; z < kBrickSize; ++z) {
+      for (int y = 0; y < kBrickSize; ++y) {
+        for (int x = 0; x < kBrickSize; ++x) {
+          voxels[GetVoxelIndex(x, y, z)] = GetCornerValue(x, y, z);
+        }
+      }
+    }
+  }
+  ReleaseChildren(pool);
   value_ = 0;
+  brick_ = true;
+  set_contents(voxels);
+  return voxel_data();
+}
+
+void Block::SimplifyVoxels(BlockPool *pool) {
+  if (!brick_) {
+    return;
+  }
+  uint16_t value = voxel_data()[0];
+  bool uniform = true;
+  for (int i = 1; i < kBrickVolume; ++i) {
+    if (voxel_data()[i] != value) {
+      uniform = false;
+      break;
+    }
+  }
+  if (uniform) {
+    ReleaseChildren(pool);
+    value_ = value;
+    return;
+  }
+  pool->UpdateAggregate(*this);
+  if (pool->deduplicates()) {
+    set_contents(pool->InternBrick(voxel_data()));
+  }
+}
+
+void Block::ExpandVoxels(BlockPool *pool) {
+  if (!brick_) {
+    return;
+  }
+  Block brick = *this;
+  brick_ = false;
+  set_contents(nullptr);
+
+  int half_size = kBrickSize / 2;
+  for (int z = 0; z < kBrickSize; ++z) {
+    for (int y = 0; y < kBrickSize; ++y) {
+      for (int x = 0; x < kBrickSize; ++x) {
+        uint16_t value = brick.voxel(x, y, z);
+        if (!value) {
+          continue;
+        }
+        Block *block = this;
+        for (int size = half_size; size > 0; size /= 2) {
+          block = block->AddChild(
+              GetChildIndex(x & size, y & size, z & size), pool);
+        }
+        block->SetValue(value, pool);
+      }
+    }
+  }
+  pool->ReleaseBrick(brick.voxel_data());
+
+  // Bricks are only a few levels deep, so simplifying the new subtree is
+  // cheap.
+  Simplify(pool);
+}
+
+void Block::ReleaseChildren(BlockPool *pool) {
+  if (brick_) {
+    pool->ReleaseBrick(voxel_data());
+    brick_ = false;
+    set_contents(nullptr);
+    return;
+  }
+  if (is_leaf()) {
+    return;
+  }
+  pool->ReleaseRun(run());
+  child_mask_ = 0;
+  set_contents(nullptr);
+}
+
+uint16_t Block::GetCornerValue(int x, int y, int z) const {
+  // Descend to the voxel, and below it towards its corner at the origin.
+  const Block *block = this;
+  for (int size = kBrickSize / 2; block && !block->is_leaf(); size /= 2) {
+    if (block->brick_) {
+      return block->voxel_data()[0];
+    }
+    block = block->child(GetChildIndex(x & size, y & size, z & size));
+  }
+  return block ? block->value_ : 0;
 }
@@ -17,6 +17,34 @@
 #define BLOCK_H_
 
 #include <cassert>
+#include <cstdint>
+
+class BlockPool;
+
+// A summary of the solid blocks in a subtree. The pool keeps it up to date
+// for every block with children or voxels as the tree is edited, so queries
+// about a whole subtree don't have to descend it.
+struct BlockAggregate {
+  // The number of steps the bounds have along each axis of a block.
+  static const int kBoundsScale = 128;
+
+  bool is_empty() const {
+    return num_solid_leaves == 0;
+  }
+
+  // The number of solid leaves, where each solid voxel of a brick counts as
+  // a leaf.
+  uint64_t num_solid_leaves;
+  // The fraction of the volume of the block that is solid.
+  float occupancy;
+  // The mean color of the solid volume.
+  int color;
+  // The bounds of the solid volume in steps of the block size divided by
+  // kBoundsScale, with the maximum excluded. Bounds between two steps are
+  // rounded outwards. Both are zero when nothing is solid.
+  uint8_t min[3];
+  uint8_t max[3];
+};
 
 // An octree block, consisting of eight child blocks
 //
@@ -31,59 +59,184 @@
 //      \ | 6 | 7 |
 //        '-------'
 //
+// Only the children that exist are stored. A block keeps a bit mask of its
+// existing children and a reference to a contiguous run of them, allocated
+// from a BlockPool, where the position of a child in the run is the number of
+// existing children before it. A missing child is the same as an empty one.
+//
+// The reference is the offset of the run from the block itself rather than a
+// pointer, so a tree can be mapped from a file at any address without
+// changing it. Copying a block adjusts the offset to its new address.
+//
+// Runs are reference counted so that identical subtrees can be shared. A
+// block only changes its run in place when nothing else refers to it, and
+// copies it first otherwise.
+//
+// Instead of children, a block can be a brick, which stores the blocks
+// kBrickDimension levels below it as a dense grid of voxel values. Bricks are
+// allocated and shared like runs. A brick has neither children nor a value of
+// its own, so it isn't a leaf.
 class Block {
  public:
   static const int kNumChildren = 8;
+  static const int kBrickDimension = 2;
+  static const int kBrickSize = 1 << kBrickDimension;
+  static const int kBrickVolume = kBrickSize * kBrickSize * kBrickSize;
 
-  Block(int value = 0)
-      : value_(value), children_() {}
-
-  ~Block() {
-    for (int i = 0; i < kNumChildren; ++i) {
-      delete children_[i];
-    }
+  Block(uint16_t value = 0)
+      : value_(value), child_mask_(0), brick_(false), offset_(0) {}
+  Block(const Block &other)
+      : value_(other.value_), child_mask_(other.child_mask_),
+        brick_(other.brick_), offset_(0) {
+    set_contents(other.contents());
+  }
+  Block &operator=(const Block &other) {
+    value_ = other.value_;
+    child_mask_ = other.child_mask_;
+    brick_ = other.brick_;
+    set_contents(other.contents());
+    return *this;
   }
 
-  void set_child(int index, Block *child) {
+  Block *child(int index) const {
     assert(index >= 0 && index < kNumChildren);
-    if (value_) {
-      Subdivide();
-    }
-    if (children_[index]) {
-      delete children_[index];
+    unsigned int bit = 1u << index;
+    if (!(child_mask_ & bit)) {
+      return nullptr;
     }
-    children_[index] = child;
-  }
-  Block *child(int index) const {
-    return children_[index];
+    return &run()[CountChildren(child_mask_ & (bit - 1))];
   }
 
   bool is_leaf() const {
-    for (int i = 0; i < kNumChildren; ++i) {
-      if (children_[i]) {
-        return false;
-      }
-    }
-    return true;
+    return child_mask_ == 0 && !brick_;
+  }
+  bool is_brick() const {
+    return brick_;
   }
 
-  int value() const {
+  uint8_t child_mask() const {
+    return child_mask_;
+  }
+  int num_children() const {
+    return CountChildren(child_mask_);
+  }
+
+  // The palette index of the color of the block, or zero if it's empty. Only
+  // leaves have a value.
+  uint16_t value() const {
     return value_;
   }
-  void set_value(int value) {
-    value_ = value;
-    for (int i = 0; i < kNumChildren; ++i) {
-      delete children_[i];
-      children_[i] = nullptr;
-    }
+
+  // The voxels of a brick, ordered by x, then y, then z.
+  const uint16_t *voxels() const {
+    assert(brick_);
+    return voxel_data();
+  }
+  uint16_t voxel(int x, int y, int z) const {
+    return voxels()[GetVoxelIndex(x, y, z)];
+  }
+  static int GetVoxelIndex(int x, int y, int z) {
+    assert(x >= 0 && x < kBrickSize && y >= 0 && y < kBrickSize &&
+           z >= 0 && z < kBrickSize);
+    return x + kBrickSize * (y + kBrickSize * z);
+  }
+
+  // Returns true if both blocks have the same value and share their children.
+  // In a deduplicated pool identical subtrees always share their children, so
+  // this is then a full comparison of the subtrees.
+  bool IsIdentical(const Block &other) const {
+    return value_ == other.value_ && child_mask_ == other.child_mask_ &&
+           brick_ == other.brick_ && contents() == other.contents();
+  }
+
+  // Sets the value of the block, releasing its children.
+  void SetValue(uint16_t value, BlockPool *pool);
+
+  // Returns a copy of the block that shares its children. The children stay
+  // alive until the copy is released, and blocks that change them copy them
+  // first, so the copy is an immutable snapshot of the subtree.
+  Block Share(BlockPool *pool) const;
+  // Releases the children of a block that isn't part of a tree, such as a
+  // copy returned by Share().
+  void Release(BlockPool *pool) {
+    ReleaseChildren(pool);
+  }
+
+  // Returns the child at the given index, creating it if it's missing. The
+  // children are copied first if they are shared with another block.
+  Block *AddChild(int index, BlockPool *pool);
+  // Replaces the contents of the block with empty leaf children at the bits
+  // set in the mask, and returns their run. Meant for building blocks whose
+  // children are known up front, which are then simplified like after an
+  // edit.
+  Block *SetChildren(uint8_t child_mask, BlockPool *pool);
+
+  void Subdivide(BlockPool *pool);
+
+  // Returns the voxels of the block for changing them, copying them first if
+  // they are shared. Any other block is turned into a brick first, keeping
+  // the value at the corner of each voxel, so detail below the voxels is
+  // lost.
+  uint16_t *MutableVoxels(BlockPool *pool);
+  // Turns a brick with all voxels equal back into a leaf. The voxels are
+  // deduplicated otherwise if the pool deduplicates blocks.
+  void SimplifyVoxels(BlockPool *pool);
+  // Turns a brick back into a subtree of blocks.
+  void ExpandVoxels(BlockPool *pool);
+  // Simplifies the whole subtree from the bottom up. Children shared with
+  // other blocks are left as they are, since they were simplified before they
+  // became shared.
+  void Simplify(BlockPool *pool);
+  // Simplifies the block assuming that its children already are simplified.
+  // Empty children are removed, since a missing child is the same as an empty
+  // one, and children that all have the same value are merged into the block.
+  // The children are deduplicated if the pool deduplicates blocks.
+  void SimplifyChildren(BlockPool *pool);
+
+  // Returns the index of the child in the given half of each axis.
+  static int GetChildIndex(int x, int y, int z) {
+    return (x ? 1 : 0) | (z ? 0 : 2) | (y ? 0 : 4);
   }
 
-  void Subdivide();
-  void Simplify();
+  static int CountChildren(unsigned int mask) {
+    mask = mask - ((mask >> 1) & 0x55);
+    mask = (mask & 0x33) + ((mask >> 2) & 0x33);
+    return (mask + (mask >> 4)) & 0x0f;
+  }
 
  private:
-  int value_;
-  Block *children_[kNumChildren];
+  friend class BlockPool;
+
+  // The run of children or the voxels of the block, or null if it has
+  // neither.
+  void *contents() const {
+    if (!offset_) {
+      return nullptr;
+    }
+    return reinterpret_cast<void *>(reinterpret_cast<intptr_t>(this) +
+                                    static_cast<intptr_t>(offset_));
+  }
+  void set_contents(const void *contents) {
+    offset_ = contents ? reinterpret_cast<intptr_t>(contents) -
+                             reinterpret_cast<intptr_t>(this)
+                       : 0;
+  }
+  Block *run() const {
+    return static_cast<Block *>(contents());
+  }
+  uint16_t *voxel_data() const {
+    return static_cast<uint16_t *>(contents());
+  }
+
+  void ReleaseChildren(BlockPool *pool);
+  uint16_t GetCornerValue(int x, int y, int z) const;
+
+  uint16_t value_;
+  uint8_t child_mask_;
+  bool brick_;
+  // The offset in bytes from the block to its contents, or zero if it has
+  // none. A block is never its own contents.
+  int64_t offset_;
 };
 
 #endif  // BLOCK_H_
@@ -0,0 +1,171 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "block_builder.h"
+
+#include <algorithm>
+#include <cassert>
+
+BlockBuilder::BlockBuilder(BlockPool *pool, Palette *palette, int levels,
+                           int brick_levels)
+    : pool_(pool), palette_(palette), levels_(levels),
+      brick_levels_(brick_levels), stack_(levels + 1), depth_(0),
+      voxels_(), root_value_(Palette::kEmptyIndex), next_path_(0),
+      num_added_(0), last_color_(0), last_index_(Palette::kEmptyIndex) {
+  assert(levels >= 0 && levels <= LocationalCode::kMaxDimension);
+  assert(brick_levels < 0 ||
+         levels <= brick_levels + Block::kBrickDimension);
+  Reset();
+}
+
+BlockBuilder::~BlockBuilder() {
+  for (int depth = 0; depth <= depth_; ++depth) {
+    Level &level = stack_[depth];
+    for (int i = 0; i < Block::kNumChildren; ++i) {
+      if (level.child_mask & (1u << i)) {
+        level.children[i].Release(pool_);
+      }
+    }
+  }
+}
+
+bool BlockBuilder::Add(LocationalCode code, int color) {
+  int depth = code.dimension();
+  if (depth > levels_) {
+    return false;
+  }
+  uint64_t path = code.value() ^ (1ull << (3 * depth));
+  int shift = 3 * (levels_ - depth);
+  if (path << shift < next_path_) {
+    return false;
+  }
+  next_path_ = (path + 1) << shift;
+  uint16_t value = GetIndex(color);
+  if (value == Palette::kEmptyIndex) {
+    return true;
+  }
+  ++num_added_;
+  if (depth == 0) {
+    root_value_ = value;
+    return true;
+  }
+
+  // Blocks below the bricks go into the voxels of the brick they are in.
+  bool in_brick = brick_levels_ >= 0 && depth > brick_levels_;
+  int parent_depth = in_brick ? brick_levels_ : depth - 1;
+  while (depth_ > parent_depth ||
+         (depth_ > 0 &&
+          stack_[depth_].path != path >> (3 * (depth - depth_)))) {
+    FinishLevel();
+  }
+  while (depth_ < parent_depth) {
+    ++depth_;
+    Level &level = stack_[depth_];
+    level.path = path >> (3 * (depth - depth_));
+    level.child_mask = 0;
+    if (depth_ == brick_levels_) {
+      std::fill(voxels_, voxels_ + Block::kBrickVolume,
+                static_cast<uint16_t>(Palette::kEmptyIndex));
+    }
+  }
+
+  if (in_brick) {
+    int voxel_levels = depth - brick_levels_;
+    uint64_t voxel_path = path & ((1ull << (3 * voxel_levels)) - 1);
+    uint32_t x;
+    uint32_t y;
+    uint32_t z;
+    LocationalCode(1ull << (3 * voxel_levels) | voxel_path)
+        .GetCoordinates(&x, &y, &z);
+    int size = 1 << (Block::kBrickDimension - voxel_levels);
+    for (int dz = 0; dz < size; ++dz) {
+      for (int dy = 0; dy < size; ++dy) {
+        for (int dx = 0; dx < size; ++dx) {
+          voxels_[Block::GetVoxelIndex(x * size + dx, y * size + dy,
+                                       z * size + dz)] = value;
+        }
+      }
+    }
+  } else {
+    Level &level = stack_[depth_];
+    int index = static_cast<int>(path & 7);
+    level.children[index] = Block(value);
+    level.child_mask |= 1u << index;
+  }
+  return true;
+}
+
+Block BlockBuilder::Finish() {
+  while (depth_ > 0) {
+    FinishLevel();
+  }
+  Block root = root_value_ != Palette::kEmptyIndex ? Block(root_value_)
+                                                   : BuildBlock(0);
+  Reset();
+  return root;
+}
+
+uint16_t BlockBuilder::GetIndex(int color) {
+  // Neighboring blocks tend to have the same color.
+  if (color != last_color_) {
+    last_index_ = palette_->Add(color);
+    last_color_ = color;
+  }
+  return last_index_;
+}
+
+void BlockBuilder::FinishLevel() {
+  Block block = BuildBlock(depth_);
+  int index = static_cast<int>(stack_[depth_].path & 7);
+  --depth_;
+  Level &parent = stack_[depth_];
+  parent.children[index] = block;
+  parent.child_mask |= 1u << index;
+}
+
+Block BlockBuilder::BuildBlock(int depth) {
+  Block block;
+  if (depth == brick_levels_) {
+    std::copy(voxels_, voxels_ + Block::kBrickVolume,
+              block.MutableVoxels(pool_));
+    block.SimplifyVoxels(pool_);
+    return block;
+  }
+  Level &level = stack_[depth];
+  if (!level.child_mask) {
+    return block;
+  }
+  Block *children = block.SetChildren(level.child_mask, pool_);
+  for (int i = 0, position = 0; i < Block::kNumChildren; ++i) {
+    if (level.child_mask & (1u << i)) {
+      children[position++] = level.children[i];
+    }
+  }
+  level.child_mask = 0;
+  block.SimplifyChildren(pool_);
+  return block;
+}
+
+void BlockBuilder::Reset() {
+  depth_ = 0;
+  stack_[0].path = 0;
+  stack_[0].child_mask = 0;
+  root_value_ = Palette::kEmptyIndex;
+  next_path_ = 0;
+  if (brick_levels_ == 0) {
+    std::fill(voxels_, voxels_ + Block::kBrickVolume,
+              static_cast<uint16_t>(Palette::kEmptyIndex));
+  }
+}
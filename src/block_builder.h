@@ -0,0 +1,139 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BLOCK_BUILDER_H_
+#define BLOCK_BUILDER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "block.h"
+#include "block_pool.h"
+#include "locational_code.h"
+#include "palette.h"
+
+// Builds the tree of a block from the blocks inside it in a single pass from
+// the bottom up, which takes time linear in the number of blocks added.
+//
+// Blocks are added in the order of their codes, which is Morton order, so
+// each block of the tree is complete once a block outside of it is added. The
+// builder keeps the block being filled at each level, and finishes and
+// simplifies blocks as soon as they are complete. The tree it returns is
+// therefore as small as one built by editing, without ever holding more than
+// one unfinished block per level.
+class BlockBuilder {
+ public:
+  // Builds a block whose smallest blocks are the given number of levels below
+  // it, into the given pool and palette. Blocks the given number of brick
+  // levels below it that have children are stored as bricks, in which case
+  // no block can be more than Block::kBrickDimension levels below them. The
+  // brick levels are negative when there are no bricks.
+  BlockBuilder(BlockPool *pool, Palette *palette, int levels,
+               int brick_levels);
+  // Releases the blocks of an unfinished tree.
+  ~BlockBuilder();
+
+  // Adds a block of a color, given by its code relative to the block being
+  // built, which can be up to the given number of levels deep. Blocks must be
+  // added in increasing order of their codes extended to the smallest
+  // blocks, and can't overlap. Returns false, ignoring the block, if it's out
+  // of order. Empty blocks only need to be added to check the order.
+  bool Add(LocationalCode code, int color);
+  // Adds every smallest block of an empty builder in Morton order, with the
+  // colors returned by a function of their coordinates relative to the
+  // corner of the block being built, taking a glm::uvec3. Eight siblings of
+  // the same color are added as their parent.
+  template <typename ColorFunction>
+  void AddGrid(const ColorFunction &get_color);
+  // Returns the finished tree, referenced once in the pool, and starts over
+  // with an empty one.
+  Block Finish();
+
+  int levels() const { return levels_; }
+  int brick_levels() const { return brick_levels_; }
+  // The number of blocks that were added and not empty.
+  uint64_t num_added() const { return num_added_; }
+
+ private:
+  // The unfinished block at a level.
+  struct Level {
+    // The path to the block, which is its code without the leading bit.
+    uint64_t path;
+    uint8_t child_mask;
+    Block children[Block::kNumChildren];
+  };
+
+  BlockBuilder(const BlockBuilder &) = delete;
+  BlockBuilder &operator=(const BlockBuilder &) = delete;
+
+  uint16_t GetIndex(int color);
+  // Finishes the deepest unfinished block and adds it to its parent.
+  void FinishLevel();
+  Block BuildBlock(int depth);
+  void Reset();
+
+  BlockPool *pool_;
+  Palette *palette_;
+  int levels_;
+  int brick_levels_;
+  // The unfinished blocks from the root down to the deepest one.
+  std::vector<Level> stack_;
+  int depth_;
+  // The voxels of the unfinished brick, if the deepest block is one.
+  uint16_t voxels_[Block::kBrickVolume];
+  // The value of the root if it was added as a whole.
+  uint16_t root_value_;
+  // The first extended code the next block can start at.
+  uint64_t next_path_;
+  uint64_t num_added_;
+  int last_color_;
+  uint16_t last_index_;
+};
+
+template <typename ColorFunction>
+void BlockBuilder::AddGrid(const ColorFunction &get_color) {
+  if (levels_ == 0) {
+    Add(LocationalCode(), get_color(glm::uvec3(0)));
+    return;
+  }
+  uint64_t num_parents = 1ull << (3 * (levels_ - 1));
+  for (uint64_t path = 0; path < num_parents; ++path) {
+    LocationalCode parent(num_parents | path);
+    uint32_t x;
+    uint32_t y;
+    uint32_t z;
+    parent.GetCoordinates(&x, &y, &z);
+    glm::uvec3 corner = glm::uvec3(x, y, z) * 2u;
+    int colors[Block::kNumChildren];
+    bool uniform = true;
+    for (int i = 0; i < Block::kNumChildren; ++i) {
+      // The inverse of Block::GetChildIndex().
+      glm::uvec3 offset(i & 1, i & 4 ? 0 : 1, i & 2 ? 0 : 1);
+      colors[i] = get_color(corner + offset);
+      uniform = uniform && colors[i] == colors[0];
+    }
+    if (uniform) {
+      Add(parent, colors[0]);
+      continue;
+    }
+    for (int i = 0; i < Block::kNumChildren; ++i) {
+      Add(parent.child(i), colors[i]);
+    }
+  }
+}
+
+#endif  // BLOCK_BUILDER_H_
@@ -0,0 +1,108 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "block_index.h"
+
+BlockIndex::BlockIndex() : blocks_() {}
+
+BlockIndex::~BlockIndex() {
+}
+
+const Block *BlockIndex::FindDeepest(LocationalCode code,
+                                     int *dimension) const {
+  int code_dimension = code.dimension();
+  const Block *block = Find(LocationalCode());
+  if (!block) {
+    return nullptr;
+  }
+
+  // Search for the deepest dimension along the path that has a block.
+  int found_dimension = 0;
+  int low = 1;
+  int high = code_dimension;
+  while (low <= high) {
+    int middle = (low + high) / 2;
+    const Block *middle_block = Find(
+        LocationalCode(code.value() >> (3 * (code_dimension - middle))));
+    if (middle_block) {
+      block = middle_block;
+      found_dimension = middle;
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+
+  *dimension = found_dimension;
+  return block;
+}
+
+void BlockIndex::Build(const Block &root) {
+  blocks_.clear();
+  AddSubtree(root, LocationalCode());
+}
+
+void BlockIndex::RemoveSubtree(const Block &block, LocationalCode code) {
+  blocks_.erase(code.value());
+  if (block.is_leaf()) {
+    return;
+  }
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    const Block *child = block.child(i);
+    if (child) {
+      RemoveSubtree(*child, code.child(i));
+    }
+  }
+}
+
+void BlockIndex::UpdatePath(const Block &root, LocationalCode code) {
+  int dimension = code.dimension();
+  LocationalCode path_code;
+  const Block *block = &root;
+  blocks_[path_code.value()] = block;
+
+  // Blocks along the path may have been moved, merged or removed. Below the
+  // point where the path ends, every removed block was a leaf.
+  for (int i = 0; i < dimension; ++i) {
+    for (int j = 0; j < Block::kNumChildren; ++j) {
+      const Block *child = block ? block->child(j) : nullptr;
+      if (child) {
+        blocks_[path_code.child(j).value()] = child;
+      } else {
+        blocks_.erase(path_code.child(j).value());
+      }
+    }
+    int index = code.child_index(i, dimension);
+    path_code = path_code.child(index);
+    block = block ? block->child(index) : nullptr;
+  }
+
+  if (block) {
+    AddSubtree(*block, code);
+  }
+}
+
+void BlockIndex::AddSubtree(const Block &block, LocationalCode code) {
+  blocks_[code.value()] = &block;
+  if (block.is_leaf()) {
+    return;
+  }
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    const Block *child = block.child(i);
+    if (child) {
+      AddSubtree(*child, code.child(i));
+    }
+  }
+}
@@ -0,0 +1,68 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BLOCK_INDEX_H_
+#define BLOCK_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "block.h"
+#include "locational_code.h"
+
+// A hash table from the locational code of every existing block to the
+// block, so that a block at a known dimension can be found with a single
+// lookup instead of a descent from the root. Since the code includes the
+// dimension, blocks at all dimensions share the same table.
+//
+// Blocks move in memory when their runs are reallocated, copied or
+// deduplicated, so the index has to be told about every edit.
+class BlockIndex {
+ public:
+  BlockIndex();
+  ~BlockIndex();
+
+  // Returns the block with the given code, or null if it doesn't exist.
+  const Block *Find(LocationalCode code) const {
+    std::unordered_map<uint64_t, const Block *>::const_iterator it =
+        blocks_.find(code.value());
+    return it != blocks_.end() ? it->second : nullptr;
+  }
+
+  // Returns the deepest existing block on the path to the code together with
+  // its dimension. This takes a logarithmic number of lookups in the
+  // dimension of the code, since a block exists only if its parent does.
+  const Block *FindDeepest(LocationalCode code, int *dimension) const;
+
+  void Clear() { blocks_.clear(); }
+  // Indexes every block of the tree.
+  void Build(const Block &root);
+
+  // Removes a block and all blocks below it, before it's edited.
+  void RemoveSubtree(const Block &block, LocationalCode code);
+  // Updates the index after the block with the given code has been edited
+  // and the path to it has been simplified.
+  void UpdatePath(const Block &root, LocationalCode code);
+
+  size_t size() const { return blocks_.size(); }
+
+ private:
+  void AddSubtree(const Block &block, LocationalCode code);
+
+  std::unordered_map<uint64_t, const Block *> blocks_;
+};
+
+#endif  // BLOCK_INDEX_H_
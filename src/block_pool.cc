@@ -0,0 +1,655 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "block_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#include "block_traversal.h"
+#include "palette.h"
+
+namespace {
+
+// Sums up the aggregates of the parts of a block.
+class AggregateBuilder {
+ public:
+  AggregateBuilder()
+      : num_solid_leaves_(0), occupancy_(0.0),
+        red_(0.0), green_(0.0), blue_(0.0) {
+    for (int i = 0; i < 3; ++i) {
+      min_[i] = BlockAggregate::kBoundsScale;
+      max_[i] = 0;
+    }
+  }
+
+  // Adds a part of the block with the given corner and size, in steps of
+  // the bounds.
+  void Add(const BlockAggregate &part, int x, int y, int z, int size) {
+    if (part.is_empty()) {
+      return;
+    }
+    num_solid_leaves_ += part.num_solid_leaves;
+    double fraction = static_cast<double>(size) / BlockAggregate::kBoundsScale;
+    double weight = part.occupancy * fraction * fraction * fraction;
+    occupancy_ += weight;
+    red_ += weight * ((part.color >> 16) & 0xff);
+    green_ += weight * ((part.color >> 8) & 0xff);
+    blue_ += weight * (part.color & 0xff);
+
+    int corner[3] = {x, y, z};
+    for (int i = 0; i < 3; ++i) {
+      int min = corner[i] + part.min[i] * size / BlockAggregate::kBoundsScale;
+      int max = corner[i] + (part.max[i] * size +
+                             BlockAggregate::kBoundsScale - 1) /
+                                BlockAggregate::kBoundsScale;
+      min_[i] = std::min(min_[i], min);
+      max_[i] = std::max(max_[i], max);
+    }
+  }
+
+  BlockAggregate Build() const {
+    BlockAggregate aggregate = BlockAggregate();
+    if (!num_solid_leaves_) {
+      return aggregate;
+    }
+    aggregate.num_solid_leaves = num_solid_leaves_;
+    aggregate.occupancy = static_cast<float>(occupancy_);
+    int red = static_cast<int>(red_ / occupancy_ + 0.5);
+    int green = static_cast<int>(green_ / occupancy_ + 0.5);
+    int blue = static_cast<int>(blue_ / occupancy_ + 0.5);
+    aggregate.color = (red << 16) | (green << 8) | blue;
+    for (int i = 0; i < 3; ++i) {
+      aggregate.min[i] = static_cast<uint8_t>(min_[i]);
+      aggregate.max[i] = static_cast<uint8_t>(max_[i]);
+    }
+    return aggregate;
+  }
+
+ private:
+  uint64_t num_solid_leaves_;
+  double occupancy_;
+  // The color channels weighted by the solid volume they cover.
+  double red_;
+  double green_;
+  double blue_;
+  int min_[3];
+  int max_[3];
+};
+
+}  // namespace
+
+BlockPool::BlockPool(const Palette *palette)
+    : palette_(palette), slabs_(), slab_bytes_used_(kSlabSize),
+      free_runs_(), free_bricks_(nullptr),
+      deduplicates_(false), interned_runs_(), interned_bricks_(),
+      num_live_blocks_(0), peak_live_blocks_(0), num_live_bricks_(0),
+      num_used_bytes_(0) {}
+
+BlockPool::~BlockPool() {
+  FreeSlabs();
+}
+
+Block *BlockPool::AllocateRun(int size) {
+  assert(size > 0 && size <= Block::kNumChildren);
+  void *memory = AllocateMemory(GetRunBytes(size), &free_runs_[size]);
+  num_live_blocks_ += size;
+  if (num_live_blocks_ > peak_live_blocks_) {
+    peak_live_blocks_ = num_live_blocks_;
+  }
+
+  RunHeader *header = new (memory) RunHeader;
+  header->references = 1;
+  header->size = static_cast<uint8_t>(size);
+  header->interned = false;
+  header->child_mask = 0;
+  header->mapped = false;
+  header->aggregate = BlockAggregate();
+
+  Block *run = reinterpret_cast<Block *>(header + 1);
+  for (int i = 0; i < size; ++i) {
+    new (&run[i]) Block();
+  }
+  return run;
+}
+
+void *BlockPool::AllocateMemory(size_t bytes, FreeListEntry **free_list) {
+  num_used_bytes_ += bytes;
+  if (*free_list) {
+    void *memory = *free_list;
+    *free_list = (*free_list)->next;
+    return memory;
+  }
+  if (slab_bytes_used_ + bytes > kSlabSize) {
+    slabs_.push_back(static_cast<char *>(::operator new(kSlabSize)));
+    slab_bytes_used_ = 0;
+  }
+  void *memory = slabs_.back() + slab_bytes_used_;
+  slab_bytes_used_ += bytes;
+  return memory;
+}
+
+void BlockPool::FreeMemory(RunHeader *header, size_t bytes,
+                           FreeListEntry **free_list) {
+  num_used_bytes_ -= bytes;
+  // Blocks and voxels are trivially destructible, so the memory can be
+  // reused for the free list link directly.
+  FreeListEntry *entry = new (header) FreeListEntry;
+  entry->next = *free_list;
+  *free_list = entry;
+}
+
+void BlockPool::FreeRun(Block *run) {
+  RunHeader *header = GetHeader(run);
+  assert(header->references == 1 && !header->interned);
+  FreeRunMemory(header);
+}
+
+void BlockPool::FreeRunMemory(RunHeader *header) {
+  int size = header->size;
+  assert(num_live_blocks_ >= static_cast<size_t>(size));
+  FreeMemory(header, GetRunBytes(size), &free_runs_[size]);
+  num_live_blocks_ -= size;
+}
+
+void BlockPool::ReleaseRun(Block *run) {
+  RunHeader *header = GetHeader(run);
+  if (header->mapped) {
+    return;
+  }
+  assert(header->references > 0);
+  if (--header->references > 0) {
+    return;
+  }
+
+  for (int i = 0; i < header->size; ++i) {
+    ReleaseContents(run[i]);
+  }
+  Unintern(run);
+  FreeRunMemory(header);
+}
+
+Block *BlockPool::UnshareRun(Block *run) {
+  RunHeader *header = GetHeader(run);
+  if (header->references > 1 || header->mapped) {
+    Block *copy = AllocateRun(header->size);
+    for (int i = 0; i < header->size; ++i) {
+      copy[i] = run[i];
+      RetainContents(copy[i]);
+    }
+    GetHeader(copy)->child_mask = header->child_mask;
+    GetHeader(copy)->aggregate = header->aggregate;
+    ReleaseRun(run);
+    return copy;
+  }
+  Unintern(run);
+  return run;
+}
+
+Block *BlockPool::InternRun(Block *run) {
+  RunHeader *header = GetHeader(run);
+  // Mapped runs are read only, so they can't be marked as interned.
+  if (header->interned || header->mapped) {
+    return run;
+  }
+  std::pair<std::unordered_set<Block *, RunHash, RunEqual>::iterator, bool>
+      result = interned_runs_.insert(run);
+  if (result.second) {
+    header->interned = true;
+    return run;
+  }
+  Block *interned_run = *result.first;
+  RetainRun(interned_run);
+  ReleaseRun(run);
+  return interned_run;
+}
+
+void BlockPool::Unintern(Block *run) {
+  RunHeader *header = GetHeader(run);
+  if (!header->interned) {
+    return;
+  }
+  // The table may hold an equal run instead if deduplication was turned off
+  // and on again since the run was interned.
+  std::unordered_set<Block *, RunHash, RunEqual>::iterator it =
+      interned_runs_.find(run);
+  if (it != interned_runs_.end() && *it == run) {
+    interned_runs_.erase(it);
+  }
+  header->interned = false;
+}
+
+uint16_t *BlockPool::AllocateBrick() {
+  void *memory = AllocateMemory(GetBrickBytes(), &free_bricks_);
+  ++num_live_bricks_;
+
+  RunHeader *header = new (memory) RunHeader;
+  header->references = 1;
+  header->size = 0;
+  header->interned = false;
+  header->child_mask = 0;
+  header->mapped = false;
+  header->aggregate = BlockAggregate();
+  return reinterpret_cast<uint16_t *>(header + 1);
+}
+
+void BlockPool::ReleaseBrick(uint16_t *brick) {
+  RunHeader *header = GetHeader(brick);
+  if (header->mapped) {
+    return;
+  }
+  assert(header->references > 0);
+  if (--header->references > 0) {
+    return;
+  }
+  UninternBrick(brick);
+  assert(num_live_bricks_ > 0);
+  FreeMemory(header, GetBrickBytes(), &free_bricks_);
+  --num_live_bricks_;
+}
+
+uint16_t *BlockPool::UnshareBrick(uint16_t *brick) {
+  RunHeader *header = GetHeader(brick);
+  if (header->references > 1 || header->mapped) {
+    uint16_t *copy = AllocateBrick();
+    std::memcpy(copy, brick, sizeof(uint16_t) * Block::kBrickVolume);
+    GetHeader(copy)->aggregate = header->aggregate;
+    ReleaseBrick(brick);
+    return copy;
+  }
+  UninternBrick(brick);
+  return brick;
+}
+
+uint16_t *BlockPool::InternBrick(uint16_t *brick) {
+  RunHeader *header = GetHeader(brick);
+  if (header->interned || header->mapped) {
+    return brick;
+  }
+  std::pair<std::unordered_set<uint16_t *, BrickHash, BrickEqual>::iterator,
+            bool> result = interned_bricks_.insert(brick);
+  if (result.second) {
+    header->interned = true;
+    return brick;
+  }
+  uint16_t *interned_brick = *result.first;
+  RetainBrick(interned_brick);
+  ReleaseBrick(brick);
+  return interned_brick;
+}
+
+void BlockPool::UninternBrick(uint16_t *brick) {
+  RunHeader *header = GetHeader(brick);
+  if (!header->interned) {
+    return;
+  }
+  std::unordered_set<uint16_t *, BrickHash, BrickEqual>::iterator it =
+      interned_bricks_.find(brick);
+  if (it != interned_bricks_.end() && *it == brick) {
+    interned_bricks_.erase(it);
+  }
+  header->interned = false;
+}
+
+void BlockPool::RetainContents(const Block &block) {
+  if (block.brick_) {
+    RetainBrick(block.voxel_data());
+  } else if (block.run()) {
+    RetainRun(block.run());
+  }
+}
+
+void BlockPool::ReleaseContents(const Block &block) {
+  if (block.brick_) {
+    ReleaseBrick(block.voxel_data());
+  } else if (block.run()) {
+    ReleaseRun(block.run());
+  }
+}
+
+BlockAggregate BlockPool::GetAggregate(const Block &block) const {
+  if (block.brick_) {
+    return GetHeader(block.voxel_data())->aggregate;
+  }
+  if (!block.is_leaf()) {
+    return GetHeader(block.run())->aggregate;
+  }
+  BlockAggregate aggregate = BlockAggregate();
+  if (block.value_) {
+    aggregate.num_solid_leaves = 1;
+    aggregate.occupancy = 1.0f;
+    aggregate.color = palette_->color(block.value_);
+    for (int i = 0; i < 3; ++i) {
+      aggregate.max[i] = BlockAggregate::kBoundsScale;
+    }
+  }
+  return aggregate;
+}
+
+void BlockPool::UpdateAggregate(const Block &block) {
+  if (block.brick_) {
+    if (!IsBrickShared(block.voxel_data())) {
+      GetHeader(block.voxel_data())->aggregate =
+          SummarizeVoxels(block.voxel_data());
+    }
+    return;
+  }
+  if (block.is_leaf() || IsRunShared(block.run())) {
+    return;
+  }
+  AggregateBuilder builder;
+  int child_size = BlockAggregate::kBoundsScale / 2;
+  for (int i = 0, position = 0; i < Block::kNumChildren; ++i) {
+    if (block.child_mask_ & (1u << i)) {
+      builder.Add(GetAggregate(block.run()[position++]),
+                  ChildOffsetX(i) * child_size, ChildOffsetY(i) * child_size,
+                  ChildOffsetZ(i) * child_size, child_size);
+    }
+  }
+  RunHeader *header = GetHeader(block.run());
+  header->child_mask = block.child_mask_;
+  header->aggregate = builder.Build();
+}
+
+BlockAggregate BlockPool::SummarizeVoxels(const uint16_t *brick) const {
+  // All voxels have the same size, so unlike the children of a block they
+  // can be summed up with plain counts, which is much faster for a whole
+  // brick. The empty color is zero, so empty voxels add nothing to the
+  // colors, and nothing branches on the voxels, which are often random.
+  int num_solid_voxels = 0;
+  int red = 0;
+  int green = 0;
+  int blue = 0;
+  // The solid voxels of each row along x, with a bit per voxel.
+  unsigned int rows[Block::kBrickSize * Block::kBrickSize] = {};
+  for (int i = 0; i < Block::kBrickVolume; ++i) {
+    uint16_t value = brick[i];
+    unsigned int solid = value != 0;
+    int color = palette_->color(value);
+    num_solid_voxels += solid;
+    red += (color >> 16) & 0xff;
+    green += (color >> 8) & 0xff;
+    blue += color & 0xff;
+    rows[i / Block::kBrickSize] |= solid << (i % Block::kBrickSize);
+  }
+
+  // The bits of the x, y and z positions that have solid voxels.
+  unsigned int solid_positions[3] = {0, 0, 0};
+  for (int z = 0, i = 0; z < Block::kBrickSize; ++z) {
+    for (int y = 0; y < Block::kBrickSize; ++y, ++i) {
+      unsigned int solid = rows[i] != 0;
+      solid_positions[0] |= rows[i];
+      solid_positions[1] |= solid << y;
+      solid_positions[2] |= solid << z;
+    }
+  }
+  int min[3] = {Block::kBrickSize, Block::kBrickSize, Block::kBrickSize};
+  int max[3] = {0, 0, 0};
+  for (int i = 0; i < 3; ++i) {
+    for (int position = 0; position < Block::kBrickSize; ++position) {
+      if (solid_positions[i] & (1u << position)) {
+        min[i] = std::min(min[i], position);
+        max[i] = position + 1;
+      }
+    }
+  }
+
+  BlockAggregate aggregate = BlockAggregate();
+  if (!num_solid_voxels) {
+    return aggregate;
+  }
+  aggregate.num_solid_leaves = num_solid_voxels;
+  aggregate.occupancy =
+      static_cast<float>(num_solid_voxels) / Block::kBrickVolume;
+  int half = num_solid_voxels / 2;
+  aggregate.color = ((red + half) / num_solid_voxels) << 16 |
+                    ((green + half) / num_solid_voxels) << 8 |
+                    (blue + half) / num_solid_voxels;
+  int voxel_size = BlockAggregate::kBoundsScale / Block::kBrickSize;
+  for (int i = 0; i < 3; ++i) {
+    aggregate.min[i] = static_cast<uint8_t>(min[i] * voxel_size);
+    aggregate.max[i] = static_cast<uint8_t>(max[i] * voxel_size);
+  }
+  return aggregate;
+}
+
+void BlockPool::set_deduplicates(bool deduplicates) {
+  deduplicates_ = deduplicates;
+  if (!deduplicates_) {
+    // Runs still marked as interned are dropped from the table lazily.
+    interned_runs_.clear();
+    interned_bricks_.clear();
+  }
+}
+
+Block BlockPool::CopyTree(const Block &root, CopyMap *copies) {
+  Block copy = root;
+  if (root.brick_) {
+    copy.set_contents(CopyBrick(root.voxel_data(), copies));
+  } else if (root.run()) {
+    copy.set_contents(CopyRun(root.run(), copies));
+  }
+  return copy;
+}
+
+Block *BlockPool::CopyRun(const Block *run, CopyMap *copies) {
+  CopyMap::iterator it = copies->find(run);
+  if (it != copies->end()) {
+    Block *copy = static_cast<Block *>(it->second);
+    RetainRun(copy);
+    return copy;
+  }
+
+  // Allocating the run before copying the children lays out the runs of a
+  // subtree right after the run of its root.
+  const RunHeader *header = GetHeader(run);
+  Block *copy = AllocateRun(header->size);
+  GetHeader(copy)->child_mask = header->child_mask;
+  GetHeader(copy)->aggregate = header->aggregate;
+  (*copies)[run] = copy;
+  for (int i = 0; i < header->size; ++i) {
+    copy[i] = CopyTree(run[i], copies);
+  }
+  if (deduplicates_ && header->interned &&
+      interned_runs_.insert(copy).second) {
+    GetHeader(copy)->interned = true;
+  }
+  return copy;
+}
+
+uint16_t *BlockPool::CopyBrick(const uint16_t *brick, CopyMap *copies) {
+  CopyMap::iterator it = copies->find(brick);
+  if (it != copies->end()) {
+    uint16_t *copy = static_cast<uint16_t *>(it->second);
+    RetainBrick(copy);
+    return copy;
+  }
+
+  uint16_t *copy = AllocateBrick();
+  (*copies)[brick] = copy;
+  std::memcpy(copy, brick, sizeof(uint16_t) * Block::kBrickVolume);
+  GetHeader(copy)->aggregate = GetHeader(brick)->aggregate;
+  if (deduplicates_ && GetHeader(brick)->interned &&
+      interned_bricks_.insert(copy).second) {
+    GetHeader(copy)->interned = true;
+  }
+  return copy;
+}
+
+const size_t BlockPool::kMinImageBytes = BlockPool::GetRunBytes(1);
+
+bool BlockPool::WriteImage(const Block &root, std::ostream *stream) {
+  // Lay out the whole image first, so that the offset of every block to its
+  // contents is known when it's written.
+  ImageLayout layout;
+  layout.size = GetRunBytes(1);
+  LayOutImage(root, &layout);
+
+  RunHeader root_header = RunHeader();
+  root_header.size = 1;
+  WriteImageHeader(root_header, stream);
+  WriteImageBlock(root, sizeof(RunHeader), layout, stream);
+  for (const Block *owner : layout.owners) {
+    void *contents = owner->contents();
+    uint64_t position = layout.positions[contents];
+    if (owner->brick_) {
+      const uint16_t *brick = owner->voxel_data();
+      WriteImageHeader(*GetHeader(brick), stream);
+      stream->write(reinterpret_cast<const char *>(brick),
+                    sizeof(uint16_t) * Block::kBrickVolume);
+    } else {
+      const Block *run = owner->run();
+      const RunHeader *header = GetHeader(run);
+      WriteImageHeader(*header, stream);
+      for (int i = 0; i < header->size; ++i) {
+        WriteImageBlock(run[i], position + sizeof(Block) * i, layout,
+                        stream);
+      }
+    }
+  }
+  return static_cast<bool>(*stream);
+}
+
+void BlockPool::LayOutImage(const Block &block, ImageLayout *layout) {
+  void *contents = block.contents();
+  if (!contents || layout->positions.count(contents)) {
+    return;
+  }
+  layout->positions[contents] = layout->size + sizeof(RunHeader);
+  layout->owners.push_back(&block);
+  if (block.brick_) {
+    layout->size += GetBrickBytes();
+    return;
+  }
+  const Block *run = block.run();
+  int size = GetHeader(run)->size;
+  layout->size += GetRunBytes(size);
+  for (int i = 0; i < size; ++i) {
+    LayOutImage(run[i], layout);
+  }
+}
+
+void BlockPool::WriteImageHeader(const RunHeader &header,
+                                 std::ostream *stream) {
+  // Built in zeroed memory, so that the padding is written as zeros too.
+  alignas(RunHeader) char bytes[sizeof(RunHeader)] = {};
+  RunHeader *image_header = new (bytes) RunHeader;
+  image_header->references = 1;
+  image_header->size = header.size;
+  image_header->interned = header.interned;
+  image_header->child_mask = header.child_mask;
+  image_header->mapped = true;
+  image_header->aggregate = header.aggregate;
+  stream->write(bytes, sizeof(bytes));
+}
+
+void BlockPool::WriteImageBlock(const Block &block, uint64_t position,
+                                const ImageLayout &layout,
+                                std::ostream *stream) {
+  alignas(Block) char bytes[sizeof(Block)] = {};
+  Block *image_block = new (bytes) Block(block.value_);
+  image_block->child_mask_ = block.child_mask_;
+  image_block->brick_ = block.brick_;
+  void *contents = block.contents();
+  if (contents) {
+    image_block->offset_ =
+        static_cast<int64_t>(layout.positions.find(contents)->second) -
+        static_cast<int64_t>(position);
+  }
+  stream->write(bytes, sizeof(bytes));
+}
+
+void BlockPool::Swap(BlockPool *other) {
+  std::swap(palette_, other->palette_);
+  std::swap(slabs_, other->slabs_);
+  std::swap(slab_bytes_used_, other->slab_bytes_used_);
+  for (int i = 0; i <= Block::kNumChildren; ++i) {
+    std::swap(free_runs_[i], other->free_runs_[i]);
+  }
+  std::swap(free_bricks_, other->free_bricks_);
+  std::swap(deduplicates_, other->deduplicates_);
+  std::swap(interned_runs_, other->interned_runs_);
+  std::swap(interned_bricks_, other->interned_bricks_);
+  std::swap(num_live_blocks_, other->num_live_blocks_);
+  std::swap(peak_live_blocks_, other->peak_live_blocks_);
+  std::swap(num_live_bricks_, other->num_live_bricks_);
+  std::swap(num_used_bytes_, other->num_used_bytes_);
+}
+
+void BlockPool::Reset() {
+  FreeSlabs();
+  slab_bytes_used_ = kSlabSize;
+  for (int i = 0; i <= Block::kNumChildren; ++i) {
+    free_runs_[i] = nullptr;
+  }
+  free_bricks_ = nullptr;
+  interned_runs_.clear();
+  interned_bricks_.clear();
+  num_live_blocks_ = 0;
+  peak_live_blocks_ = 0;
+  num_live_bricks_ = 0;
+  num_used_bytes_ = 0;
+}
+
+void BlockPool::FreeSlabs() {
+  for (char *slab : slabs_) {
+    ::operator delete(slab);
+  }
+  slabs_.clear();
+}
+
+size_t BlockPool::RunHash::operator()(const Block *run) const {
+  const RunHeader *header = GetHeader(run);
+  uint64_t hash = header->child_mask;
+  for (int i = 0; i < header->size; ++i) {
+    hash = (hash ^ static_cast<uint32_t>(run[i].value_)) * 0x100000001b3ull;
+    hash = (hash ^ run[i].child_mask_) * 0x100000001b3ull;
+    hash = (hash ^ reinterpret_cast<uintptr_t>(run[i].run())) *
+           0x100000001b3ull;
+  }
+  return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+bool BlockPool::RunEqual::operator()(const Block *run1,
+                                     const Block *run2) const {
+  const RunHeader *header1 = GetHeader(run1);
+  const RunHeader *header2 = GetHeader(run2);
+  if (header1->child_mask != header2->child_mask ||
+      header1->size != header2->size) {
+    return false;
+  }
+  for (int i = 0; i < header1->size; ++i) {
+    if (!run1[i].IsIdentical(run2[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t BlockPool::BrickHash::operator()(const uint16_t *brick) const {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (int i = 0; i < Block::kBrickVolume; ++i) {
+    hash = (hash ^ brick[i]) * 0x100000001b3ull;
+  }
+  return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+bool BlockPool::BrickEqual::operator()(const uint16_t *brick1,
+                                       const uint16_t *brick2) const {
+  return std::memcmp(brick1, brick2,
+                     sizeof(uint16_t) * Block::kBrickVolume) == 0;
+}
@@ -0,0 +1,250 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BLOCK_POOL_H_
+#define BLOCK_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "block.h"
+
+class Palette;
+
+// An arena that hands out the children of a block as one contiguous run of
+// up to Block::kNumChildren blocks. Runs are carved out of large slabs and
+// freed runs are recycled through one free list per run size, so building and
+// breaking blocks doesn't go through the general purpose allocator.
+//
+// Runs are reference counted. When deduplication is enabled, the pool also
+// keeps a table of the runs in use so that identical runs, and therefore
+// identical subtrees, are stored only once. This turns the octree into a
+// directed acyclic graph.
+//
+// The voxels of bricks are allocated, shared and deduplicated the same way,
+// with a free list of their own.
+//
+// The header of each run and brick also holds the BlockAggregate of the
+// block that owns it. The aggregate of a run depends on which children its
+// blocks are, so runs are only deduplicated with runs of the same child
+// mask, and the aggregate stays valid when the run is shared. The colors of
+// the aggregates are looked up in the given palette.
+//
+// A tree can also be written as an image with the same layout as the pool,
+// which can be used in place once it's mapped back into memory. Its runs and
+// bricks are marked as mapped, and the pool treats them as shared forever:
+// they are never changed, freed or reference counted, and blocks that change
+// them copy them into the pool first.
+class BlockPool {
+ public:
+  explicit BlockPool(const Palette *palette);
+  ~BlockPool();
+
+  // Returns a run of the given number of empty leaf blocks, referenced once.
+  Block *AllocateRun(int size);
+  // Returns the memory of a run to the free list without releasing the
+  // children of its blocks. Only for runs that nothing else refers to.
+  void FreeRun(Block *run);
+
+  void RetainRun(Block *run) {
+    RunHeader *header = GetHeader(run);
+    if (!header->mapped) {
+      ++header->references;
+    }
+  }
+  // Drops a reference to a run, freeing it and releasing the children of its
+  // blocks once nothing refers to it.
+  void ReleaseRun(Block *run);
+
+  // Returns true if the run can't be changed in place, either because other
+  // blocks refer to it or because it's in the deduplication table.
+  bool IsRunShared(Block *run) const {
+    const RunHeader *header = GetHeader(run);
+    return header->references > 1 || header->interned || header->mapped;
+  }
+  // Returns a run that can be changed in place with the same contents, which
+  // is a copy if the run is shared.
+  Block *UnshareRun(Block *run);
+  // Returns the deduplicated equivalent of a run, which takes over the
+  // reference to the given run.
+  Block *InternRun(Block *run);
+
+  // Returns the uninitialized voxels of a brick, referenced once.
+  uint16_t *AllocateBrick();
+  void RetainBrick(uint16_t *brick) {
+    RunHeader *header = GetHeader(brick);
+    if (!header->mapped) {
+      ++header->references;
+    }
+  }
+  void ReleaseBrick(uint16_t *brick);
+  bool IsBrickShared(const uint16_t *brick) const {
+    const RunHeader *header = GetHeader(brick);
+    return header->references > 1 || header->interned || header->mapped;
+  }
+  uint16_t *UnshareBrick(uint16_t *brick);
+  uint16_t *InternBrick(uint16_t *brick);
+
+  // Returns the aggregate of a block, which is stored with its children or
+  // voxels, or follows from the value of a leaf.
+  BlockAggregate GetAggregate(const Block &block) const;
+  // Recomputes the aggregate of a block from its children or voxels, whose
+  // aggregates must be up to date. Shared blocks are left as they are, since
+  // they were up to date before they became shared.
+  void UpdateAggregate(const Block &block);
+
+  bool deduplicates() const { return deduplicates_; }
+  void set_deduplicates(bool deduplicates);
+
+  // Maps the runs and bricks of another pool to their copies in this one.
+  typedef std::unordered_map<const void *, void *> CopyMap;
+  // Returns a copy of a tree from another pool, with its runs and bricks
+  // allocated in depth-first order. Runs and bricks shared between trees
+  // copied with the same map stay shared.
+  Block CopyTree(const Block &root, CopyMap *copies);
+  // Writes a tree as an image, which starts with a run of just the root
+  // followed by the runs and bricks below it in depth-first order. Shared
+  // runs and bricks are written once. Returns false if writing fails.
+  static bool WriteImage(const Block &root, std::ostream *stream);
+  // Returns the root of an image in memory, which must be aligned for
+  // blocks and at least kMinImageBytes long.
+  static const Block *GetImageRoot(const char *image) {
+    return reinterpret_cast<const Block *>(image + sizeof(RunHeader));
+  }
+  static const size_t kMinImageBytes;
+
+  // Exchanges all blocks and settings with another pool.
+  void Swap(BlockPool *other);
+
+  // Frees every run at once without visiting the blocks. Any block
+  // allocated from the pool is invalid afterwards.
+  void Reset();
+
+  size_t num_live_blocks() const { return num_live_blocks_; }
+  size_t peak_live_blocks() const { return peak_live_blocks_; }
+  size_t num_interned_runs() const { return interned_runs_.size(); }
+  size_t num_live_bricks() const { return num_live_bricks_; }
+  // The bytes of runs and bricks in use, and the bytes of the slabs they are
+  // allocated from, which also counts the freed ones.
+  size_t num_used_bytes() const { return num_used_bytes_; }
+  size_t num_reserved_bytes() const { return slabs_.size() * kSlabSize; }
+  size_t num_interned_bricks() const { return interned_bricks_.size(); }
+
+ private:
+  static const size_t kSlabSize = 512 * 1024;
+
+  // Stored in front of the blocks of every run.
+  struct RunHeader {
+    uint32_t references;
+    uint8_t size;
+    bool interned;
+    // The child mask of the block that owns the run, as of the last update
+    // of the aggregate.
+    uint8_t child_mask;
+    // Set for runs of an image that is used in place.
+    bool mapped;
+    BlockAggregate aggregate;
+  };
+  static_assert(sizeof(RunHeader) % alignof(Block) == 0,
+                "Blocks must stay aligned after the run header");
+
+  // The positions of the runs and bricks of a tree in an image, relative to
+  // its start, and the blocks they belong to in the order they are written.
+  struct ImageLayout {
+    std::unordered_map<const void *, uint64_t> positions;
+    std::vector<const Block *> owners;
+    uint64_t size;
+  };
+
+  struct FreeListEntry {
+    FreeListEntry *next;
+  };
+
+  struct RunHash {
+    size_t operator()(const Block *run) const;
+  };
+  struct RunEqual {
+    bool operator()(const Block *run1, const Block *run2) const;
+  };
+  struct BrickHash {
+    size_t operator()(const uint16_t *brick) const;
+  };
+  struct BrickEqual {
+    bool operator()(const uint16_t *brick1, const uint16_t *brick2) const;
+  };
+
+  static RunHeader *GetHeader(Block *run) {
+    return reinterpret_cast<RunHeader *>(run) - 1;
+  }
+  static const RunHeader *GetHeader(const Block *run) {
+    return reinterpret_cast<const RunHeader *>(run) - 1;
+  }
+  static RunHeader *GetHeader(uint16_t *brick) {
+    return reinterpret_cast<RunHeader *>(brick) - 1;
+  }
+  static const RunHeader *GetHeader(const uint16_t *brick) {
+    return reinterpret_cast<const RunHeader *>(brick) - 1;
+  }
+
+  static size_t GetRunBytes(int size) {
+    return sizeof(RunHeader) + sizeof(Block) * size;
+  }
+  static size_t GetBrickBytes() {
+    return sizeof(RunHeader) + sizeof(uint16_t) * Block::kBrickVolume;
+  }
+  static_assert((sizeof(RunHeader) + sizeof(uint16_t) * Block::kBrickVolume) %
+                    alignof(Block) == 0,
+                "Runs must stay aligned after a brick");
+
+  void *AllocateMemory(size_t bytes, FreeListEntry **free_list);
+  void FreeMemory(RunHeader *header, size_t bytes, FreeListEntry **free_list);
+  BlockAggregate SummarizeVoxels(const uint16_t *brick) const;
+  Block *CopyRun(const Block *run, CopyMap *copies);
+  uint16_t *CopyBrick(const uint16_t *brick, CopyMap *copies);
+  void FreeRunMemory(RunHeader *header);
+  void Unintern(Block *run);
+  void UninternBrick(uint16_t *brick);
+  // Retains or releases the children or voxels of a block.
+  void RetainContents(const Block &block);
+  void ReleaseContents(const Block &block);
+  void FreeSlabs();
+  static void LayOutImage(const Block &block, ImageLayout *layout);
+  static void WriteImageHeader(const RunHeader &header,
+                               std::ostream *stream);
+  static void WriteImageBlock(const Block &block, uint64_t position,
+                              const ImageLayout &layout,
+                              std::ostream *stream);
+
+  const Palette *palette_;
+  std::vector<char *> slabs_;
+  size_t slab_bytes_used_;
+  FreeListEntry *free_runs_[Block::kNumChildren + 1];
+  FreeListEntry *free_bricks_;
+
+  bool deduplicates_;
+  std::unordered_set<Block *, RunHash, RunEqual> interned_runs_;
+  std::unordered_set<uint16_t *, BrickHash, BrickEqual> interned_bricks_;
+
+  size_t num_live_blocks_;
+  size_t peak_live_blocks_;
+  size_t num_live_bricks_;
+  size_t num_used_bytes_;
+};
+
+#endif  // BLOCK_POOL_H_
@@ -0,0 +1,209 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#ifndef BLOCK_TRAVERSAL_H_
+#define BLOCK_TRAVERSAL_H_
+
+#include <cassert>
+
+#include "glm/glm.hpp"
+
+#include "block.h"
+#include "locational_code.h"
+
+// Depth-first octree traversals that use an explicit stack instead of
+// recursion. A visitor is called with a TraversalNode for each block and
+// decides how the traversal continues with its return value.
+
+enum class TraversalResult {
+  kContinue,      // Visit the children of the block.
+  kSkipChildren,  // Skip the children of the block.
+  kStop,          // Stop the traversal.
+};
+
+// The offsets of the corner of a child from the corner of its parent, in
+// halves of the parent size, following the child order of Block.
+constexpr int ChildOffsetX(int index) { return index & 1; }
+constexpr int ChildOffsetY(int index) { return (~index >> 2) & 1; }
+constexpr int ChildOffsetZ(int index) { return (~index >> 1) & 1; }
+
+// Returns the index of the child of a block that contains the point, or the
+// child nearest to it if the point is outside the block.
+inline int GetNearestChild(glm::vec3 corner, float size, glm::vec3 point) {
+  glm::vec3 center = corner + size / 2.0f;
+  return (point.x >= center.x ? 1 : 0) |
+         (point.z >= center.z ? 0 : 2) |
+         (point.y >= center.y ? 0 : 4);
+}
+
+template <typename BlockType>
+struct TraversalNode {
+  BlockType *block;
+  glm::vec3 corner;
+  float size;
+  int depth;
+};
+
+// A fixed size stack that fits a traversal of the deepest possible tree.
+template <typename Entry>
+class TraversalStack {
+ public:
+  static const int kMaxSize =
+      Block::kNumChildren * (LocationalCode::kMaxDimension + 1) + 1;
+
+  TraversalStack() : size_(0) {}
+
+  bool empty() const { return size_ == 0; }
+  Entry &top() { return entries_[size_ - 1]; }
+
+  void Push(const Entry &entry) {
+    assert(size_ < kMaxSize);
+    entries_[size_++] = entry;
+  }
+  void Pop() { --size_; }
+
+ private:
+  Entry entries_[kMaxSize];
+  int size_;
+};
+
+template <typename BlockType>
+inline TraversalNode<BlockType> GetChildNode(
+    const TraversalNode<BlockType> &node, BlockType *child, int index) {
+  TraversalNode<BlockType> child_node;
+  child_node.block = child;
+  child_node.size = node.size / 2.0f;
+  child_node.corner = node.corner + child_node.size *
+      glm::vec3(ChildOffsetX(index), ChildOffsetY(index),
+                ChildOffsetZ(index));
+  child_node.depth = node.depth + 1;
+  return child_node;
+}
+
+// Visits the blocks of a tree in pre-order, parents before their children
+// and children in index order. If front_to_back is set, children are instead
+// visited in order of distance from the point, so that nearer blocks are
+// visited first. Returns false if the visitor stopped the traversal.
+template <typename BlockType, typename Visitor>
+bool TraverseBlocks(BlockType *root, glm::vec3 corner, float size,
+                    bool front_to_back, glm::vec3 point, Visitor &&visitor) {
+  TraversalStack<TraversalNode<BlockType>> stack;
+  TraversalNode<BlockType> root_node = {root, corner, size, 0};
+  stack.Push(root_node);
+
+  while (!stack.empty()) {
+    TraversalNode<BlockType> node = stack.top();
+    stack.Pop();
+
+    TraversalResult result = visitor(node);
+    if (result == TraversalResult::kStop) {
+      return false;
+    }
+    if (result == TraversalResult::kSkipChildren || node.block->is_leaf()) {
+      continue;
+    }
+
+    // Reversing the order of each child index bit mirrors the order along
+    // that axis, so starting at the nearest child orders them front to back.
+    int first = front_to_back ? GetNearestChild(node.corner, node.size, point)
+                              : 0;
+    for (int i = Block::kNumChildren - 1; i >= 0; --i) {
+      int index = first ^ i;
+      BlockType *child = node.block->child(index);
+      if (child) {
+        stack.Push(GetChildNode(node, child, index));
+      }
+    }
+  }
+  return true;
+}
+
+template <typename BlockType, typename Visitor>
+bool TraverseBlocks(BlockType *root, glm::vec3 corner, float size,
+                    Visitor &&visitor) {
+  return TraverseBlocks(root, corner, size, false, glm::vec3(0.0f),
+                        visitor);
+}
+
+template <typename BlockType, typename Visitor>
+bool TraverseBlocksFrontToBack(BlockType *root, glm::vec3 corner, float size,
+                               glm::vec3 point, Visitor &&visitor) {
+  return TraverseBlocks(root, corner, size, true, point, visitor);
+}
+
+// Visits the blocks of a tree calling enter before the children of a block
+// and leave after them. Leave is called for every block that enter returned
+// kContinue for, so children are done before their parent, as when changing
+// a tree bottom-up. Returns false if enter stopped the traversal.
+template <typename BlockType, typename EnterVisitor, typename LeaveVisitor>
+bool TraverseBlocksPostOrder(BlockType *root, glm::vec3 corner, float size,
+                             EnterVisitor &&enter, LeaveVisitor &&leave) {
+  struct Entry {
+    TraversalNode<BlockType> node;
+    bool entered;
+  };
+  TraversalStack<Entry> stack;
+  Entry root_entry = {{root, corner, size, 0}, false};
+  stack.Push(root_entry);
+
+  while (!stack.empty()) {
+    Entry &entry = stack.top();
+    if (entry.entered) {
+      TraversalNode<BlockType> node = entry.node;
+      stack.Pop();
+      leave(node);
+      continue;
+    }
+
+    entry.entered = true;
+    TraversalNode<BlockType> node = entry.node;
+    TraversalResult result = enter(node);
+    if (result == TraversalResult::kStop) {
+      return false;
+    }
+    if (result == TraversalResult::kSkipChildren) {
+      stack.Pop();
+      continue;
+    }
+    for (int i = Block::kNumChildren - 1; i >= 0; --i) {
+      BlockType *child = node.block->child(i);
+      if (child) {
+        Entry child_entry = {GetChildNode(node, child, i), false};
+        stack.Push(child_entry);
+      }
+    }
+  }
+  return true;
+}
+
+// Calls the visitor with the value, corner and size of every voxel of a
+// brick that isn't empty, scanning the voxels in memory order.
+template <typename Visitor>
+void VisitVoxels(const Block &brick, glm::vec3 corner, float size,
+                 Visitor &&visitor) {
+  const uint16_t *voxels = brick.voxels();
+  float voxel_size = size / Block::kBrickSize;
+  for (int z = 0, i = 0; z < Block::kBrickSize; ++z) {
+    for (int y = 0; y < Block::kBrickSize; ++y) {
+      for (int x = 0; x < Block::kBrickSize; ++x, ++i) {
+        if (voxels[i]) {
+          visitor(voxels[i], corner + voxel_size * glm::vec3(x, y, z),
+                  voxel_size);
+        }
+      }
+    }
+  }
+}
+
+#endif  // BLOCK_TRAVERSAL_H_
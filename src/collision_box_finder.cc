@@ -0,0 +1,161 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "collision_box_finder.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "block_traversal.h"
+
+namespace {
+
+// How long the thread waits before looking for a newer snapshot again.
+const int kSnapshotPollMs = 1;
+
+// Finds the boxes in the block with the given code, where a change inside a
+// leaf or a brick covers all of it.
+CollisionBoxFinder::Region FindRegion(const Block &root,
+                                      LocationalCode code) {
+  int dimension = code.dimension();
+  const Block *block = &root;
+  CollisionBoxFinder::Region region;
+  for (int i = 0; i < dimension && block && !block->is_leaf() &&
+                  !block->is_brick(); ++i) {
+    int index = code.child_index(i, dimension);
+    block = block->child(index);
+    region.code = region.code.child(index);
+  }
+  if (!block) {
+    return region;
+  }
+
+  uint32_t x;
+  uint32_t y;
+  uint32_t z;
+  region.code.GetCoordinates(&x, &y, &z);
+  uint32_t size = 1u << (World::kMaxDimension - region.code.dimension());
+  std::vector<CollisionBoxFinder::Box> *boxes = &region.boxes;
+  TraverseBlocks(
+      block, glm::vec3(x, y, z) * static_cast<float>(size),
+      static_cast<float>(size),
+      [boxes](const TraversalNode<const Block> &node) {
+        if (node.block->is_brick()) {
+          VisitVoxels(*node.block, node.corner, node.size,
+                      [boxes](uint16_t, glm::vec3 corner, float size) {
+                        boxes->push_back({corner, size});
+                      });
+        } else if (node.block->value() != Palette::kEmptyIndex) {
+          boxes->push_back({node.corner, node.size});
+        }
+        return TraversalResult::kContinue;
+      });
+  return region;
+}
+
+}  // namespace
+
+CollisionBoxFinder::CollisionBoxFinder(SnapshotPublisher *publisher)
+    : publisher_(publisher), finding_(false), stopping_(false),
+      num_clears_(0),
+      finding_thread_(&CollisionBoxFinder::RunFindingThread, this) {}
+
+CollisionBoxFinder::~CollisionBoxFinder() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_condition_.notify_one();
+  finding_thread_.join();
+}
+
+void CollisionBoxFinder::Add(const std::vector<WorldChange> &changes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_changes_.insert(queued_changes_.end(), changes.begin(),
+                           changes.end());
+  }
+  queued_condition_.notify_one();
+}
+
+void CollisionBoxFinder::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_condition_.wait(
+      lock, [this] { return queued_changes_.empty() && !finding_; });
+}
+
+void CollisionBoxFinder::TakeRegions(std::vector<Region> *regions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Region &region : found_regions_) {
+    regions->push_back(std::move(region));
+  }
+  found_regions_.clear();
+}
+
+void CollisionBoxFinder::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queued_changes_.clear();
+  found_regions_.clear();
+  // Regions being found now are dropped once they are.
+  ++num_clears_;
+}
+
+void CollisionBoxFinder::RunFindingThread() {
+  SnapshotPublisher::Reader reader(publisher_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queued_condition_.wait(
+        lock, [this] { return stopping_ || !queued_changes_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    std::vector<WorldChange> changes(queued_changes_.begin(),
+                                     queued_changes_.end());
+    queued_changes_.clear();
+    uint64_t num_clears = num_clears_;
+    finding_ = true;
+    lock.unlock();
+
+    uint64_t generation = 0;
+    for (const WorldChange &change : changes) {
+      generation = std::max(generation, change.generation);
+    }
+    // The changes may be queued just before their snapshot is published.
+    const SnapshotPublisher::Snapshot *snapshot = reader.Lock();
+    while ((!snapshot || snapshot->world_generation < generation) &&
+           !stopping_ && num_clears_ == num_clears) {
+      reader.Unlock();
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(kSnapshotPollMs));
+      snapshot = reader.Lock();
+    }
+    std::vector<Region> regions;
+    if (snapshot && snapshot->world_generation >= generation) {
+      for (const WorldChange &change : changes) {
+        regions.push_back(FindRegion(snapshot->root, change.code));
+      }
+    }
+    reader.Unlock();
+
+    lock.lock();
+    if (num_clears_ == num_clears && !stopping_) {
+      for (Region &region : regions) {
+        found_regions_.push_back(std::move(region));
+      }
+    }
+    finding_ = false;
+    idle_condition_.notify_all();
+  }
+}
@@ -0,0 +1,92 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef COLLISION_BOX_FINDER_H_
+#define COLLISION_BOX_FINDER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "locational_code.h"
+#include "snapshot_publisher.h"
+#include "world.h"
+
+// Finds the boxes of the solid blocks in the regions of a world that
+// changed, on a background thread that reads the snapshots a
+// SnapshotPublisher publishes. The editing thread only queues the changes
+// and swaps in the boxes, while the traversal of the changed blocks, which
+// covers the whole world after it's loaded, happens off of it.
+class CollisionBoxFinder {
+ public:
+  // A cube given in units of the deepest blocks, where all corners are
+  // exact.
+  struct Box {
+    glm::vec3 corner;
+    float size;
+  };
+
+  // The boxes inside a block, which replace all earlier boxes inside it.
+  struct Region {
+    LocationalCode code;
+    std::vector<Box> boxes;
+  };
+
+  explicit CollisionBoxFinder(SnapshotPublisher *publisher);
+  // Stops the thread, dropping any work that is left.
+  ~CollisionBoxFinder();
+
+  // Queues changes of the world. Their boxes are found in a snapshot at
+  // least as new as the changes, so they must be published before long.
+  void Add(const std::vector<WorldChange> &changes);
+  // Waits until the boxes of every queued change are found. The changes
+  // must already be published.
+  void Wait();
+  // Moves the regions found so far into the given vector, in the order of
+  // their changes.
+  void TakeRegions(std::vector<Region> *regions);
+  // Drops the queued changes and the regions that weren't taken, such as
+  // before the world is replaced.
+  void Clear();
+
+ private:
+  CollisionBoxFinder(const CollisionBoxFinder &) = delete;
+  CollisionBoxFinder &operator=(const CollisionBoxFinder &) = delete;
+
+  void RunFindingThread();
+
+  SnapshotPublisher *publisher_;
+
+  std::mutex mutex_;
+  // Signaled when changes are queued or the thread is stopped.
+  std::condition_variable queued_condition_;
+  // Signaled when the thread is done with the changes it took.
+  std::condition_variable idle_condition_;
+  std::deque<WorldChange> queued_changes_;
+  std::vector<Region> found_regions_;
+  bool finding_;
+  // Read without the mutex by the thread while it waits for a snapshot.
+  std::atomic<bool> stopping_;
+  std::atomic<uint64_t> num_clears_;
+  std::thread finding_thread_;
+};
+
+#endif  // COLLISION_BOX_FINDER_H_
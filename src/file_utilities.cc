@@ -0,0 +1,57 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "file_utilities.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+void MakeDirectory(const std::string &path) {
+#ifdef _WIN32
+  _mkdir(path.c_str());
+#else
+  mkdir(path.c_str(), 0755);
+#endif
+}
+
+bool ReplaceFile(const std::string &new_path, const std::string &path) {
+  // Renaming over an existing file fails on some systems.
+  if (std::rename(new_path.c_str(), path.c_str()) != 0) {
+    std::remove(path.c_str());
+    if (std::rename(new_path.c_str(), path.c_str()) != 0) {
+      std::remove(new_path.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReadFile(const std::string &path, std::string *data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  *data = buffer.str();
+  return true;
+}
@@ -0,0 +1,61 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef FILE_UTILITIES_H_
+#define FILE_UTILITIES_H_
+
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Creates a directory unless it already exists.
+void MakeDirectory(const std::string &path);
+
+// Moves a new file over an existing one, which may be mapped or being read.
+// Returns false and removes the new file if it can't be moved.
+bool ReplaceFile(const std::string &new_path, const std::string &path);
+
+// Reads the whole contents of a file. Returns false if it can't be opened.
+bool ReadFile(const std::string &path, std::string *data);
+
+// Reads a value in the byte order of the machine from the data at the
+// position, which is moved past it. Returns false if the value doesn't fit
+// before the end.
+template <typename T>
+bool ReadValue(const std::string &data, size_t *position, size_t end,
+               T *value) {
+  if (end - *position < sizeof(*value)) {
+    return false;
+  }
+  std::memcpy(value, &data[*position], sizeof(*value));
+  *position += sizeof(*value);
+  return true;
+}
+
+// Writes and reads values in the byte order of the machine.
+template <typename T>
+void WriteValue(std::ostream *stream, T value) {
+  stream->write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+bool ReadValue(std::istream *stream, T *value) {
+  return static_cast<bool>(
+      stream->read(reinterpret_cast<char *>(value), sizeof(*value)));
+}
+
+#endif  // FILE_UTILITIES_H_
@@ -15,11 +15,12 @@
 
 #include "fractals.h"
 
-void SimpleFractal(Block *block, int depth) {
+void SimpleFractal(Block *block, int depth, BlockPool *pool) {
   if (depth <= 0) {
     return;
   }
-  block->set_child(depth % 2 == 0 ? 0 : 7, new Block(100));
-  block->set_child(depth % 2 == 0 ? 7 : 0, new Block());
-  SimpleFractal(block->child(depth % 2 == 0 ? 7 : 0), depth - 1);
+  block->AddChild(depth % 2 == 0 ? 0 : 7, pool)->SetValue(100, pool);
+  Block *child = block->AddChild(depth % 2 == 0 ? 7 : 0, pool);
+  child->SetValue(0, pool);
+  SimpleFractal(child, depth - 1, pool);
 }
@@ -17,7 +17,8 @@
 #define FRACTALS_H_
 
 #include "block.h"
+#include "block_pool.h"
 
-void SimpleFractal(Block *block, int depth);
+void SimpleFractal(Block *block, int depth, BlockPool *pool);
 
 #endif  // FRACTALS_H_
@@ -21,7 +21,9 @@
 
 #include "glm/gtx/transform.hpp"
 
+#include "block_traversal.h"
 #include "utilities.h"
+#include "voxel_import.h"
 
 static const float kMouseSensitivity = 0.003f;
 
@@ -51,6 +53,42 @@ static const int kDefaultColor = kColor1;
 
 static const double kBlockInterval = 0.25;
 
+// Subtrees that are smaller than this fraction of their distance from the
+// camera are drawn as a single box with their mean color.
+static const float kLodSizeRatio = 0.005f;
+
+static const bool kDeduplicateWorld = true;
+static const bool kIndexWorld = false;
+static const bool kUseWideTree = false;
+// Store the two smallest block dimensions the player can build with as
+// dense bricks instead of blocks.
+static const int kWorldBrickDimension =
+    kMinBlockDimension - Block::kBrickDimension;
+static const size_t kMaxUndoSteps = 500;
+// Saved as an image, which is mapped on loading instead of read.
+static const char kWorldPath[] = "world.sbi";
+// Compact the block pool once it has grown past this size and less than
+// half of it is in use.
+static const size_t kMinDefragmentBytes = 2 * 1024 * 1024;
+// Streamed worlds are split into regions of this dimension, which are kept
+// in memory up to the budget.
+static const char kRegionPath[] = "world_regions";
+static const int kRegionDimension = 4;
+static const size_t kStreamingBudget = 256 * 1024 * 1024;
+// Edits are journaled here as they happen, and the world is recovered from
+// it on startup. Streamed worlds aren't journaled.
+static const char kJournalPath[] = "world_journal";
+// The world is saved in the background this often, in seconds, once it has
+// been edited since it was last generated, loaded or saved.
+static const double kAutosaveInterval = 60.0;
+// A MagicaVoxel model imported into the targeted block, in voxels of the
+// smallest blocks.
+static const char kImportPath[] = "import.vox";
+// A Wavefront mesh imported into the targeted block in the current color,
+// scaled to fit it and filled, which assumes that it is closed.
+static const char kMeshImportPath[] = "import.obj";
+static const bool kFillImportedMeshes = true;
+
 Game::Game(Window *window, Renderer *renderer, InputSystem *input)
     : window_(window), renderer_(renderer), input_(input),
       window_focused_(false),
@@ -68,8 +106,16 @@ Game::Game(Window *window, Renderer *renderer, InputSystem *input)
       placing_(false),
       block_interval_(kBlockInterval), last_block_time_(0.0),
       ray_cast_hit_(),
-      world_(),
-      world_changed_(false),
+      has_box_corner_(false), box_corner_(0.0f),
+      world_(kWorldSize),
+      history_(&world_, kMaxUndoSteps),
+      publisher_(&world_),
+      collision_box_finder_(&publisher_),
+      streamer_(&world_, kStreamingBudget),
+      journal_(&world_),
+      saver_(&world_),
+      last_save_time_(0.0),
+      saved_generation_(0),
       world_bodies_(),
       block_geometry_(),
       block_material_(),
@@ -97,18 +143,17 @@ Game::~Game()
   delete highlight_mesh_;
   delete crosshair_mesh_;
 
-  delete world_;
-
   delete player_body_;
-  for (Body *body : world_bodies_)
+  for (const auto &entry : world_bodies_)
   {
-    delete body;
+    delete entry.second;
   }
 }
 
 bool Game::Initialize()
 {
   input_->AddListener(this);
+  world_.AddListener(this);
 
   window_->Maximize();
   FocusWindow();
@@ -172,7 +217,7 @@ bool Game::Initialize()
 
   // Create world
 
-  GenerateWorld();
+  RecoverWorld();
 
   BoxBody *world_body =
       new BoxBody(glm::vec3(kWorldSize, kWorldSize / 2.0f, kWorldSize));
@@ -240,13 +285,15 @@ void Game::Update(float delta_time)
   speed_ *= glm::pow(2.0f, -size_dimension_);
 
   UpdatePlayer(delta_time);
+  streamer_.Update(player_body_->position(), player_body_->size().y);
+  journal_.Update();
 
   ray_cast_hit_ = RayCastBlock();
 
   player_body_->Update(delta_time);
-  for (Body *body : world_bodies_)
+  for (const auto &entry : world_bodies_)
   {
-    body->Update(delta_time);
+    entry.second->Update(delta_time);
   }
 
   HandleCollisions();
@@ -263,6 +310,28 @@ void Game::Update(float delta_time)
     last_block_time_ = time;
   }
 
+  if (saver_.Update())
+  {
+    const WorldSaver::Stats &stats = saver_.last_stats();
+    if (stats.succeeded)
+    {
+      std::cout << "Saved world to " << kWorldPath << ": "
+                << stats.num_bytes / 1000000.0 << " MB, started in "
+                << stats.start_ms << " ms, written in " << stats.write_ms
+                << " ms\n";
+    }
+    else
+    {
+      std::cerr << "Failed to save world to " << kWorldPath << "\n";
+    }
+  }
+  // Streamed worlds write back their own regions.
+  if (time - last_save_time_ >= kAutosaveInterval && !streamer_.is_open() &&
+      world_.generation() != saved_generation_)
+  {
+    SaveWorld();
+  }
+
   if (ray_cast_hit_.block)
   {
     highlight_mesh_->set_hidden(false);
@@ -286,11 +355,33 @@ void Game::Update(float delta_time)
     highlight_mesh_->set_hidden(true);
   }
 
-  if (world_changed_)
+  if (world_.has_changes())
   {
-    UpdateWorldCollisionBodies();
-    world_changed_ = false;
+    const BlockPool &pool = world_.pool();
+    // Blocks a running save is reading can't be moved.
+    if (pool.num_reserved_bytes() > kMinDefragmentBytes &&
+        pool.num_used_bytes() * 2 < pool.num_reserved_bytes() &&
+        !saver_.is_saving())
+    {
+      DefragmentWorld();
+    }
+    // Listeners may read the changes from the published snapshot.
+    publisher_.Publish();
+    world_.NotifyListeners();
   }
+  UpdateWorldCollisionBodies();
+}
+
+void Game::DefragmentWorld()
+{
+  // Readers may still hold published snapshots, so drop them before their
+  // blocks are moved, and so may a base being written.
+  publisher_.Clear();
+  journal_.FinishCompaction();
+  std::vector<Block *> snapshots;
+  streamer_.GetSnapshots(&snapshots);
+  history_.DefragmentWorld(snapshots);
+  ray_cast_hit_.block = nullptr;
 }
 
 void Game::UpdatePlayer(float delta_time)
@@ -369,9 +460,9 @@ void Game::UpdatePlayer(float delta_time)
 void Game::HandleCollisions()
 {
   Body *body1 = player_body_;
-  for (size_t i = 0; i < world_bodies_.size(); ++i)
+  for (const auto &entry : world_bodies_)
   {
-    BoxBody *body2 = world_bodies_[i];
+    BoxBody *body2 = entry.second;
     if (body1->CollidesWith(body2) &&
         !(body1->is_fixed() && body2->is_fixed()))
     {
@@ -382,9 +473,9 @@ void Game::HandleCollisions()
 
 bool Game::PlayerCollidesWithWorld() const
 {
-  for (size_t i = 0; i < world_bodies_.size(); ++i)
+  for (const auto &entry : world_bodies_)
   {
-    BoxBody *body = world_bodies_[i];
+    BoxBody *body = entry.second;
     if (player_body_->CollidesWith(body))
     {
       return true;
@@ -472,65 +563,182 @@ void Game::ResolveBoxCollision(Body *body1, Body *body2)
   }
 }
 
+void Game::WorldChanged(const std::vector<WorldChange> &changes)
+{
+  collision_box_finder_.Add(changes);
+  // Without the bodies of a new world, the player would fall through it.
+  for (const WorldChange &change : changes)
+  {
+    if (change.code == LocationalCode())
+    {
+      collision_box_finder_.Wait();
+      UpdateWorldCollisionBodies();
+      break;
+    }
+  }
+}
+
 void Game::UpdateWorldCollisionBodies()
 {
-  for (Body *body : world_bodies_)
+  std::vector<CollisionBoxFinder::Region> regions;
+  collision_box_finder_.TakeRegions(&regions);
+  for (const CollisionBoxFinder::Region &region : regions)
+  {
+    // The bodies are keyed by the code of the deepest block at their corner,
+    // so the bodies inside a block are a range of keys.
+    auto first = world_bodies_.lower_bound(
+        region.code.first_descendant(World::kMaxDimension).value());
+    auto last = world_bodies_.upper_bound(
+        region.code.last_descendant(World::kMaxDimension).value());
+    for (auto it = first; it != last; ++it)
+    {
+      delete it->second;
+    }
+    world_bodies_.erase(first, last);
+    for (const CollisionBoxFinder::Box &box : region.boxes)
+    {
+      AddWorldCollisionBody(box.corner, box.size);
+    }
+  }
+}
+
+void Game::AddWorldCollisionBody(glm::vec3 corner, float size)
+{
+  LocationalCode code = LocationalCode::FromCoordinates(
+      static_cast<uint32_t>(corner.x), static_cast<uint32_t>(corner.y),
+      static_cast<uint32_t>(corner.z), World::kMaxDimension);
+  float scale =
+      kWorldSize / static_cast<float>(1u << World::kMaxDimension);
+  BoxBody *body = new BoxBody(glm::vec3(size * scale));
+  body->set_fixed(true);
+  body->position() = (corner + size / 2.0f) * scale;
+  world_bodies_[code.value()] = body;
+}
+
+void Game::RecoverWorld()
+{
+  ConfigureWorld();
+  if (!journal_.Recover(kJournalPath))
+  {
+    GenerateWorld();
+    return;
+  }
+  world_.SetBrickDimension(kWorldBrickDimension);
+  saved_generation_ = world_.generation();
+}
+
+void Game::GenerateWorld()
+{
+  FinishSave();
+  // Drop the previous world in one go instead of freeing block by block.
+  history_.Clear();
+  collision_box_finder_.Clear();
+  publisher_.Clear();
+  CloseStream();
+  StopJournal();
+  world_.Clear();
+  ConfigureWorld();
+
+  float half_size = kWorldSize / 2.0f;
+  world_.SetBlock(0.0f, 0.0f, half_size, 1, kColor3);
+  world_.SetBlock(half_size, 0.0f, half_size, 1, kColor2);
+  world_.SetBlock(0.0f, 0.0f, 0.0f, 1, kColor4);
+  world_.SetBlock(half_size, 0.0f, 0.0f, 1, kColor5);
+  journal_.Start(kJournalPath);
+  saved_generation_ = world_.generation();
+}
+
+void Game::ConfigureWorld()
+{
+  world_.SetDeduplicates(kDeduplicateWorld);
+  world_.SetIndexed(kIndexWorld);
+  world_.SetUsesWideTree(kUseWideTree);
+  world_.SetBrickDimension(kWorldBrickDimension);
+}
+
+void Game::SaveWorld()
+{
+  // A save started before gets to finish first, so that saves land in the
+  // order they were made.
+  FinishSave();
+  saver_.Save(kWorldPath);
+  last_save_time_ = input_->GetTime();
+  saved_generation_ = world_.generation();
+}
+
+void Game::LoadWorld()
+{
+  FinishSave();
+  history_.Clear();
+  collision_box_finder_.Clear();
+  publisher_.Clear();
+  CloseStream();
+  StopJournal();
+  ray_cast_hit_.block = nullptr;
+  if (!world_.LoadImage(kWorldPath))
   {
-    delete body;
+    std::cerr << "Failed to load world from " << kWorldPath << "\n";
+    GenerateWorld();
+    return;
   }
-  world_bodies_.clear();
-  AddWorldCollisionBody(world_, 0.0f, 0.0f, 0.0f, kWorldSize);
+  // The journal links the image as its base, unless converting the bricks
+  // made the world differ from it.
+  bool converts_bricks = world_.brick_dimension() != kWorldBrickDimension;
+  world_.SetBrickDimension(kWorldBrickDimension);
+  journal_.Start(kJournalPath, converts_bricks ? "" : kWorldPath);
+  saved_generation_ = world_.generation();
 }
 
-void Game::AddWorldCollisionBody(Block *block, float x, float y, float z,
-                                 float size)
+void Game::SplitWorld()
 {
-  if (!block)
+  if (streamer_.is_open())
   {
     return;
   }
+  if (!WorldStreamer::WriteRegions(world_, kRegionDimension, kRegionPath))
+  {
+    std::cerr << "Failed to write regions to " << kRegionPath << "\n";
+  }
+}
 
-  if (block->value() != kNoValue)
+void Game::StreamWorld()
+{
+  FinishSave();
+  history_.Clear();
+  collision_box_finder_.Clear();
+  publisher_.Clear();
+  CloseStream();
+  StopJournal();
+  ray_cast_hit_.block = nullptr;
+  if (!streamer_.Open(kRegionPath))
   {
-    BoxBody *body = new BoxBody(glm::vec3(size));
-    body->set_fixed(true);
-    body->position() = glm::vec3(x + size / 2.0f, y + size / 2.0f,
-                                 z + size / 2.0f);
-    world_bodies_.push_back(body);
+    std::cerr << "Failed to stream world from " << kRegionPath << "\n";
+    GenerateWorld();
   }
+}
 
-  if (!block->is_leaf())
+void Game::CloseStream()
+{
+  if (!streamer_.Close())
   {
-    size /= 2;
-    AddWorldCollisionBody(
-        block->child(0), x, y + size, z + size, size);
-    AddWorldCollisionBody(
-        block->child(1), x + size, y + size, z + size, size);
-    AddWorldCollisionBody(
-        block->child(2), x, y + size, z, size);
-    AddWorldCollisionBody(
-        block->child(3), x + size, y + size, z, size);
+    std::cerr << "Failed to write regions to " << kRegionPath << "\n";
+  }
+}
 
-    AddWorldCollisionBody(
-        block->child(4), x, y, z + size, size);
-    AddWorldCollisionBody(
-        block->child(5), x + size, y, z + size, size);
-    AddWorldCollisionBody(
-        block->child(6), x, y, z, size);
-    AddWorldCollisionBody(
-        block->child(7), x + size, y, z, size);
+void Game::FinishSave()
+{
+  if (!saver_.Wait())
+  {
+    std::cerr << "Failed to save world to " << kWorldPath << "\n";
   }
 }
 
-void Game::GenerateWorld()
+void Game::StopJournal()
 {
-  delete world_;
-  world_ = new Block();
-  world_->set_child(4, new Block(kColor3));
-  world_->set_child(5, new Block(kColor2));
-  world_->set_child(6, new Block(kColor4));
-  world_->set_child(7, new Block(kColor5));
-  world_changed_ = true;
+  if (!journal_.Stop())
+  {
+    std::cerr << "Failed to journal world to " << kJournalPath << "\n";
+  }
 }
 
 void Game::PlaceBlock()
@@ -555,13 +763,92 @@ void Game::BreakBlock()
   }
 }
 
+void Game::BuildBox(bool placing)
+{
+  RayCastHit hit = RayCastBlock();
+  if (!hit.block)
+  {
+    return;
+  }
+  // Like single blocks, boxes are placed in front of the targeted blocks and
+  // broken at them.
+  glm::vec3 corner = placing ? hit.previous_position : hit.position;
+  if (!has_box_corner_)
+  {
+    box_corner_ = corner;
+    has_box_corner_ = true;
+    return;
+  }
+  has_box_corner_ = false;
+  // Spanning the centers of the corner blocks keeps rounding from reaching
+  // into the blocks next to them.
+  float half_block_size =
+      0.5f * kWorldSize * glm::pow(2.0f, static_cast<float>(-block_dimension_));
+  FillBox(glm::min(box_corner_, corner) + half_block_size,
+          glm::max(box_corner_, corner) + half_block_size, block_dimension_,
+          placing ? color_ : kNoValue);
+}
+
 void Game::CopyBlock()
 {
   RayCastHit hit = RayCastBlock();
   if (hit.block)
   {
-    color_ = hit.block->value();
+    color_ = world_.palette().color(hit.block->value());
+  }
+}
+
+void Game::ImportModel()
+{
+  LocationalCode code;
+  if (!TargetImportBlock(&code))
+  {
+    return;
+  }
+  Block snapshot = world_.TakeSnapshot();
+  if (!ImportVox(&world_, kImportPath, code, kMinBlockDimension))
+  {
+    std::cerr << "Failed to import model from " << kImportPath << "\n";
+  }
+  history_.Record(&snapshot);
+}
+
+void Game::ImportMesh()
+{
+  LocationalCode code;
+  if (!TargetImportBlock(&code))
+  {
+    return;
+  }
+  Block snapshot = world_.TakeSnapshot();
+  if (!ImportObj(&world_, kMeshImportPath, code, kMinBlockDimension, color_,
+                 kFillImportedMeshes))
+  {
+    std::cerr << "Failed to import mesh from " << kMeshImportPath << "\n";
+  }
+  history_.Record(&snapshot);
+}
+
+bool Game::TargetImportBlock(LocationalCode *code)
+{
+  RayCastHit hit = RayCastBlock();
+  if (!hit.block)
+  {
+    return false;
+  }
+  // Blocks below the bricks can't be replaced as a whole.
+  int dimension = glm::min(block_dimension_, kWorldBrickDimension);
+  if (!world_.GetCode(hit.previous_position.x, hit.previous_position.y,
+                      hit.previous_position.z, dimension, code))
+  {
+    return false;
   }
+  float block_size =
+      kWorldSize * glm::pow(2.0f, static_cast<float>(-dimension));
+  glm::vec3 block_min =
+      glm::floor(hit.previous_position / block_size) * block_size;
+  streamer_.LoadNow(block_min, block_min + block_size);
+  return true;
 }
 
 Game::RayCastHit Game::RayCastBlock()
@@ -581,9 +868,10 @@ Game::RayCastHit Game::RayCastBlock()
   for (int i = 0; i < num_steps; ++i)
   {
     int dimension;
-    Block *block = GetBlock(hit.position.x, hit.position.y, hit.position.z,
-                            &dimension);
-    if (block && (!block->is_leaf() || block->value() != kNoValue))
+    const Block *block = GetBlock(hit.position.x, hit.position.y,
+                                  hit.position.z, &dimension);
+    if (block &&
+        (!block->is_leaf() || block->value() != Palette::kEmptyIndex))
     {
       hit.block = block;
       hit.dimension = dimension;
@@ -609,170 +897,49 @@ Game::RayCastHit Game::RayCastBlock()
   return hit;
 }
 
-Block *Game::GetBlock(float x, float y, float z, int *dimension)
+const Block *Game::GetBlock(float x, float y, float z, int *dimension)
 {
-  if (x < 0.0f || y < 0.0f || z < 0.0f ||
-      x >= kWorldSize || y >= kWorldSize || z >= kWorldSize)
+  if (world_.indexed())
   {
-    return nullptr;
-  }
-
-  Block *block = world_;
-  *dimension = 0;
-  float size = kWorldSize;
-  float dx = 0.0f;
-  float dy = 0.0f;
-  float dz = 0.0f;
-
-  for (int i = 0;; ++i)
-  {
-    if (block->is_leaf())
-    {
-      break;
-    }
-
-    ++(*dimension);
-    size /= 2.0f;
-    float center_x = size + dx;
-    float center_y = size + dy;
-    float center_z = size + dz;
-
-    int index = 0;
-    if (x < center_x && y >= center_y && z >= center_z)
-    {
-      index = 0;
-      dy += size;
-      dz += size;
-    }
-    else if (x >= center_x && y >= center_y && z >= center_z)
-    {
-      index = 1;
-      dx += size;
-      dy += size;
-      dz += size;
-    }
-    else if (x < center_x && y >= center_y && z < center_z)
-    {
-      index = 2;
-      dy += size;
-    }
-    else if (x >= center_x && y >= center_y && z < center_z)
-    {
-      index = 3;
-      dx += size;
-      dy += size;
-    }
-    else if (x < center_x && y < center_y && z >= center_z)
-    {
-      index = 4;
-      dz += size;
-    }
-    else if (x >= center_x && y < center_y && z >= center_z)
-    {
-      index = 5;
-      dx += size;
-      dz += size;
-    }
-    else if (x < center_x && y < center_y && z < center_z)
-    {
-      index = 6;
-    }
-    else if (x >= center_x && y < center_y && z < center_z)
-    {
-      index = 7;
-      dx += size;
-    }
-
-    Block *child = block->child(index);
-    if (!child)
+    LocationalCode code;
+    if (!world_.GetCode(x, y, z, World::kMaxDimension, &code))
     {
       return nullptr;
     }
-    block = child;
+    return world_.FindBlock(code, dimension);
   }
-
-  return block;
+  return world_.GetBlock(x, y, z, dimension);
 }
 
 void Game::SetBlock(float x, float y, float z, int dimension, int value)
 {
-  if (x < 0.0f || y < 0.0f || z < 0.0f ||
-      x >= kWorldSize || y >= kWorldSize || z >= kWorldSize)
-  {
-    return;
-  }
-
-  Block *block = world_;
-  float size = kWorldSize;
-  float dx = 0.0f;
-  float dy = 0.0f;
-  float dz = 0.0f;
-
-  for (int i = 0; i < dimension; ++i)
-  {
-    size /= 2.0f;
-    float center_x = size + dx;
-    float center_y = size + dy;
-    float center_z = size + dz;
+  float block_size =
+      kWorldSize * glm::pow(2.0f, static_cast<float>(-dimension));
+  glm::vec3 block_min = glm::floor(glm::vec3(x, y, z) / block_size) *
+                        block_size;
+  streamer_.LoadNow(block_min, block_min + block_size);
+  Block snapshot = world_.TakeSnapshot();
+  world_.SetBlock(x, y, z, dimension, value);
+  history_.Record(&snapshot);
+}
 
-    int index = 0;
-    if (x < center_x && y >= center_y && z >= center_z)
-    {
-      index = 0;
-      dy += size;
-      dz += size;
-    }
-    else if (x >= center_x && y >= center_y && z >= center_z)
-    {
-      index = 1;
-      dx += size;
-      dy += size;
-      dz += size;
-    }
-    else if (x < center_x && y >= center_y && z < center_z)
-    {
-      index = 2;
-      dy += size;
-    }
-    else if (x >= center_x && y >= center_y && z < center_z)
-    {
-      index = 3;
-      dx += size;
-      dy += size;
-    }
-    else if (x < center_x && y < center_y && z >= center_z)
-    {
-      index = 4;
-      dz += size;
-    }
-    else if (x >= center_x && y < center_y && z >= center_z)
-    {
-      index = 5;
-      dx += size;
-      dz += size;
-    }
-    else if (x < center_x && y < center_y && z < center_z)
-    {
-      index = 6;
-    }
-    else if (x >= center_x && y < center_y && z < center_z)
-    {
-      index = 7;
-      dx += size;
-    }
+void Game::FillBox(const glm::vec3 &min, const glm::vec3 &max, int dimension,
+                   int value)
+{
+  streamer_.LoadNow(min, max);
+  Block snapshot = world_.TakeSnapshot();
+  world_.FillBox(min, max, dimension, value);
+  history_.Record(&snapshot);
+}
 
-    Block *child = block->child(index);
-    if (!child)
-    {
-      child = new Block(block->value());
-      block->set_child(index, child);
-    }
-    block = child;
-  }
+void Game::Undo()
+{
+  history_.Undo();
+}
 
-  block->set_value(value);
-  world_->Simplify();
-  world_changed_ = true;
+void Game::Redo()
+{
+  history_.Redo();
 }
 
 void Game::SetPlayerSize(int dimension)
@@ -853,7 +1020,41 @@ void Game::Render()
 
   renderer_->ClearScreen();
 
-  DrawBlock(world_, 0.0f, 0.0f, 0.0f, kWorldSize);
+  // Drawing nearer blocks first lets the depth test discard more fragments.
+  glm::vec3 camera_position = renderer_->camera_position();
+  TraverseBlocksFrontToBack(
+      &world_.root(), glm::vec3(0.0f), kWorldSize, camera_position,
+      [this, camera_position](const TraversalNode<const Block> &node)
+      {
+        glm::vec3 center = node.corner + glm::vec3(node.size / 2.0f);
+        if (!node.block->is_leaf() &&
+            node.size < kLodSizeRatio * glm::distance(camera_position, center))
+        {
+          BlockAggregate aggregate = world_.pool().GetAggregate(*node.block);
+          if (!aggregate.is_empty())
+          {
+            float scale = node.size / BlockAggregate::kBoundsScale;
+            glm::vec3 min(aggregate.min[0], aggregate.min[1], aggregate.min[2]);
+            glm::vec3 max(aggregate.max[0], aggregate.max[1], aggregate.max[2]);
+            DrawBox(aggregate.color, node.corner + min * scale,
+                    (max - min) * scale);
+          }
+          return TraversalResult::kSkipChildren;
+        }
+        if (node.block->is_brick())
+        {
+          VisitVoxels(*node.block, node.corner, node.size,
+                      [this](uint16_t value, glm::vec3 corner, float size)
+                      {
+                        DrawBlock(value, corner, size);
+                      });
+        }
+        else if (node.block->value() != Palette::kEmptyIndex)
+        {
+          DrawBlock(node.block->value(), node.corner, node.size);
+        }
+        return TraversalResult::kContinue;
+      });
 
   // Note: Draw transparent geometry and UI last.
 
@@ -870,45 +1071,28 @@ void Game::Render()
   renderer_->SwapBuffers();
 }
 
-void Game::DrawBlock(Block *block, float x, float y, float z, float size)
+void Game::DrawBlock(uint16_t value, glm::vec3 corner, float size)
 {
-  if (!block)
-  {
-    return;
-  }
-
-  if (block->value() != kNoValue)
-  {
-    glm::mat4 model_matrix(1.0f);
-    model_matrix = glm::scale(glm::vec3(size)) * model_matrix;
-    model_matrix = glm::translate(glm::vec3(x, y, z)) * model_matrix;
-    block_mesh_->set_model_matrix(model_matrix);
-
-    glUseProgram(block_shader_program_);
-    float r = static_cast<float>((block->value() >> 16) & 0xff) / 0xff;
-    float g = static_cast<float>((block->value() >> 8) & 0xff) / 0xff;
-    float b = static_cast<float>(block->value() & 0xff) / 0xff;
-    glUniform3f(glGetUniformLocation(block_shader_program_, "uColor"), r, g, b);
-    glUseProgram(0);
-
-    block_mesh_->set_wireframe(wireframe_);
+  DrawBox(world_.palette().color(value), corner, glm::vec3(size));
+}
 
-    renderer_->RenderMesh(block_mesh_);
-  }
+void Game::DrawBox(int color, glm::vec3 corner, glm::vec3 size)
+{
+  glm::mat4 model_matrix(1.0f);
+  model_matrix = glm::scale(size) * model_matrix;
+  model_matrix = glm::translate(corner) * model_matrix;
+  block_mesh_->set_model_matrix(model_matrix);
+
+  glUseProgram(block_shader_program_);
+  float r = static_cast<float>((color >> 16) & 0xff) / 0xff;
+  float g = static_cast<float>((color >> 8) & 0xff) / 0xff;
+  float b = static_cast<float>(color & 0xff) / 0xff;
+  glUniform3f(glGetUniformLocation(block_shader_program_, "uColor"), r, g, b);
+  glUseProgram(0);
 
-  if (!block->is_leaf())
-  {
-    size /= 2;
-    DrawBlock(block->child(0), x, y + size, z + size, size);
-    DrawBlock(block->child(1), x + size, y + size, z + size, size);
-    DrawBlock(block->child(2), x, y + size, z, size);
-    DrawBlock(block->child(3), x + size, y + size, z, size);
+  block_mesh_->set_wireframe(wireframe_);
 
-    DrawBlock(block->child(4), x, y, z + size, size);
-    DrawBlock(block->child(5), x + size, y, z + size, size);
-    DrawBlock(block->child(6), x, y, z, size);
-    DrawBlock(block->child(7), x + size, y, z, size);
-  }
+  renderer_->RenderMesh(block_mesh_);
 }
 
 void Game::MouseDown(int button)
@@ -973,9 +1157,22 @@ void Game::KeyDown(int key)
   {
     GrowSize();
   }
+  bool control_pressed = input_->KeyIsPressed(KEY_LEFT_CONTROL) ||
+                         input_->KeyIsPressed(KEY_RIGHT_CONTROL);
   if (key == KEY_Z)
   {
-    ShrinkBlock();
+    if (control_pressed)
+    {
+      Undo();
+    }
+    else
+    {
+      ShrinkBlock();
+    }
+  }
+  if (key == KEY_Y && control_pressed)
+  {
+    Redo();
   }
   if (key == KEY_C)
   {
@@ -1007,6 +1204,38 @@ void Game::KeyDown(int key)
   {
     GenerateWorld();
   }
+  if (key == KEY_F5)
+  {
+    SaveWorld();
+  }
+  if (key == KEY_F9)
+  {
+    LoadWorld();
+  }
+  if (key == KEY_F6)
+  {
+    SplitWorld();
+  }
+  if (key == KEY_F10)
+  {
+    StreamWorld();
+  }
+  if (key == KEY_F7)
+  {
+    ImportModel();
+  }
+  if (key == KEY_F8)
+  {
+    ImportMesh();
+  }
+  if (key == KEY_B)
+  {
+    BuildBox(true);
+  }
+  if (key == KEY_V)
+  {
+    BuildBox(false);
+  }
 
   if (key == KEY_G)
   {
@@ -16,6 +16,7 @@
 #ifndef GAME_H_
 #define GAME_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -23,17 +24,24 @@
 #include "glm/glm.hpp"
 
 #include "block.h"
+#include "collision_box_finder.h"
 #include "geometry.h"
 #include "input.h"
 #include "material.h"
 #include "renderer.h"
 #include "physics.h"
+#include "snapshot_publisher.h"
+#include "undo_history.h"
 #include "window.h"
+#include "world.h"
+#include "world_journal.h"
+#include "world_saver.h"
+#include "world_streamer.h"
 
-class Game : public InputListener {
+class Game : public InputListener, public WorldListener {
  public:
   struct RayCastHit {
-    Block *block;
+    const Block *block;
     int dimension;
     glm::vec3 position;
     glm::vec3 previous_position;
@@ -45,14 +53,29 @@ class Game : public InputListener {
   bool Initialize();
   void Run();
 
+  void RecoverWorld();
   void GenerateWorld();
+  void SaveWorld();
+  void LoadWorld();
+  void SplitWorld();
+  void StreamWorld();
 
   void PlaceBlock();
   void BreakBlock();
+  // Marks the targeted block as a corner of a box, or fills the box from
+  // the marked corner to it with blocks of the current size, in a single
+  // edit. Placing fills it with the current color, and breaking empties it.
+  void BuildBox(bool placing);
   void CopyBlock();
+  void ImportModel();
+  void ImportMesh();
   RayCastHit RayCastBlock();
-  Block *GetBlock(float x, float y, float z, int *dimension);
+  const Block *GetBlock(float x, float y, float z, int *dimension);
   void SetBlock(float x, float y, float z, int dimension, int value);
+  void FillBox(const glm::vec3 &min, const glm::vec3 &max, int dimension,
+               int value);
+  void Undo();
+  void Redo();
 
   void ShrinkSize();
   void GrowSize();
@@ -70,6 +93,8 @@ class Game : public InputListener {
   virtual void KeyDown(int key);
   virtual void KeyUp(int key);
 
+  virtual void WorldChanged(const std::vector<WorldChange> &changes);
+
  private:
   void LoadAssets();
 
@@ -78,12 +103,23 @@ class Game : public InputListener {
   void HandleCollisions();
   bool PlayerCollidesWithWorld() const;
   void ResolveBoxCollision(Body *body1, Body *body2);
+  // Replaces the collision bodies inside the regions the finder is done
+  // with.
   void UpdateWorldCollisionBodies();
-  void AddWorldCollisionBody(Block *block, float x, float y, float z,
-                             float size);
+  // Adds a body for a block given in units of the deepest blocks.
+  void AddWorldCollisionBody(glm::vec3 corner, float size);
+  void ConfigureWorld();
+  void DefragmentWorld();
+  void CloseStream();
+  void StopJournal();
+  void FinishSave();
+  // Finds the block an import replaces, which is the one the player would
+  // place a block in, and loads it. Returns false if there's no such block.
+  bool TargetImportBlock(LocationalCode *code);
 
   void Render();
-  void DrawBlock(Block *block, float x, float y, float z, float size);
+  void DrawBlock(uint16_t value, glm::vec3 corner, float size);
+  void DrawBox(int color, glm::vec3 corner, glm::vec3 size);
   void DrawHighlight();
   void DrawCrosshair();
 
@@ -111,10 +147,22 @@ class Game : public InputListener {
   double block_interval_;
   double last_block_time_;
   RayCastHit ray_cast_hit_;
-
-  Block *world_;
-  bool world_changed_;
-  std::vector<BoxBody *> world_bodies_;
+  bool has_box_corner_;
+  glm::vec3 box_corner_;
+
+  World world_;
+  UndoHistory history_;
+  SnapshotPublisher publisher_;
+  // Reads the published snapshots, so it's declared after the publisher.
+  CollisionBoxFinder collision_box_finder_;
+  WorldStreamer streamer_;
+  WorldJournal journal_;
+  WorldSaver saver_;
+  double last_save_time_;
+  // The generation of the world when it was last saved.
+  uint64_t saved_generation_;
+  // Keyed by the code of the deepest block at the corner of each body.
+  std::map<uint64_t, BoxBody *> world_bodies_;
 
   GLuint block_texture_;
   GLuint highlight_texture_;
@@ -0,0 +1,154 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef LOCATIONAL_CODE_H_
+#define LOCATIONAL_CODE_H_
+
+#include <cassert>
+#include <cstdint>
+
+// The address of a block in the octree as a 64-bit integer. The code is a
+// leading one bit followed by the child indices of the path from the root to
+// the block, three bits per dimension, which makes it a Morton code of the
+// integer coordinates of the block with its dimension encoded in its length.
+//
+// The child index at each step is the x bit of the block coordinates, the
+// inverted z bit and the inverted y bit, matching the child order of Block.
+class LocationalCode {
+ public:
+  static const int kMaxDimension = 21;
+
+  // The code of the root block.
+  LocationalCode() : code_(1) {}
+  explicit LocationalCode(uint64_t code) : code_(code) {}
+
+  // Returns the code of the block at the given integer coordinates, where
+  // each coordinate is less than 2 ^ dimension.
+  static LocationalCode FromCoordinates(uint32_t x, uint32_t y, uint32_t z,
+                                        int dimension) {
+    assert(dimension >= 0 && dimension <= kMaxDimension);
+    uint32_t mask = (1u << dimension) - 1;
+    assert(x <= mask && y <= mask && z <= mask);
+    return LocationalCode((1ull << (3 * dimension)) |
+                          SpreadBits(x) |
+                          SpreadBits(~z & mask) << 1 |
+                          SpreadBits(~y & mask) << 2);
+  }
+
+  uint64_t value() const { return code_; }
+
+  int dimension() const {
+    int dimension = 0;
+    for (uint64_t code = code_ >> 3; code; code >>= 3) {
+      ++dimension;
+    }
+    return dimension;
+  }
+
+  // Returns the index of the child that the path goes through at the given
+  // depth, where depth 0 selects a child of the root. The dimension of the
+  // code is passed in since it's usually known by the caller.
+  int child_index(int depth, int dimension) const {
+    return static_cast<int>(code_ >> (3 * (dimension - 1 - depth))) & 7;
+  }
+
+  // Returns the first and the last code of the descendants of the block at
+  // the given dimension. The codes of all descendants of a block, at any
+  // dimension up to the given one, fall between these two once extended to
+  // it, so a subtree is a contiguous range of extended codes.
+  LocationalCode first_descendant(int dimension) const {
+    int levels = dimension - this->dimension();
+    assert(levels >= 0);
+    return LocationalCode(code_ << (3 * levels));
+  }
+  LocationalCode last_descendant(int dimension) const {
+    int levels = dimension - this->dimension();
+    assert(levels >= 0);
+    return LocationalCode(code_ << (3 * levels) |
+                          ((1ull << (3 * levels)) - 1));
+  }
+
+  LocationalCode parent() const {
+    return LocationalCode(code_ >> 3);
+  }
+  LocationalCode child(int index) const {
+    return LocationalCode(code_ << 3 | static_cast<uint64_t>(index));
+  }
+
+  void GetCoordinates(uint32_t *x, uint32_t *y, uint32_t *z) const {
+    int dimension = this->dimension();
+    uint32_t mask = (1u << dimension) - 1;
+    uint64_t path = code_ & ((1ull << (3 * dimension)) - 1);
+    *x = CompactBits(path);
+    *z = ~CompactBits(path >> 1) & mask;
+    *y = ~CompactBits(path >> 2) & mask;
+  }
+
+  // Gets the code of the block of the same dimension at the given offset in
+  // blocks. Returns false if the neighbor is outside of the world.
+  bool GetNeighbor(int dx, int dy, int dz, LocationalCode *neighbor) const {
+    uint32_t x;
+    uint32_t y;
+    uint32_t z;
+    GetCoordinates(&x, &y, &z);
+    int dimension = this->dimension();
+    int64_t size = 1ll << dimension;
+    int64_t nx = static_cast<int64_t>(x) + dx;
+    int64_t ny = static_cast<int64_t>(y) + dy;
+    int64_t nz = static_cast<int64_t>(z) + dz;
+    if (nx < 0 || ny < 0 || nz < 0 || nx >= size || ny >= size || nz >= size) {
+      return false;
+    }
+    *neighbor = FromCoordinates(static_cast<uint32_t>(nx),
+                                static_cast<uint32_t>(ny),
+                                static_cast<uint32_t>(nz), dimension);
+    return true;
+  }
+
+  bool operator==(const LocationalCode &other) const {
+    return code_ == other.code_;
+  }
+  bool operator!=(const LocationalCode &other) const {
+    return code_ != other.code_;
+  }
+
+ private:
+  // Moves the lowest 21 bits of a value so that there are two zero bits
+  // between each of them.
+  static uint64_t SpreadBits(uint32_t value) {
+    uint64_t bits = value & 0x1fffff;
+    bits = (bits | bits << 32) & 0x001f00000000ffffull;
+    bits = (bits | bits << 16) & 0x001f0000ff0000ffull;
+    bits = (bits | bits << 8) & 0x100f00f00f00f00full;
+    bits = (bits | bits << 4) & 0x10c30c30c30c30c3ull;
+    bits = (bits | bits << 2) & 0x1249249249249249ull;
+    return bits;
+  }
+
+  // The inverse of SpreadBits().
+  static uint32_t CompactBits(uint64_t bits) {
+    bits &= 0x1249249249249249ull;
+    bits = (bits | bits >> 2) & 0x10c30c30c30c30c3ull;
+    bits = (bits | bits >> 4) & 0x100f00f00f00f00full;
+    bits = (bits | bits >> 8) & 0x001f0000ff0000ffull;
+    bits = (bits | bits >> 16) & 0x001f00000000ffffull;
+    bits = (bits | bits >> 32) & 0x1fffff;
+    return static_cast<uint32_t>(bits);
+  }
+
+  uint64_t code_;
+};
+
+#endif  // LOCATIONAL_CODE_H_
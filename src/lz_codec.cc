@@ -0,0 +1,208 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "lz_codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const int kHashBits = 14;
+const size_t kMinMatch = 4;
+const size_t kMaxOffset = 0xffff;
+// Bytes copied at a time, which may overrun a copy as long as the buffers
+// have room.
+const size_t kCopySize = 8;
+// Literals fewer than fit in the token are copied at once in this many
+// bytes.
+const ptrdiff_t kShortLiterals = 16;
+// How many positions without a match before the search starts skipping.
+const int kSkipShift = 6;
+
+uint32_t Load32(const uint8_t *data) {
+  uint32_t value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+uint32_t Hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - kHashBits);
+}
+
+void Copy8(uint8_t *output, const uint8_t *data) {
+  std::memcpy(output, data, kCopySize);
+}
+
+uint8_t *WriteLength(size_t length, uint8_t *output) {
+  for (; length >= 255; length -= 255) {
+    *output++ = 255;
+  }
+  *output++ = static_cast<uint8_t>(length);
+  return output;
+}
+
+// Reads the rest of a length that didn't fit in a token. Returns false if
+// the data ends first.
+bool ReadLength(const uint8_t **data, const uint8_t *end, size_t *length) {
+  uint8_t byte;
+  do {
+    if (*data == end) {
+      return false;
+    }
+    byte = *(*data)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+uint8_t *WriteSequence(const uint8_t *literals, size_t num_literals,
+                       size_t offset, size_t match_length, uint8_t *output) {
+  uint8_t *token = output++;
+  *token = static_cast<uint8_t>(std::min<size_t>(num_literals, 15) << 4);
+  if (num_literals >= 15) {
+    output = WriteLength(num_literals - 15, output);
+  }
+  output = std::copy(literals, literals + num_literals, output);
+  if (!match_length) {
+    return output;
+  }
+
+  *output++ = static_cast<uint8_t>(offset);
+  *output++ = static_cast<uint8_t>(offset >> 8);
+  size_t length = match_length - kMinMatch;
+  *token |= static_cast<uint8_t>(std::min<size_t>(length, 15));
+  if (length >= 15) {
+    output = WriteLength(length - 15, output);
+  }
+  return output;
+}
+
+}  // namespace
+
+LzCompressor::LzCompressor() : table_(1 << kHashBits) {}
+
+size_t LzCompressor::Compress(const uint8_t *data, size_t size,
+                              uint8_t *output) {
+  std::fill(table_.begin(), table_.end(), 0);
+  uint8_t *start = output;
+  size_t anchor = 0;
+  size_t position = 0;
+  while (position + kMinMatch <= size) {
+    uint32_t sequence = Load32(data + position);
+    uint32_t &entry = table_[Hash(sequence)];
+    size_t candidate = entry;
+    entry = static_cast<uint32_t>(position + 1);
+    if (!candidate || position + 1 - candidate > kMaxOffset ||
+        Load32(data + candidate - 1) != sequence) {
+      // Skip ahead faster the longer there has been no match.
+      position += 1 + ((position - anchor) >> kSkipShift);
+      continue;
+    }
+
+    const uint8_t *match = data + candidate - 1;
+    size_t length = kMinMatch;
+    while (position + length + kCopySize <= size) {
+      uint64_t a, b;
+      std::memcpy(&a, match + length, kCopySize);
+      std::memcpy(&b, data + position + length, kCopySize);
+      if (a != b) {
+        break;
+      }
+      length += kCopySize;
+    }
+    while (position + length < size &&
+           match[length] == data[position + length]) {
+      ++length;
+    }
+
+    output = WriteSequence(data + anchor, position - anchor,
+                           data + position - match, length, output);
+    position += length;
+    anchor = position;
+  }
+  output = WriteSequence(data + anchor, size - anchor, 0, 0, output);
+  return static_cast<size_t>(output - start);
+}
+
+bool LzDecompress(const uint8_t *data, size_t size, uint8_t *output,
+                  size_t output_size) {
+  const uint8_t *end = data + size;
+  uint8_t *start = output;
+  uint8_t *output_end = output + output_size;
+  while (data != end) {
+    uint8_t token = *data++;
+    size_t num_literals = token >> 4;
+    if (num_literals < 15 && end - data >= kShortLiterals + 2 &&
+        output_end - output >= kShortLiterals) {
+      // Most sequences have few literals, which are copied in whole words
+      // without checking their length when far enough from the ends. The
+      // last sequence is never among them, since it ends at the end.
+      Copy8(output, data);
+      Copy8(output + kCopySize, data + kCopySize);
+      output += num_literals;
+      data += num_literals;
+    } else {
+      if (num_literals == 15 && !ReadLength(&data, end, &num_literals)) {
+        return false;
+      }
+      if (num_literals > static_cast<size_t>(end - data) ||
+          num_literals > static_cast<size_t>(output_end - output)) {
+        return false;
+      }
+      output = std::copy(data, data + num_literals, output);
+      data += num_literals;
+      if (data == end) {
+        break;
+      }
+    }
+
+    if (end - data < 2) {
+      return false;
+    }
+    size_t offset = data[0] | data[1] << 8;
+    data += 2;
+    size_t length = (token & 15) + kMinMatch;
+    if (length == 15 + kMinMatch && !ReadLength(&data, end, &length)) {
+      return false;
+    }
+    if (!offset || offset > static_cast<size_t>(output - start) ||
+        length > static_cast<size_t>(output_end - output)) {
+      return false;
+    }
+    const uint8_t *match = output - offset;
+    if (output_end - output >= static_cast<ptrdiff_t>(length + kCopySize)) {
+      size_t i = 0;
+      if (offset < kCopySize) {
+        // A match closer than a copy repeats with the period of its offset,
+        // so after the first copy the rest is copied from a multiple of the
+        // offset back instead, which long runs of the same byte need.
+        for (; i < kCopySize; ++i) {
+          output[i] = match[i];
+        }
+        match = output - (kCopySize + offset - 1) / offset * offset;
+      }
+      for (; i < length; i += kCopySize) {
+        Copy8(output + i, match + i);
+      }
+    } else {
+      for (size_t i = 0; i < length; ++i) {
+        output[i] = match[i];
+      }
+    }
+    output += length;
+  }
+  return output == output_end;
+}
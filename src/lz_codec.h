@@ -0,0 +1,61 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef LZ_CODEC_H_
+#define LZ_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A byte-oriented LZ77 codec for the streams of saved worlds, which have
+// long runs of repeated child masks and palette indices. The format is a
+// sequence of
+//
+//   token            1 byte    literal length in the high 4 bits, match
+//                              length minus 4 in the low 4 bits
+//   literal length   bytes     only if 15 in the token, each added to the
+//                              length, up to and including one below 255
+//   literals         bytes
+//   match offset     uint16    little-endian, back from the current output
+//   match length     bytes     like the literal length
+//
+// where the last sequence ends after its literals. Matches are found
+// greedily through a hash table of the last position of every 4 bytes, so
+// compressing is fast and decompressing is little more than copying.
+class LzCompressor {
+ public:
+  LzCompressor();
+
+  // Returns the largest size the given number of bytes can compress to.
+  static size_t GetMaxCompressedSize(size_t size) {
+    return size + size / 255 + 16;
+  }
+
+  // Compresses the data into the output, which must have room for
+  // GetMaxCompressedSize(size) bytes. Returns the compressed size.
+  size_t Compress(const uint8_t *data, size_t size, uint8_t *output);
+
+ private:
+  // Positions plus one of the last 4 bytes with each hash, or zero.
+  std::vector<uint32_t> table_;
+};
+
+// Decompresses data into exactly the given number of bytes of output.
+// Returns false if the data is corrupt.
+bool LzDecompress(const uint8_t *data, size_t size, uint8_t *output,
+                  size_t output_size);
+
+#endif  // LZ_CODEC_H_
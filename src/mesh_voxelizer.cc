@@ -0,0 +1,438 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "mesh_voxelizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "block_builder.h"
+#include "world_builder.h"
+
+namespace {
+
+// The block is voxelized as tasks of the blocks this many levels below it.
+const int kTaskLevels = 3;
+// The grid of rays cast to find the inside of a mesh has a few columns for
+// each triangle of the mesh, up to this many levels of them.
+const int kMaxRayGridLevels = 11;
+const int kRayGridColumnsPerTriangle = 4;
+
+// A triangle in units of the voxels, together with its bounds.
+struct Triangle {
+  glm::dvec3 vertices[3];
+  glm::dvec3 min;
+  glm::dvec3 max;
+};
+
+// Returns whether the projections of a triangle and a cube onto an axis are
+// apart, given the projections of two vertices of the triangle, which are
+// all that is needed when the third lies on a line through one of them along
+// an edge perpendicular to the axis.
+bool AreApartOnAxis(double projection1, double projection2, double radius) {
+  return std::min(projection1, projection2) > radius ||
+         std::max(projection1, projection2) < -radius;
+}
+
+// Returns whether a triangle overlaps a closed cube with the given center and
+// half size, by looking for an axis that separates them. The axes to check
+// are those of the cube, the normal of the triangle and the cross products of
+// the axes of the cube and the edges of the triangle.
+bool TriangleOverlapsCube(const Triangle &triangle, const glm::dvec3 &center,
+                          double half_size) {
+  for (int i = 0; i < 3; ++i) {
+    if (triangle.min[i] - center[i] > half_size ||
+        triangle.max[i] - center[i] < -half_size) {
+      return false;
+    }
+  }
+  glm::dvec3 vertices[3] = {triangle.vertices[0] - center,
+                            triangle.vertices[1] - center,
+                            triangle.vertices[2] - center};
+  for (int i = 0; i < 3; ++i) {
+    // Both ends of the edge project to the same point on the axes
+    // perpendicular to it, so the start and the opposite vertex are enough.
+    const glm::dvec3 &start = vertices[i];
+    const glm::dvec3 &opposite = vertices[(i + 2) % 3];
+    glm::dvec3 edge = vertices[(i + 1) % 3] - start;
+    glm::dvec3 length = glm::abs(edge);
+    if (AreApartOnAxis(edge.y * start.z - edge.z * start.y,
+                       edge.y * opposite.z - edge.z * opposite.y,
+                       half_size * (length.y + length.z)) ||
+        AreApartOnAxis(edge.z * start.x - edge.x * start.z,
+                       edge.z * opposite.x - edge.x * opposite.z,
+                       half_size * (length.z + length.x)) ||
+        AreApartOnAxis(edge.x * start.y - edge.y * start.x,
+                       edge.x * opposite.y - edge.y * opposite.x,
+                       half_size * (length.x + length.y))) {
+      return false;
+    }
+  }
+  glm::dvec3 normal = glm::cross(vertices[1] - vertices[0],
+                                 vertices[2] - vertices[0]);
+  glm::dvec3 normal_length = glm::abs(normal);
+  return std::abs(glm::dot(normal, vertices[0])) <=
+         half_size * (normal_length.x + normal_length.y + normal_length.z);
+}
+
+// Returns how far a point is to the left of an edge, projected onto the y
+// and z axes, times the length of the edge.
+double GetEdgeDistance(const glm::dvec3 &start, const glm::dvec3 &end,
+                       const glm::dvec3 &point) {
+  return (end.y - start.y) * (point.z - start.z) -
+         (end.z - start.z) * (point.y - start.y);
+}
+
+// Returns whether a point on an edge of a counterclockwise triangle belongs
+// to it, which is the case for exactly one of the two directions of an edge,
+// so that points on an edge between two triangles belong to exactly one.
+bool IncludesEdge(const glm::dvec3 &start, const glm::dvec3 &end) {
+  return end.z > start.z || (end.z == start.z && end.y < start.y);
+}
+
+// Returns whether a ray from a point along the x axis crosses a triangle.
+bool RayCrossesTriangle(const Triangle &triangle, const glm::dvec3 &point) {
+  if (point.y < triangle.min.y || point.y > triangle.max.y ||
+      point.z < triangle.min.z || point.z > triangle.max.z ||
+      point.x >= triangle.max.x) {
+    return false;
+  }
+  const glm::dvec3 &a = triangle.vertices[0];
+  glm::dvec3 b = triangle.vertices[1];
+  glm::dvec3 c = triangle.vertices[2];
+  double area = GetEdgeDistance(a, b, c);
+  if (area == 0.0) {
+    return false;
+  }
+  if (area < 0.0) {
+    std::swap(b, c);
+    area = -area;
+  }
+  double weight_a = GetEdgeDistance(b, c, point);
+  double weight_b = GetEdgeDistance(c, a, point);
+  double weight_c = GetEdgeDistance(a, b, point);
+  if (weight_a < 0.0 || (weight_a == 0.0 && !IncludesEdge(b, c)) ||
+      weight_b < 0.0 || (weight_b == 0.0 && !IncludesEdge(c, a)) ||
+      weight_c < 0.0 || (weight_c == 0.0 && !IncludesEdge(a, b))) {
+    return false;
+  }
+  return (weight_a * a.x + weight_b * b.x + weight_c * c.x) / area > point.x;
+}
+
+// The triangles of a mesh that overlap each column of a square grid over the
+// y and z axes, for casting rays along the x axis.
+class RayGrid {
+ public:
+  RayGrid() : triangles_(nullptr), resolution_(0), column_size_(0.0) {}
+
+  // Builds the grid over a square of the given size with its corner at the
+  // origin.
+  void Build(const std::vector<Triangle> *triangles, double size, int levels);
+
+  // Returns whether a point is inside a closed mesh, which is the case if a
+  // ray from it crosses the mesh an odd number of times.
+  bool IsInside(const glm::dvec3 &point) const;
+
+ private:
+  int GetColumn(double coordinate) const {
+    return glm::clamp(static_cast<int>(std::floor(coordinate / column_size_)),
+                      0, resolution_ - 1);
+  }
+
+  const std::vector<Triangle> *triangles_;
+  int resolution_;
+  double column_size_;
+  // Where the triangles of each column start in the triangle indices,
+  // followed by where they end.
+  std::vector<uint32_t> offsets_;
+  std::vector<uint32_t> triangle_indices_;
+};
+
+void RayGrid::Build(const std::vector<Triangle> *triangles, double size,
+                    int levels) {
+  triangles_ = triangles;
+  resolution_ = 1 << levels;
+  column_size_ = size / resolution_;
+  // Count the triangles of each column first, and then place them.
+  offsets_.assign(resolution_ * resolution_ + 1, 0);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (uint32_t i = 0; i < triangles->size(); ++i) {
+      const Triangle &triangle = (*triangles)[i];
+      for (int z = GetColumn(triangle.min.z); z <= GetColumn(triangle.max.z);
+           ++z) {
+        for (int y = GetColumn(triangle.min.y);
+             y <= GetColumn(triangle.max.y); ++y) {
+          uint32_t &offset = offsets_[y + resolution_ * z + 1];
+          if (pass == 1) {
+            triangle_indices_[offset] = i;
+          }
+          ++offset;
+        }
+      }
+    }
+    if (pass == 0) {
+      for (size_t i = 1; i < offsets_.size(); ++i) {
+        offsets_[i] += offsets_[i - 1];
+      }
+      triangle_indices_.resize(offsets_.back());
+      // Shift the offsets by a column, so that placing the triangles moves
+      // each offset from the start of the column to its end.
+      std::copy_backward(offsets_.begin(), offsets_.end() - 1,
+                         offsets_.end());
+      offsets_[0] = 0;
+    }
+  }
+}
+
+bool RayGrid::IsInside(const glm::dvec3 &point) const {
+  int column = GetColumn(point.y) + resolution_ * GetColumn(point.z);
+  bool inside = false;
+  for (uint32_t i = offsets_[column]; i < offsets_[column + 1]; ++i) {
+    if (RayCrossesTriangle((*triangles_)[triangle_indices_[i]], point)) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+// Voxelizes a mesh scaled to a cube of the given number of levels of voxels,
+// split into a grid of tasks.
+class MeshVoxelizer {
+ public:
+  MeshVoxelizer(const TriangleMesh &mesh, int levels, int task_levels,
+                bool solid);
+
+  // Adds the voxels of the task with the given coordinates in the grid of
+  // tasks to a builder of the task.
+  void Voxelize(const glm::uvec3 &task, int color,
+                BlockBuilder *builder) const;
+
+ private:
+  // Voxelizes the cell with the given code relative to the task, given the
+  // triangles that overlap it. The triangles that overlap each child are
+  // listed in the eight lists of the depth of the cell.
+  void VoxelizeCell(LocationalCode cell, const glm::dvec3 &corner,
+                    double size, const std::vector<uint32_t> &triangles,
+                    int color, BlockBuilder *builder,
+                    std::vector<std::vector<uint32_t>> *child_triangles) const;
+
+  bool solid_;
+  double task_size_;
+  int num_tasks_;
+  std::vector<Triangle> triangles_;
+  // The triangles whose bounds overlap each task, in the order of the task
+  // coordinates x, y and z.
+  std::vector<std::vector<uint32_t>> task_triangles_;
+  RayGrid ray_grid_;
+};
+
+MeshVoxelizer::MeshVoxelizer(const TriangleMesh &mesh, int levels,
+                             int task_levels, bool solid)
+    : solid_(solid), num_tasks_(1 << task_levels) {
+  double size = std::ldexp(1.0, levels);
+  task_size_ = size / num_tasks_;
+  task_triangles_.resize(num_tasks_ * num_tasks_ * num_tasks_);
+  if (mesh.indices.empty()) {
+    return;
+  }
+
+  glm::dvec3 min(mesh.vertices[mesh.indices[0]]);
+  glm::dvec3 max = min;
+  for (uint32_t index : mesh.indices) {
+    min = glm::min(min, glm::dvec3(mesh.vertices[index]));
+    max = glm::max(max, glm::dvec3(mesh.vertices[index]));
+  }
+  double extent = glm::max(max.x - min.x, glm::max(max.y - min.y,
+                                                   max.z - min.z));
+  double scale = extent > 0.0 ? size / extent : 1.0;
+  triangles_.resize(mesh.indices.size() / 3);
+  for (size_t i = 0; i < triangles_.size(); ++i) {
+    Triangle &triangle = triangles_[i];
+    for (int j = 0; j < 3; ++j) {
+      triangle.vertices[j] =
+          (glm::dvec3(mesh.vertices[mesh.indices[3 * i + j]]) - min) * scale;
+    }
+    triangle.min = glm::min(triangle.vertices[0],
+                            glm::min(triangle.vertices[1],
+                                     triangle.vertices[2]));
+    triangle.max = glm::max(triangle.vertices[0],
+                            glm::max(triangle.vertices[1],
+                                     triangle.vertices[2]));
+    glm::ivec3 first_task = glm::clamp(
+        glm::ivec3(glm::floor(triangle.min / task_size_)), 0, num_tasks_ - 1);
+    glm::ivec3 last_task = glm::clamp(
+        glm::ivec3(glm::floor(triangle.max / task_size_)), 0, num_tasks_ - 1);
+    for (int z = first_task.z; z <= last_task.z; ++z) {
+      for (int y = first_task.y; y <= last_task.y; ++y) {
+        for (int x = first_task.x; x <= last_task.x; ++x) {
+          task_triangles_[x + num_tasks_ * (y + num_tasks_ * z)].push_back(
+              static_cast<uint32_t>(i));
+        }
+      }
+    }
+  }
+
+  if (solid_) {
+    int ray_grid_levels = 0;
+    while (ray_grid_levels < std::min(levels, kMaxRayGridLevels) &&
+           (1ull << (2 * ray_grid_levels)) <
+               kRayGridColumnsPerTriangle * triangles_.size()) {
+      ++ray_grid_levels;
+    }
+    ray_grid_.Build(&triangles_, size, ray_grid_levels);
+  }
+}
+
+void MeshVoxelizer::Voxelize(const glm::uvec3 &task, int color,
+                             BlockBuilder *builder) const {
+  glm::dvec3 corner = glm::dvec3(task) * task_size_;
+  double half_size = 0.5 * task_size_;
+  std::vector<uint32_t> triangles;
+  for (uint32_t index : task_triangles_[task.x + num_tasks_ *
+                                                     (task.y + num_tasks_ *
+                                                                   task.z)]) {
+    if (TriangleOverlapsCube(triangles_[index], corner + half_size,
+                             half_size)) {
+      triangles.push_back(index);
+    }
+  }
+  if (triangles.empty()) {
+    if (solid_ && ray_grid_.IsInside(corner + half_size)) {
+      builder->Add(LocationalCode(), color);
+    }
+    return;
+  }
+  std::vector<std::vector<uint32_t>> child_triangles(Block::kNumChildren *
+                                                     builder->levels());
+  VoxelizeCell(LocationalCode(), corner, task_size_, triangles, color,
+               builder, &child_triangles);
+}
+
+void MeshVoxelizer::VoxelizeCell(
+    LocationalCode cell, const glm::dvec3 &corner, double size,
+    const std::vector<uint32_t> &triangles, int color, BlockBuilder *builder,
+    std::vector<std::vector<uint32_t>> *child_triangles) const {
+  int depth = cell.dimension();
+  if (depth == builder->levels()) {
+    builder->Add(cell, color);
+    return;
+  }
+  // The lists of the shallower cells are still in use, while the deeper ones
+  // are free to reuse.
+  std::vector<uint32_t> *children =
+      &(*child_triangles)[Block::kNumChildren * depth];
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    children[i].clear();
+  }
+  double half_size = 0.5 * size;
+  glm::dvec3 middle = corner + half_size;
+  // The children of the smallest cells only need to know whether any
+  // triangle overlaps them.
+  bool children_are_voxels = depth + 1 == builder->levels();
+  for (uint32_t index : triangles) {
+    const Triangle &triangle = triangles_[index];
+    glm::ivec3 first(glm::greaterThan(triangle.min, middle));
+    glm::ivec3 last(glm::greaterThanEqual(triangle.max, middle));
+    // A triangle within a single child overlaps it, since it overlaps the
+    // cell.
+    bool single_child = first == last;
+    for (int z = first.z; z <= last.z; ++z) {
+      for (int y = first.y; y <= last.y; ++y) {
+        for (int x = first.x; x <= last.x; ++x) {
+          std::vector<uint32_t> &child =
+              children[Block::GetChildIndex(x, y, z)];
+          if (children_are_voxels && !child.empty()) {
+            continue;
+          }
+          if (single_child ||
+              TriangleOverlapsCube(
+                  triangle, corner + glm::dvec3(x, y, z) * half_size +
+                                0.5 * half_size,
+                  0.5 * half_size)) {
+            child.push_back(index);
+          }
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    // The inverse of Block::GetChildIndex().
+    glm::dvec3 child_corner =
+        corner + glm::dvec3(i & 1, i & 4 ? 0 : 1, i & 2 ? 0 : 1) * half_size;
+    if (!children[i].empty()) {
+      VoxelizeCell(cell.child(i), child_corner, half_size, children[i],
+                   color, builder, child_triangles);
+    } else if (solid_ &&
+               ray_grid_.IsInside(child_corner + 0.5 * half_size)) {
+      // No part of the mesh is in the child, so the whole child is either
+      // inside or outside of it.
+      builder->Add(cell.child(i), color);
+    }
+  }
+}
+
+}  // namespace
+
+bool VoxelizeMesh(World *world, const TriangleMesh &mesh, LocationalCode code,
+                  int dimension, int color, bool solid) {
+  if (mesh.indices.size() % 3 != 0) {
+    return false;
+  }
+  for (uint32_t index : mesh.indices) {
+    if (index >= mesh.vertices.size()) {
+      return false;
+    }
+  }
+  int code_dimension = code.dimension();
+  int brick_dimension = world->brick_dimension();
+  if (dimension < code_dimension ||
+      (brick_dimension >= 0 && code_dimension > brick_dimension)) {
+    return false;
+  }
+  int task_levels = std::min(kTaskLevels, dimension - code_dimension);
+  if (brick_dimension >= 0) {
+    task_levels = std::min(task_levels, brick_dimension - code_dimension);
+  }
+  MeshVoxelizer voxelizer(mesh, dimension - code_dimension, task_levels,
+                          solid);
+
+  uint32_t num_tasks = 1u << task_levels;
+  uint32_t code_x;
+  uint32_t code_y;
+  uint32_t code_z;
+  code.GetCoordinates(&code_x, &code_y, &code_z);
+  glm::uvec3 first_task = glm::uvec3(code_x, code_y, code_z) * num_tasks;
+  std::vector<LocationalCode> tasks;
+  for (uint32_t z = 0; z < num_tasks; ++z) {
+    for (uint32_t y = 0; y < num_tasks; ++y) {
+      for (uint32_t x = 0; x < num_tasks; ++x) {
+        tasks.push_back(LocationalCode::FromCoordinates(
+            first_task.x + x, first_task.y + y, first_task.z + z,
+            code_dimension + task_levels));
+      }
+    }
+  }
+  return BuildWorldBlocks(
+      world, tasks, dimension,
+      [&](LocationalCode task, BlockBuilder *builder) {
+        uint32_t x;
+        uint32_t y;
+        uint32_t z;
+        task.GetCoordinates(&x, &y, &z);
+        voxelizer.Voxelize(glm::uvec3(x, y, z) - first_task, color, builder);
+        return true;
+      });
+}
@@ -0,0 +1,51 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef MESH_VOXELIZER_H_
+#define MESH_VOXELIZER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "locational_code.h"
+#include "world.h"
+
+// A mesh of triangles, each given by the indices of its three vertices.
+struct TriangleMesh {
+  std::vector<glm::vec3> vertices;
+  std::vector<uint32_t> indices;
+};
+
+// Replaces a block of the world with the voxels of the given dimension that
+// a mesh passes through, scaled uniformly to fit the block with the corner
+// of its bounds at the corner of the block. When solid, the voxels inside
+// the mesh are filled as well, which requires it to be closed.
+//
+// Cells of the block are tested against the triangles that overlap their
+// parent with the separating axis theorem, from the block down, so cells
+// that no triangle passes through are either left empty or, inside a solid
+// mesh, filled as a whole without visiting the voxels in them. Whether such
+// a cell is inside is found by counting the triangles a ray from its center
+// crosses. The block is split into a few hundred blocks that are voxelized
+// as tasks with world_builder.h, so the same limits on the dimensions apply.
+//
+// Returns false, leaving the world unchanged, if the mesh has an index out
+// of range or the dimensions don't fit the bricks of the world.
+bool VoxelizeMesh(World *world, const TriangleMesh &mesh, LocationalCode code,
+                  int dimension, int color, bool solid);
+
+#endif  // MESH_VOXELIZER_H_
@@ -0,0 +1,66 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#include "palette.h"
+
+Palette::Palette() : colors_(), indices_() {
+  Clear();
+}
+
+uint16_t Palette::Add(int color) {
+  uint16_t index;
+  if (Find(color, &index)) {
+    return index;
+  }
+  if (size() == kMaxSize) {
+    return FindNearest(color);
+  }
+  index = static_cast<uint16_t>(colors_.size());
+  colors_.push_back(color);
+  indices_[color] = index;
+  return index;
+}
+
+bool Palette::Find(int color, uint16_t *index) const {
+  auto it = indices_.find(color);
+  if (it == indices_.end()) {
+    return false;
+  }
+  *index = it->second;
+  return true;
+}
+
+void Palette::Clear() {
+  colors_.clear();
+  indices_.clear();
+  colors_.push_back(0);
+  indices_[0] = kEmptyIndex;
+}
+
+uint16_t Palette::FindNearest(int color) const {
+  // The empty color is never a substitute for a solid one.
+  uint16_t nearest = kEmptyIndex;
+  int nearest_distance = 0;
+  for (int i = 1; i < size(); ++i) {
+    int dr = ((colors_[i] >> 16) & 0xff) - ((color >> 16) & 0xff);
+    int dg = ((colors_[i] >> 8) & 0xff) - ((color >> 8) & 0xff);
+    int db = (colors_[i] & 0xff) - (color & 0xff);
+    int distance = dr * dr + dg * dg + db * db;
+    if (nearest == kEmptyIndex || distance < nearest_distance) {
+      nearest = static_cast<uint16_t>(i);
+      nearest_distance = distance;
+    }
+  }
+  return nearest;
+}
@@ -0,0 +1,56 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#ifndef PALETTE_H_
+#define PALETTE_H_
+
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// The colors used in a world. Blocks store a 16-bit index into the palette
+// instead of a 24-bit RGB color. Index zero is the empty color zero, and
+// colors are never removed, so the indices in snapshots of the world stay
+// valid as colors are added.
+class Palette {
+ public:
+  static const uint16_t kEmptyIndex = 0;
+  static const int kMaxSize = 1 << 16;
+
+  Palette();
+
+  int size() const { return static_cast<int>(colors_.size()); }
+  int color(uint16_t index) const {
+    assert(index < colors_.size());
+    return colors_[index];
+  }
+
+  // Returns the index of the color, adding it if it's new. Once the palette
+  // is full, the index of the nearest color is returned instead.
+  uint16_t Add(int color);
+  // Gets the index of the color. Returns false if it isn't in the palette.
+  bool Find(int color, uint16_t *index) const;
+
+  // Removes every color except the empty color.
+  void Clear();
+
+ private:
+  uint16_t FindNearest(int color) const;
+
+  std::vector<int> colors_;
+  std::unordered_map<int, uint16_t> indices_;
+};
+
+#endif  // PALETTE_H_
@@ -0,0 +1,126 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "snapshot_publisher.h"
+
+#include <cassert>
+#include <thread>
+
+SnapshotPublisher::Reader::Reader(SnapshotPublisher *publisher)
+    : publisher_(publisher), slot_(-1) {
+  for (int i = 0; i < kMaxReaders; ++i) {
+    bool used = false;
+    if (publisher_->reader_slots_used_[i].compare_exchange_strong(used,
+                                                                  true)) {
+      slot_ = i;
+      break;
+    }
+  }
+  assert(slot_ >= 0 && "Too many snapshot readers");
+}
+
+SnapshotPublisher::Reader::~Reader() {
+  Unlock();
+  publisher_->reader_slots_used_[slot_].store(false);
+}
+
+const SnapshotPublisher::Snapshot *SnapshotPublisher::Reader::Lock() {
+  // The epoch has to be announced before the snapshot is loaded, so that the
+  // publisher sees it if it replaces the snapshot in between.
+  publisher_->reader_epochs_[slot_].store(publisher_->epoch_.load());
+  return publisher_->published_snapshot_.load();
+}
+
+void SnapshotPublisher::Reader::Unlock() {
+  publisher_->reader_epochs_[slot_].store(0);
+}
+
+SnapshotPublisher::SnapshotPublisher(World *world)
+    : world_(world), generation_(0),
+      published_snapshot_(nullptr),
+      epoch_(1),
+      retired_snapshots_() {
+  for (int i = 0; i < kMaxReaders; ++i) {
+    reader_epochs_[i].store(0);
+    reader_slots_used_[i].store(false);
+  }
+}
+
+SnapshotPublisher::~SnapshotPublisher() {
+  Clear();
+}
+
+void SnapshotPublisher::Publish() {
+  Snapshot *snapshot = new Snapshot;
+  snapshot->root = world_->TakeSnapshot();
+  const Palette &palette = world_->palette();
+  if (!palette_ || palette_->size() != palette.size()) {
+    palette_ = std::make_shared<const Palette>(palette);
+  }
+  snapshot->palette = palette_;
+  snapshot->generation = ++generation_;
+  snapshot->world_generation = world_->generation();
+  Retire(published_snapshot_.exchange(snapshot));
+  Reclaim();
+}
+
+void SnapshotPublisher::Clear() {
+  Retire(published_snapshot_.exchange(nullptr));
+  // The world may get different colors once it's cleared.
+  palette_.reset();
+  while (!retired_snapshots_.empty()) {
+    Reclaim();
+    if (!retired_snapshots_.empty()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void SnapshotPublisher::Retire(const Snapshot *snapshot) {
+  if (!snapshot) {
+    return;
+  }
+  // Readers that announce a later epoch can't see the replaced snapshot.
+  RetiredSnapshot retired_snapshot;
+  retired_snapshot.snapshot = snapshot;
+  retired_snapshot.epoch = epoch_.fetch_add(1);
+  retired_snapshots_.push_back(retired_snapshot);
+}
+
+void SnapshotPublisher::Reclaim() {
+  uint64_t oldest_epoch = UINT64_MAX;
+  for (int i = 0; i < kMaxReaders; ++i) {
+    uint64_t epoch = reader_epochs_[i].load();
+    if (epoch && epoch < oldest_epoch) {
+      oldest_epoch = epoch;
+    }
+  }
+
+  size_t num_kept = 0;
+  for (size_t i = 0; i < retired_snapshots_.size(); ++i) {
+    if (retired_snapshots_[i].epoch < oldest_epoch) {
+      ReleaseSnapshot(retired_snapshots_[i].snapshot);
+    } else {
+      retired_snapshots_[num_kept++] = retired_snapshots_[i];
+    }
+  }
+  retired_snapshots_.resize(num_kept);
+}
+
+void SnapshotPublisher::ReleaseSnapshot(const Snapshot *snapshot) {
+  Block root = snapshot->root;
+  world_->ReleaseSnapshot(&root);
+  delete snapshot;
+}
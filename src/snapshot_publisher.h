@@ -0,0 +1,115 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef SNAPSHOT_PUBLISHER_H_
+#define SNAPSHOT_PUBLISHER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "block.h"
+#include "palette.h"
+#include "world.h"
+
+// Publishes snapshots of a world to readers on other threads without locks.
+//
+// The thread that edits the world publishes a new snapshot with an atomic
+// swap, typically once per frame. Readers read the latest snapshot without
+// blocking the editing thread. A snapshot shares its blocks with the world,
+// and edits copy shared blocks instead of changing them, so a snapshot never
+// changes while it's being read.
+//
+// Replaced snapshots are released by the editing thread using epochs. Each
+// reader announces the epoch it started reading in, and a snapshot is only
+// released once every active reader started after it was replaced.
+class SnapshotPublisher {
+ public:
+  static const int kMaxReaders = 32;
+
+  // A snapshot has a copy of the palette, since adding colors to the
+  // palette of the world may move them. Snapshots share the copy until
+  // colors are added, since colors are never changed or removed.
+  struct Snapshot {
+    Block root;
+    std::shared_ptr<const Palette> palette;
+    // Counts the snapshots published so far.
+    uint64_t generation;
+    // The generation of the world when the snapshot was published.
+    uint64_t world_generation;
+  };
+
+  // A thread that reads published snapshots. Each reader takes one of
+  // kMaxReaders slots for as long as it exists.
+  class Reader {
+   public:
+    explicit Reader(SnapshotPublisher *publisher);
+    ~Reader();
+
+    // Returns the latest snapshot, or null if none has been published. The
+    // snapshot stays valid until Unlock() is called.
+    const Snapshot *Lock();
+    void Unlock();
+
+   private:
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    SnapshotPublisher *publisher_;
+    int slot_;
+  };
+
+  explicit SnapshotPublisher(World *world);
+  ~SnapshotPublisher();
+
+  // Publishes the current state of the world and releases snapshots that no
+  // reader can see anymore. Never waits for readers.
+  void Publish();
+  // Releases every snapshot, waiting for active readers to finish. Must be
+  // called before the world is cleared.
+  void Clear();
+
+  uint64_t generation() const { return generation_; }
+  size_t num_retired_snapshots() const { return retired_snapshots_.size(); }
+
+ private:
+  struct RetiredSnapshot {
+    const Snapshot *snapshot;
+    uint64_t epoch;
+  };
+
+  SnapshotPublisher(const SnapshotPublisher &) = delete;
+  SnapshotPublisher &operator=(const SnapshotPublisher &) = delete;
+
+  void Retire(const Snapshot *snapshot);
+  // Releases the retired snapshots that were replaced before the oldest
+  // epoch a reader is in.
+  void Reclaim();
+  void ReleaseSnapshot(const Snapshot *snapshot);
+
+  World *world_;
+  uint64_t generation_;
+  // The copy of the palette of the latest snapshot.
+  std::shared_ptr<const Palette> palette_;
+  std::atomic<const Snapshot *> published_snapshot_;
+  std::atomic<uint64_t> epoch_;
+  // The epoch each reader started reading in, or zero if it isn't reading.
+  std::atomic<uint64_t> reader_epochs_[kMaxReaders];
+  std::atomic<bool> reader_slots_used_[kMaxReaders];
+  std::vector<RetiredSnapshot> retired_snapshots_;
+};
+
+#endif  // SNAPSHOT_PUBLISHER_H_
@@ -0,0 +1,86 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "undo_history.h"
+
+UndoHistory::UndoHistory(World *world, size_t max_steps)
+    : world_(world), max_steps_(max_steps),
+      undo_snapshots_(), redo_snapshots_() {}
+
+UndoHistory::~UndoHistory() {
+  Clear();
+}
+
+void UndoHistory::Record(Block *snapshot) {
+  if (snapshot->IsIdentical(world_->root())) {
+    world_->ReleaseSnapshot(snapshot);
+    return;
+  }
+  for (Block &redo_snapshot : redo_snapshots_) {
+    world_->ReleaseSnapshot(&redo_snapshot);
+  }
+  redo_snapshots_.clear();
+
+  undo_snapshots_.push_back(*snapshot);
+  if (undo_snapshots_.size() > max_steps_) {
+    world_->ReleaseSnapshot(&undo_snapshots_.front());
+    undo_snapshots_.pop_front();
+  }
+}
+
+bool UndoHistory::Undo() {
+  if (undo_snapshots_.empty()) {
+    return false;
+  }
+  redo_snapshots_.push_back(world_->TakeSnapshot());
+  world_->RestoreSnapshot(undo_snapshots_.back());
+  world_->ReleaseSnapshot(&undo_snapshots_.back());
+  undo_snapshots_.pop_back();
+  return true;
+}
+
+bool UndoHistory::Redo() {
+  if (redo_snapshots_.empty()) {
+    return false;
+  }
+  undo_snapshots_.push_back(world_->TakeSnapshot());
+  world_->RestoreSnapshot(redo_snapshots_.back());
+  world_->ReleaseSnapshot(&redo_snapshots_.back());
+  redo_snapshots_.pop_back();
+  return true;
+}
+
+void UndoHistory::Clear() {
+  for (Block &snapshot : undo_snapshots_) {
+    world_->ReleaseSnapshot(&snapshot);
+  }
+  undo_snapshots_.clear();
+  for (Block &snapshot : redo_snapshots_) {
+    world_->ReleaseSnapshot(&snapshot);
+  }
+  redo_snapshots_.clear();
+}
+
+void UndoHistory::DefragmentWorld(
+    const std::vector<Block *> &other_snapshots) {
+  std::vector<Block *> snapshots = other_snapshots;
+  for (Block &snapshot : undo_snapshots_) {
+    snapshots.push_back(&snapshot);
+  }
+  for (Block &snapshot : redo_snapshots_) {
+    snapshots.push_back(&snapshot);
+  }
+  world_->Defragment(snapshots);
+}
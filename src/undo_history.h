@@ -0,0 +1,61 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef UNDO_HISTORY_H_
+#define UNDO_HISTORY_H_
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "block.h"
+#include "world.h"
+
+// Undo and redo for a world, kept as a list of world snapshots. Snapshots
+// share every block that hasn't been edited, so each step only costs the
+// blocks along the edited paths.
+class UndoHistory {
+ public:
+  UndoHistory(World *world, size_t max_steps);
+  ~UndoHistory();
+
+  // Records the state of the world before an edit, given as a snapshot
+  // taken before it, which the history takes over. Edits that left the
+  // root unchanged aren't recorded and keep the steps that can be redone.
+  // In a deduplicated world, that's every edit that changed nothing.
+  void Record(Block *snapshot);
+  // Returns false if there is nothing to undo or redo.
+  bool Undo();
+  bool Redo();
+  // Forgets all steps. Must be called before the world is cleared.
+  void Clear();
+  // Defragments the world together with the recorded steps and any other
+  // snapshots of the world, which are moved along.
+  void DefragmentWorld(const std::vector<Block *> &other_snapshots);
+
+  size_t num_undo_steps() const { return undo_snapshots_.size(); }
+  size_t num_redo_steps() const { return redo_snapshots_.size(); }
+
+ private:
+  UndoHistory(const UndoHistory &) = delete;
+  UndoHistory &operator=(const UndoHistory &) = delete;
+
+  World *world_;
+  size_t max_steps_;
+  std::deque<Block> undo_snapshots_;
+  std::vector<Block> redo_snapshots_;
+};
+
+#endif  // UNDO_HISTORY_H_
@@ -0,0 +1,555 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "voxel_import.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "block_builder.h"
+#include "file_utilities.h"
+#include "world_builder.h"
+
+namespace {
+
+const char kVoxMagic[] = {'V', 'O', 'X', ' '};
+const int kVoxPaletteSize = 256;
+// Scene graphs deeper than this are taken as broken.
+const int kMaxVoxSceneDepth = 64;
+// Raw volumes are built in blocks of this many levels above the voxels.
+const int kRawChunkLevels = 5;
+
+struct VoxModel {
+  glm::ivec3 size;
+  // Four bytes per voxel: x, y, z and the color index.
+  std::string voxels;
+};
+
+// A node of the scene graph, which is a transform with one child, a group
+// of children or a shape made of models.
+struct VoxNode {
+  VoxNode() : translation(0), children() {}
+
+  glm::ivec3 translation;
+  std::vector<int> children;
+  std::vector<int> models;
+};
+
+// A voxel placed in the scene, in the coordinates of the file.
+struct VoxVoxel {
+  glm::ivec3 position;
+  int color;
+};
+
+bool ReadString(const std::string &data, size_t *position, size_t end,
+                std::string *value) {
+  uint32_t size;
+  if (!ReadValue(data, position, end, &size) || end - *position < size) {
+    return false;
+  }
+  value->assign(data, *position, size);
+  *position += size;
+  return true;
+}
+
+bool ReadDictionary(const std::string &data, size_t *position, size_t end,
+                    std::map<std::string, std::string> *dictionary) {
+  uint32_t size;
+  if (!ReadValue(data, position, end, &size)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < size; ++i) {
+    std::string key;
+    std::string value;
+    if (!ReadString(data, position, end, &key) ||
+        !ReadString(data, position, end, &value)) {
+      return false;
+    }
+    (*dictionary)[key] = value;
+  }
+  return true;
+}
+
+// Reads the nodes of the scene graph from the contents of a chunk. Returns
+// false if the chunk isn't valid.
+bool ReadVoxNode(const char *id, const std::string &data, size_t position,
+                 size_t end, std::map<int, VoxNode> *nodes) {
+  int32_t node_id;
+  std::map<std::string, std::string> attributes;
+  if (!ReadValue(data, &position, end, &node_id) ||
+      !ReadDictionary(data, &position, end, &attributes)) {
+    return false;
+  }
+  VoxNode &node = (*nodes)[node_id];
+  if (std::memcmp(id, "nTRN", 4) == 0) {
+    int32_t child_id;
+    int32_t reserved_id;
+    int32_t layer_id;
+    uint32_t num_frames;
+    if (!ReadValue(data, &position, end, &child_id) ||
+        !ReadValue(data, &position, end, &reserved_id) ||
+        !ReadValue(data, &position, end, &layer_id) ||
+        !ReadValue(data, &position, end, &num_frames)) {
+      return false;
+    }
+    node.children.push_back(child_id);
+    // Only the first frame of an animation is placed.
+    std::map<std::string, std::string> frame;
+    if (num_frames > 0 && ReadDictionary(data, &position, end, &frame) &&
+        frame.count("_t")) {
+      std::istringstream translation(frame["_t"]);
+      translation >> node.translation.x >> node.translation.y >>
+          node.translation.z;
+    }
+  } else if (std::memcmp(id, "nGRP", 4) == 0) {
+    uint32_t num_children;
+    if (!ReadValue(data, &position, end, &num_children)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < num_children; ++i) {
+      int32_t child_id;
+      if (!ReadValue(data, &position, end, &child_id)) {
+        return false;
+      }
+      node.children.push_back(child_id);
+    }
+  } else {
+    uint32_t num_models;
+    if (!ReadValue(data, &position, end, &num_models)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < num_models; ++i) {
+      int32_t model_id;
+      std::map<std::string, std::string> model_attributes;
+      if (!ReadValue(data, &position, end, &model_id) ||
+          !ReadDictionary(data, &position, end, &model_attributes)) {
+        return false;
+      }
+      node.models.push_back(model_id);
+    }
+  }
+  return true;
+}
+
+// Fills in the palette of files without one, which is the default palette of
+// MagicaVoxel: six levels of each channel from the brightest, with blue
+// changing fastest, followed by ramps of red, green, blue and gray.
+void GetDefaultVoxColors(int *colors) {
+  static const int kCubeLevels[] = {0xff, 0xcc, 0x99, 0x66, 0x33, 0x00};
+  static const int kRampLevels[] = {0xee, 0xdd, 0xbb, 0xaa, 0x88,
+                                    0x77, 0x55, 0x44, 0x22, 0x11};
+  int index = 0;
+  colors[index++] = 0;
+  for (int r : kCubeLevels) {
+    for (int g : kCubeLevels) {
+      for (int b : kCubeLevels) {
+        // Black is left for the end of the gray ramp.
+        if (r || g || b) {
+          colors[index++] = r << 16 | g << 8 | b;
+        }
+      }
+    }
+  }
+  for (int shift : {16, 8, 0}) {
+    for (int level : kRampLevels) {
+      colors[index++] = level << shift;
+    }
+  }
+  for (int level : kRampLevels) {
+    colors[index++] = level << 16 | level << 8 | level;
+  }
+}
+
+void PlaceVoxModel(const VoxModel &model, const glm::ivec3 &translation,
+                   const int *colors, std::vector<VoxVoxel> *voxels) {
+  // Models are centered on their translation.
+  glm::ivec3 corner = translation - model.size / 2;
+  for (size_t i = 0; i + 4 <= model.voxels.size(); i += 4) {
+    const uint8_t *voxel =
+        reinterpret_cast<const uint8_t *>(&model.voxels[i]);
+    if (voxel[3]) {
+      VoxVoxel placed;
+      placed.position = corner + glm::ivec3(voxel[0], voxel[1], voxel[2]);
+      placed.color = colors[voxel[3]];
+      voxels->push_back(placed);
+    }
+  }
+}
+
+bool PlaceVoxNode(const std::map<int, VoxNode> &nodes,
+                  const std::vector<VoxModel> &models, int node_id,
+                  glm::ivec3 translation, int depth, const int *colors,
+                  std::vector<VoxVoxel> *voxels) {
+  std::map<int, VoxNode>::const_iterator it = nodes.find(node_id);
+  if (it == nodes.end() || depth > kMaxVoxSceneDepth) {
+    return false;
+  }
+  const VoxNode &node = it->second;
+  translation += node.translation;
+  for (int model_id : node.models) {
+    if (model_id < 0 || static_cast<size_t>(model_id) >= models.size()) {
+      return false;
+    }
+    PlaceVoxModel(models[model_id], translation, colors, voxels);
+  }
+  for (int child_id : node.children) {
+    if (!PlaceVoxNode(nodes, models, child_id, translation, depth + 1,
+                      colors, voxels)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads the voxels of a .vox file as they are placed in its scene. Returns
+// false if the file isn't valid.
+bool ReadVox(const std::string &data, std::vector<VoxVoxel> *voxels) {
+  size_t position = 0;
+  size_t end = data.size();
+  char magic[sizeof(kVoxMagic)];
+  uint32_t version;
+  char main_id[4];
+  uint32_t main_size;
+  uint32_t main_children_size;
+  if (!ReadValue(data, &position, end, &magic) ||
+      std::memcmp(magic, kVoxMagic, sizeof(magic)) != 0 ||
+      !ReadValue(data, &position, end, &version) ||
+      !ReadValue(data, &position, end, &main_id) ||
+      std::memcmp(main_id, "MAIN", 4) != 0 ||
+      !ReadValue(data, &position, end, &main_size) ||
+      !ReadValue(data, &position, end, &main_children_size) ||
+      end - position < main_size) {
+    return false;
+  }
+  position += main_size;
+
+  std::vector<VoxModel> models;
+  std::map<int, VoxNode> nodes;
+  int colors[kVoxPaletteSize];
+  GetDefaultVoxColors(colors);
+  while (position < end) {
+    char id[4];
+    uint32_t size;
+    uint32_t children_size;
+    if (!ReadValue(data, &position, end, &id) ||
+        !ReadValue(data, &position, end, &size) ||
+        !ReadValue(data, &position, end, &children_size) ||
+        end - position < size) {
+      return false;
+    }
+    size_t chunk_end = position + size;
+    if (std::memcmp(id, "SIZE", 4) == 0) {
+      VoxModel model;
+      int32_t x;
+      int32_t y;
+      int32_t z;
+      if (!ReadValue(data, &position, chunk_end, &x) ||
+          !ReadValue(data, &position, chunk_end, &y) ||
+          !ReadValue(data, &position, chunk_end, &z)) {
+        return false;
+      }
+      model.size = glm::ivec3(x, y, z);
+      models.push_back(model);
+    } else if (std::memcmp(id, "XYZI", 4) == 0) {
+      uint32_t num_voxels;
+      if (models.empty() ||
+          !ReadValue(data, &position, chunk_end, &num_voxels) ||
+          (chunk_end - position) / 4 < num_voxels) {
+        return false;
+      }
+      models.back().voxels.assign(data, position, 4 * num_voxels);
+    } else if (std::memcmp(id, "RGBA", 4) == 0) {
+      // The colors are for indices from one up.
+      for (int i = 1; i < kVoxPaletteSize; ++i) {
+        uint8_t rgba[4];
+        if (!ReadValue(data, &position, chunk_end, &rgba)) {
+          return false;
+        }
+        colors[i] = rgba[0] << 16 | rgba[1] << 8 | rgba[2];
+      }
+    } else if (std::memcmp(id, "nTRN", 4) == 0 ||
+               std::memcmp(id, "nGRP", 4) == 0 ||
+               std::memcmp(id, "nSHP", 4) == 0) {
+      if (!ReadVoxNode(id, data, position, chunk_end, &nodes)) {
+        return false;
+      }
+    }
+    if (end - chunk_end < children_size) {
+      return false;
+    }
+    position = chunk_end + children_size;
+  }
+
+  // Black is the empty color of the world, so make it the nearest color
+  // instead.
+  for (int i = 1; i < kVoxPaletteSize; ++i) {
+    if (colors[i] == 0) {
+      colors[i] = 0x010101;
+    }
+  }
+  if (nodes.empty()) {
+    // Files without a scene graph have the models at the origin.
+    for (const VoxModel &model : models) {
+      PlaceVoxModel(model, model.size / 2, colors, voxels);
+    }
+    return true;
+  }
+  return PlaceVoxNode(nodes, models, 0, glm::ivec3(0), 0, colors, voxels);
+}
+
+// Reads the vertex positions and faces of a .obj file. Returns false if a
+// face refers to a vertex that doesn't exist.
+bool ReadObj(const std::string &data, TriangleMesh *mesh) {
+  const char *position = data.c_str();
+  const char *end = position + data.size();
+  std::vector<uint32_t> face;
+  while (position < end) {
+    const char *line_end = static_cast<const char *>(
+        std::memchr(position, '\n', end - position));
+    if (!line_end) {
+      line_end = end;
+    }
+    if (line_end - position > 2 && position[0] == 'v' &&
+        std::isspace(static_cast<unsigned char>(position[1]))) {
+      glm::vec3 vertex;
+      const char *number = position + 1;
+      for (int i = 0; i < 3; ++i) {
+        char *number_end;
+        vertex[i] = std::strtof(number, &number_end);
+        if (number_end == number || number_end > line_end) {
+          return false;
+        }
+        number = number_end;
+      }
+      mesh->vertices.push_back(vertex);
+    } else if (line_end - position > 2 && position[0] == 'f' &&
+               std::isspace(static_cast<unsigned char>(position[1]))) {
+      face.clear();
+      const char *token = position + 1;
+      while (true) {
+        while (token < line_end &&
+               std::isspace(static_cast<unsigned char>(*token))) {
+          ++token;
+        }
+        if (token == line_end) {
+          break;
+        }
+        // Only the first of the indices of each vertex is its position, and
+        // negative indices count back from the last vertex.
+        char *index_end;
+        long index = std::strtol(token, &index_end, 10);
+        long num_vertices = static_cast<long>(mesh->vertices.size());
+        if (index_end == token || index == 0 || index > num_vertices ||
+            index < -num_vertices) {
+          return false;
+        }
+        face.push_back(static_cast<uint32_t>(
+            index > 0 ? index - 1 : num_vertices + index));
+        token = index_end;
+        while (token < line_end &&
+               !std::isspace(static_cast<unsigned char>(*token))) {
+          ++token;
+        }
+      }
+      for (size_t i = 2; i < face.size(); ++i) {
+        mesh->indices.push_back(face[0]);
+        mesh->indices.push_back(face[i - 1]);
+        mesh->indices.push_back(face[i]);
+      }
+    }
+    position = line_end + 1;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool ImportVox(World *world, const std::string &path, LocationalCode code,
+               int dimension) {
+  std::string data;
+  std::vector<VoxVoxel> voxels;
+  if (!ReadFile(path, &data) || !ReadVox(data, &voxels)) {
+    return false;
+  }
+  data.clear();
+  data.shrink_to_fit();
+
+  glm::ivec3 min(0);
+  glm::ivec3 max(0);
+  if (!voxels.empty()) {
+    min = voxels[0].position;
+    max = voxels[0].position;
+    for (const VoxVoxel &voxel : voxels) {
+      min = glm::min(min, voxel.position);
+      max = glm::max(max, voxel.position);
+    }
+  }
+  uint32_t code_x;
+  uint32_t code_y;
+  uint32_t code_z;
+  code.GetCoordinates(&code_x, &code_y, &code_z);
+  int levels = dimension - code.dimension();
+  if (levels < 0) {
+    return false;
+  }
+  int64_t extent = 1ll << levels;
+  std::vector<World::BlockEdit> edits;
+  edits.reserve(voxels.size());
+  for (const VoxVoxel &voxel : voxels) {
+    // Turn the z axis up into the y axis up, keeping the scene from being
+    // mirrored.
+    int64_t x = voxel.position.x - min.x;
+    int64_t y = voxel.position.z - min.z;
+    int64_t z = max.y - voxel.position.y;
+    if (x < extent && y < extent && z < extent) {
+      World::BlockEdit edit;
+      edit.code = LocationalCode::FromCoordinates(
+          static_cast<uint32_t>((code_x << levels) + x),
+          static_cast<uint32_t>((code_y << levels) + y),
+          static_cast<uint32_t>((code_z << levels) + z), dimension);
+      edit.color = voxel.color;
+      edits.push_back(edit);
+    }
+  }
+  voxels.clear();
+  voxels.shrink_to_fit();
+
+  // Where models overlap, the ones placed later win.
+  std::stable_sort(edits.begin(), edits.end(),
+                   [](const World::BlockEdit &edit1,
+                      const World::BlockEdit &edit2) {
+                     return edit1.code.value() < edit2.code.value();
+                   });
+  size_t num_kept = 0;
+  for (size_t i = 0; i < edits.size(); ++i) {
+    if (num_kept > 0 && edits[num_kept - 1].code == edits[i].code) {
+      edits[num_kept - 1] = edits[i];
+    } else {
+      edits[num_kept++] = edits[i];
+    }
+  }
+  edits.resize(num_kept);
+  return BuildWorldBlock(world, code, dimension, edits);
+}
+
+bool ImportRaw(World *world, const std::string &path, const glm::uvec3 &size,
+               const std::vector<int> &colors, LocationalCode code,
+               int dimension) {
+  assert(colors.size() == 256);
+  int code_dimension = code.dimension();
+  int brick_dimension = world->brick_dimension();
+  if (dimension < code_dimension ||
+      (brick_dimension >= 0 && code_dimension > brick_dimension)) {
+    return false;
+  }
+  std::ifstream file(path, std::ios::binary);
+  uint64_t layer_size = static_cast<uint64_t>(size.x) * size.y;
+  if (!file || !file.seekg(0, std::ios::end) ||
+      static_cast<uint64_t>(file.tellg()) < layer_size * size.z ||
+      !file.seekg(0)) {
+    return false;
+  }
+
+  // The volume is built in chunks, a slab of them at a time.
+  uint32_t extent = 1u << (dimension - code_dimension);
+  glm::uvec3 clipped_size = glm::min(size, glm::uvec3(extent));
+  int chunk_dimension = std::max(code_dimension, dimension - kRawChunkLevels);
+  uint32_t chunk_size = 1u << (dimension - chunk_dimension);
+  uint32_t chunk_scale = 1u << (chunk_dimension - code_dimension);
+  uint32_t code_x;
+  uint32_t code_y;
+  uint32_t code_z;
+  code.GetCoordinates(&code_x, &code_y, &code_z);
+  glm::uvec3 first_chunk = glm::uvec3(code_x, code_y, code_z) * chunk_scale;
+
+  // Keep the block in case the file turns out to be unreadable.
+  Block old_block = world->TakeSnapshot(code);
+  world->RestoreSnapshot(code, Block());
+  std::vector<uint8_t> slab(layer_size * chunk_size);
+  bool imported = true;
+  for (uint32_t slab_z = 0; imported && slab_z < clipped_size.z;
+       slab_z += chunk_size) {
+    uint32_t num_layers = std::min(chunk_size, clipped_size.z - slab_z);
+    if (!file.read(reinterpret_cast<char *>(slab.data()),
+                   static_cast<std::streamsize>(layer_size * num_layers))) {
+      imported = false;
+      break;
+    }
+    std::vector<LocationalCode> chunks;
+    for (uint32_t y = 0; y < clipped_size.y; y += chunk_size) {
+      for (uint32_t x = 0; x < clipped_size.x; x += chunk_size) {
+        glm::uvec3 chunk =
+            first_chunk + glm::uvec3(x, y, slab_z) / chunk_size;
+        chunks.push_back(LocationalCode::FromCoordinates(
+            chunk.x, chunk.y, chunk.z, chunk_dimension));
+      }
+    }
+    imported = BuildWorldBlocks(
+        world, chunks, dimension,
+        [&](LocationalCode chunk, BlockBuilder *builder) {
+          uint32_t x;
+          uint32_t y;
+          uint32_t z;
+          chunk.GetCoordinates(&x, &y, &z);
+          glm::uvec3 corner = (glm::uvec3(x, y, z) - first_chunk) * chunk_size;
+          corner.z -= slab_z;
+          builder->AddGrid([&](const glm::uvec3 &voxel) {
+            glm::uvec3 position = corner + voxel;
+            if (position.x >= clipped_size.x ||
+                position.y >= clipped_size.y || position.z >= num_layers) {
+              return 0;
+            }
+            uint8_t value =
+                slab[position.x + size.x * (position.y +
+                                            size.y * static_cast<uint64_t>(
+                                                         position.z))];
+            return value ? colors[value] : 0;
+          });
+          return true;
+        });
+  }
+  if (!imported) {
+    world->RestoreSnapshot(code, old_block);
+  }
+  world->ReleaseSnapshot(&old_block);
+  return imported;
+}
+
+bool ImportObj(World *world, const std::string &path, LocationalCode code,
+               int dimension, int color, bool solid) {
+  std::string data;
+  TriangleMesh mesh;
+  if (!ReadFile(path, &data) || !ReadObj(data, &mesh)) {
+    return false;
+  }
+  data.clear();
+  data.shrink_to_fit();
+  return VoxelizeMesh(world, mesh, code, dimension, color, solid);
+}
+
+std::vector<int> GetGrayscaleColors() {
+  std::vector<int> colors(256);
+  for (int i = 0; i < 256; ++i) {
+    colors[i] = i << 16 | i << 8 | i;
+  }
+  return colors;
+}
@@ -0,0 +1,63 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef VOXEL_IMPORT_H_
+#define VOXEL_IMPORT_H_
+
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "locational_code.h"
+#include "mesh_voxelizer.h"
+#include "world.h"
+
+// Imports models made with other tools into a block of a world, which is
+// replaced by them. Each voxel becomes a block of the given dimension, with the
+// corner of the data at the corner of the block, and voxels that don't fit
+// into the block are left out. The blocks are built with world_builder.h, so
+// the same limits on the dimensions apply.
+
+// Imports the models of a MagicaVoxel .vox file, placed by the translations
+// in its scene graph. Rotations are ignored. The z axis of the file, which
+// points up, becomes the y axis of the world. The voxels are collected
+// without ever allocating the volume they span. Returns false, leaving the
+// world unchanged, if the file can't be read.
+bool ImportVox(World *world, const std::string &path, LocationalCode code,
+               int dimension);
+
+// Imports a raw volume of the given size, which is a file of one byte per
+// voxel ordered by x, then y, then z. Nonzero bytes are looked up in 256
+// colors, and zero bytes are empty. The file is read in slabs as thick as
+// the blocks the volume is built in, so only one slab is ever in memory.
+// Returns false, leaving the world unchanged, if the file can't be read or
+// is too small.
+bool ImportRaw(World *world, const std::string &path, const glm::uvec3 &size,
+               const std::vector<int> &colors, LocationalCode code,
+               int dimension);
+
+// Imports the triangles of a Wavefront .obj file in one color, voxelized as
+// described in mesh_voxelizer.h, which scales the mesh to fit the block.
+// Faces with more than three vertices are split into fans of triangles, and
+// everything but the positions of the vertices and the faces is ignored.
+// Returns false, leaving the world unchanged, if the file can't be read.
+bool ImportObj(World *world, const std::string &path, LocationalCode code,
+               int dimension, int color, bool solid);
+
+// Returns 256 colors from black to white, for volumes of densities.
+std::vector<int> GetGrayscaleColors();
+
+#endif  // VOXEL_IMPORT_H_
@@ -0,0 +1,198 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#include "wide_tree.h"
+
+#include <algorithm>
+#include <new>
+
+WideTree::WideTree() : root_(nullptr), num_nodes_(0) {}
+
+WideTree::~WideTree() {
+  Clear();
+}
+
+void WideTree::Clear() {
+  FreeNode(root_);
+  root_ = nullptr;
+}
+
+void WideTree::Build(const Block &root) {
+  Clear();
+  if (HasNode(root)) {
+    root_ = BuildNode(&root, nullptr, LocationalCode(), 0);
+  }
+}
+
+void WideTree::UpdatePath(const Block &root, LocationalCode code) {
+  if (!HasNode(root)) {
+    Clear();
+    return;
+  }
+  Node *old_root = root_;
+  root_ = BuildNode(&root, old_root, code, 0);
+  FreeNode(old_root);
+}
+
+const Block *WideTree::GetBlock(const Block &root, LocationalCode code,
+                                int *dimension) const {
+  int code_dimension = code.dimension();
+  if (!root_ || code_dimension == 0) {
+    *dimension = 0;
+    return &root;
+  }
+
+  const Node *node = root_;
+  for (int depth = 0;; depth += 2) {
+    if (code_dimension == depth) {
+      *dimension = depth;
+      return node->block;
+    }
+    int first = code.child_index(depth, code_dimension);
+    if (code_dimension == depth + 1) {
+      *dimension = depth + 1;
+      return node->block->child(first);
+    }
+
+    int cell = first * Block::kNumChildren +
+               code.child_index(depth + 1, code_dimension);
+    uint64_t bit = 1ull << cell;
+    if (!(node->cell_mask & bit)) {
+      return nullptr;
+    }
+    const Cell &found = node->cells[CountCells(node->cell_mask & (bit - 1))];
+    if (node->coarse_mask & bit) {
+      *dimension = depth + 1;
+      return found.block;
+    }
+    if (!(node->node_mask & bit)) {
+      *dimension = depth + 2;
+      return found.block;
+    }
+    node = found.node;
+  }
+}
+
+WideTree::Node *WideTree::BuildNode(const Block *block, Node *old_node,
+                                    LocationalCode code, int depth) {
+  // A child that is a leaf or a brick covers all eight of its cells, and
+  // the other children have a cell for each of their own children.
+  uint64_t cell_mask = 0;
+  uint64_t coarse_mask = 0;
+  for (int first = 0; first < Block::kNumChildren; ++first) {
+    const Block *child = block->child(first);
+    if (!child) {
+      continue;
+    }
+    int shift = first * Block::kNumChildren;
+    if (!HasNode(*child)) {
+      coarse_mask |= 0xffull << shift;
+    } else {
+      cell_mask |= static_cast<uint64_t>(child->child_mask()) << shift;
+    }
+  }
+  cell_mask |= coarse_mask;
+
+  Node *node = AllocateNode(CountCells(cell_mask));
+  node->block = block;
+  node->cell_mask = cell_mask;
+  node->node_mask = 0;
+  node->coarse_mask = coarse_mask;
+
+  // The nodes below the edited block are built again, and the nodes on the
+  // path to it are updated the same way.
+  int code_dimension = code.dimension();
+  int edited_first = code_dimension > depth
+                         ? code.child_index(depth, code_dimension)
+                         : -1;
+  int path_cell = -1;
+  if (code_dimension > depth + 1) {
+    path_cell = edited_first * Block::kNumChildren +
+                code.child_index(depth + 1, code_dimension);
+  }
+  bool keeps_cells = old_node && code_dimension > depth;
+
+  Cell *cell_data = node->cells;
+  for (int first = 0; first < Block::kNumChildren; ++first) {
+    const Block *child = block->child(first);
+    if (!child) {
+      continue;
+    }
+    for (int second = 0; second < Block::kNumChildren; ++second) {
+      int cell = first * Block::kNumChildren + second;
+      uint64_t bit = 1ull << cell;
+      Cell new_cell;
+      if (!HasNode(*child)) {
+        new_cell.block = child;
+      } else {
+        const Block *grandchild = child->child(second);
+        if (!grandchild) {
+          continue;
+        }
+        new_cell.block = grandchild;
+        if (HasNode(*grandchild)) {
+          bool edited = code_dimension == depth + 1
+                            ? first == edited_first
+                            : code_dimension == depth + 2 &&
+                                  cell == path_cell;
+          Node *old_child = nullptr;
+          if (keeps_cells && !edited) {
+            old_child = FindNode(old_node, cell);
+          }
+          if (old_child && cell == path_cell) {
+            new_cell.node = BuildNode(grandchild, old_child, code, depth + 2);
+          } else if (old_child && cell != path_cell) {
+            // Nothing below the cell changed, but its block may have moved
+            // along with its siblings.
+            old_child->block = grandchild;
+            new_cell.node = old_child;
+            old_node->cells[CountCells(old_node->cell_mask & (bit - 1))]
+                .node = nullptr;
+          } else {
+            new_cell.node = BuildNode(grandchild, nullptr, code, depth + 2);
+          }
+          node->node_mask |= bit;
+        }
+      }
+      *cell_data++ = new_cell;
+    }
+  }
+  return node;
+}
+
+WideTree::Node *WideTree::FindNode(const Node *node, int cell) const {
+  uint64_t bit = 1ull << cell;
+  if (!(node->node_mask & bit)) {
+    return nullptr;
+  }
+  return node->cells[CountCells(node->cell_mask & (bit - 1))].node;
+}
+
+WideTree::Node *WideTree::AllocateNode(int num_cells) {
+  // A node always has at least the one cell it's declared with.
+  size_t size = sizeof(Node) + (std::max(num_cells, 1) - 1) * sizeof(Cell);
+  ++num_nodes_;
+  return static_cast<Node *>(::operator new(size));
+}
+
+void WideTree::FreeNode(Node *node) {
+  if (!node) {
+    return;
+  }
+  for (int cell = 0; cell < kNumCells; ++cell) {
+    FreeNode(FindNode(node, cell));
+  }
+  ::operator delete(node);
+  --num_nodes_;
+}
@@ -0,0 +1,103 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#ifndef WIDE_TREE_H_
+#define WIDE_TREE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "block.h"
+#include "locational_code.h"
+
+// A 64-ary tree over the blocks of an octree, where each node covers the
+// 4 x 4 x 4 cells two levels below an octree block. A point query takes one
+// dependent load per two octree levels, and finding a cell takes a single
+// popcount of the 64-bit mask of the cells that exist.
+//
+// The cells refer to the blocks of the octree, which stays the storage of the
+// world, so the tree has to be told about every edit like a BlockIndex.
+class WideTree {
+ public:
+  static const int kNumCells = Block::kNumChildren * Block::kNumChildren;
+
+  WideTree();
+  ~WideTree();
+
+  void Clear();
+  void Build(const Block &root);
+  // Updates the tree after the block with the given code has been edited
+  // and the path to it has been simplified. Only the nodes along the path
+  // and below the block are rebuilt.
+  void UpdatePath(const Block &root, LocationalCode code);
+
+  // Returns the smallest block on the path to the code together with its
+  // dimension, or null if the path leads to a missing block.
+  const Block *GetBlock(const Block &root, LocationalCode code,
+                        int *dimension) const;
+
+  size_t num_nodes() const { return num_nodes_; }
+
+  static int CountCells(uint64_t mask) {
+    mask = mask - ((mask >> 1) & 0x5555555555555555ull);
+    mask = (mask & 0x3333333333333333ull) +
+           ((mask >> 2) & 0x3333333333333333ull);
+    mask = (mask + (mask >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return static_cast<int>((mask * 0x0101010101010101ull) >> 56);
+  }
+
+ private:
+  struct Node;
+
+  // Either the block of a cell or the node below it.
+  union Cell {
+    const Block *block;
+    Node *node;
+  };
+
+  struct Node {
+    const Block *block;
+    // The cells that have a block.
+    uint64_t cell_mask;
+    // The cells that have a node below them.
+    uint64_t node_mask;
+    // The cells whose block is a leaf one level up, covering eight cells.
+    uint64_t coarse_mask;
+    // The existing cells, where the position of a cell is the number of
+    // existing cells before it. They're allocated along with the node, so
+    // finding a cell doesn't take another dependent load.
+    Cell cells[1];
+  };
+
+  WideTree(const WideTree &) = delete;
+  WideTree &operator=(const WideTree &) = delete;
+
+  static bool HasNode(const Block &block) {
+    return !block.is_leaf() && !block.is_brick();
+  }
+
+  // Builds the node of an octree block. The nodes below the cells of the old
+  // node are kept, except for the cells below the edited block.
+  Node *BuildNode(const Block *block, Node *old_node, LocationalCode code,
+                  int depth);
+  Node *FindNode(const Node *node, int cell) const;
+  // Allocates a node with room for the given number of cells.
+  Node *AllocateNode(int num_cells);
+  void FreeNode(Node *node);
+
+  Node *root_;
+  size_t num_nodes_;
+};
+
+#endif  // WIDE_TREE_H_
@@ -0,0 +1,751 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "world.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+
+#include "block_traversal.h"
+#include "file_utilities.h"
+#include "world_file.h"
+
+// Beyond this many changes between notifications, the deepest changes are
+// merged into their parents until at most half as many are left.
+static const size_t kMaxChanges = 4096;
+
+// Gets the cube of voxels of a brick that a block below the brick covers,
+// and returns the number of levels the block is below the brick. Blocks
+// below the voxels are rounded up to their voxel.
+static int GetVoxelCube(LocationalCode code, int brick_dimension,
+                        glm::uvec3 *corner, uint32_t *size) {
+  int code_dimension = code.dimension();
+  assert(code_dimension > brick_dimension);
+  int levels = code_dimension - brick_dimension;
+  if (levels > Block::kBrickDimension) {
+    levels = Block::kBrickDimension;
+  }
+  LocationalCode voxel_code(
+      code.value() >> (3 * (code_dimension - brick_dimension - levels)));
+  uint32_t x, y, z;
+  voxel_code.GetCoordinates(&x, &y, &z);
+  uint32_t mask = (1u << levels) - 1;
+  int shift = Block::kBrickDimension - levels;
+  *corner = glm::uvec3((x & mask) << shift, (y & mask) << shift,
+                       (z & mask) << shift);
+  *size = 1u << shift;
+  return levels;
+}
+
+World::World(float size)
+    : size_(size), palette_(), pool_(&palette_), image_(), root_(),
+      brick_dimension_(-1), voxel_blocks_(1),
+      indexed_(false), index_(),
+      uses_wide_tree_(false), wide_tree_(),
+      generation_(0), changes_(), listeners_() {}
+
+World::~World() {
+}
+
+void World::Clear() {
+  pool_.Reset();
+  palette_.Clear();
+  voxel_blocks_.resize(1);
+  root_ = Block();
+  image_.Close();
+  BuildIndexes();
+
+  // The blocks from before are gone, so there is nothing to compare with.
+  ++generation_;
+  changes_.clear();
+  RecordChange(LocationalCode());
+}
+
+bool World::Save(const std::string &path,
+                 WorldCompression compression) const {
+  std::ofstream file(path, std::ios::binary);
+  return file && WriteWorld(root_, palette_, brick_dimension_, compression,
+                            &file);
+}
+
+bool World::Load(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    Clear();
+    return false;
+  }
+  return Load(&file);
+}
+
+bool World::Load(std::istream *stream) {
+  Clear();
+  int brick_dimension;
+  if (!ReadWorld(stream, &pool_, &palette_, &root_, &brick_dimension)) {
+    Clear();
+    return false;
+  }
+  brick_dimension_ = brick_dimension;
+  AddVoxelBlocks();
+  BuildIndexes();
+  return true;
+}
+
+bool World::SaveImage(const std::string &path) const {
+  // Write to a new file and move it into place, since the old one may be
+  // mapped.
+  std::string new_path = path + ".new";
+  {
+    std::ofstream file(new_path, std::ios::binary);
+    if (!file ||
+        !WriteWorldImage(root_, palette_, brick_dimension_, &file)) {
+      file.close();
+      std::remove(new_path.c_str());
+      return false;
+    }
+  }
+  return ReplaceFile(new_path, path);
+}
+
+bool World::LoadImage(const std::string &path) {
+  Clear();
+  if (!image_.Open(path)) {
+    return false;
+  }
+  int brick_dimension;
+  const Block *root = ReadWorldImage(image_, &palette_, &brick_dimension);
+  if (!root) {
+    Clear();
+    return false;
+  }
+  root_ = *root;
+  brick_dimension_ = brick_dimension;
+  AddVoxelBlocks();
+  BuildIndexes();
+  return true;
+}
+
+void World::AddListener(WorldListener *listener) {
+  listeners_.push_back(listener);
+}
+
+void World::RemoveListener(WorldListener *listener) {
+  std::vector<WorldListener *>::iterator position =
+      std::find(listeners_.begin(), listeners_.end(), listener);
+  if (position != listeners_.end()) {
+    listeners_.erase(position);
+  }
+}
+
+void World::NotifyListeners() {
+  if (changes_.empty()) {
+    return;
+  }
+  // Changes are either nested or disjoint. Ordered by their first
+  // descendant, with larger blocks first, every change comes right after
+  // the changes containing it.
+  std::sort(changes_.begin(), changes_.end(),
+            [](const WorldChange &change1, const WorldChange &change2) {
+              uint64_t first1 =
+                  change1.code.first_descendant(kMaxDimension).value();
+              uint64_t first2 =
+                  change2.code.first_descendant(kMaxDimension).value();
+              if (first1 != first2) {
+                return first1 < first2;
+              }
+              return change1.code.value() < change2.code.value();
+            });
+  std::vector<WorldChange> changes;
+  uint64_t last = 0;
+  for (const WorldChange &change : changes_) {
+    if (!changes.empty() &&
+        change.code.first_descendant(kMaxDimension).value() <= last) {
+      changes.back().generation =
+          std::max(changes.back().generation, change.generation);
+      continue;
+    }
+    changes.push_back(change);
+    last = change.code.last_descendant(kMaxDimension).value();
+  }
+  changes_.clear();
+
+  for (WorldListener *listener : listeners_) {
+    listener->WorldChanged(changes);
+  }
+}
+
+void World::RestoreSnapshot(const Block &snapshot) {
+  Block old_root = root_;
+  root_ = snapshot.Share(&pool_);
+  RecordChanges(old_root);
+  old_root.Release(&pool_);
+  BuildIndexes();
+}
+
+Block World::TakeSnapshot(LocationalCode code) {
+  assert(GetEditDimension(code.dimension()) == code.dimension());
+  int dimension;
+  const Block *block = GetBlock(code, &dimension);
+  if (!block) {
+    return Block();
+  }
+  if (dimension < code.dimension()) {
+    return Block(block->value());
+  }
+  return block->Share(&pool_);
+}
+
+void World::RestoreSnapshot(LocationalCode code, const Block &snapshot) {
+  int dimension = code.dimension();
+  assert(GetEditDimension(dimension) == dimension);
+  if (indexed_) {
+    int existing_dimension;
+    const Block *existing_block = GetBlock(code, &existing_dimension);
+    if (existing_block && existing_dimension == dimension) {
+      index_.RemoveSubtree(*existing_block, code);
+    }
+  }
+
+  Block old_root = root_.Share(&pool_);
+  Block *path[kMaxDimension + 1];
+  path[0] = &root_;
+  for (int i = 0; i < dimension; ++i) {
+    path[i + 1] =
+        path[i]->AddChild(code.child_index(i, dimension), &pool_);
+  }
+  path[dimension]->SetValue(0, &pool_);
+  *path[dimension] = snapshot.Share(&pool_);
+  for (int i = dimension - 1; i >= 0; --i) {
+    path[i]->SimplifyChildren(&pool_);
+  }
+  RecordChanges(old_root);
+  old_root.Release(&pool_);
+
+  UpdateIndexes(code);
+}
+
+Block World::ImportSnapshot(const Block &tree, const Palette &palette) {
+  std::vector<uint16_t> indices(palette.size());
+  bool same_indices = true;
+  for (int i = 0; i < palette.size(); ++i) {
+    indices[i] = i == 0 ? 0 : AddColor(palette.color(i));
+    same_indices = same_indices && indices[i] == i;
+  }
+  if (same_indices) {
+    BlockPool::CopyMap copies;
+    return pool_.CopyTree(tree, &copies);
+  }
+  return CopyRemapped(tree, indices);
+}
+
+Block World::CopyRemapped(const Block &block,
+                          const std::vector<uint16_t> &indices) {
+  Block copy;
+  if (block.is_leaf()) {
+    copy.SetValue(indices[block.value()], &pool_);
+  } else if (block.is_brick()) {
+    uint16_t *voxels = copy.MutableVoxels(&pool_);
+    for (int i = 0; i < Block::kBrickVolume; ++i) {
+      voxels[i] = indices[block.voxels()[i]];
+    }
+    copy.SimplifyVoxels(&pool_);
+  } else {
+    Block *children = copy.SetChildren(block.child_mask(), &pool_);
+    for (int i = 0, position = 0; i < Block::kNumChildren; ++i) {
+      const Block *child = block.child(i);
+      if (child) {
+        children[position++] = CopyRemapped(*child, indices);
+      }
+    }
+    copy.SimplifyChildren(&pool_);
+  }
+  return copy;
+}
+
+void World::Defragment(const std::vector<Block *> &snapshots) {
+  BlockPool pool(&palette_);
+  pool.set_deduplicates(pool_.deduplicates());
+  BlockPool::CopyMap copies;
+  Block root = pool.CopyTree(root_, &copies);
+  for (Block *snapshot : snapshots) {
+    *snapshot = pool.CopyTree(*snapshot, &copies);
+  }
+  // The old pool is freed as a whole, without releasing its blocks, and
+  // nothing refers to the image anymore.
+  pool_.Swap(&pool);
+  root_ = root;
+  image_.Close();
+  BuildIndexes();
+}
+
+void World::SetDeduplicates(bool deduplicates) {
+  pool_.set_deduplicates(deduplicates);
+  // Simplifying interns the blocks that aren't shared from the bottom up.
+  // Blocks shared with snapshots are skipped, so they are only interned once
+  // edits copy them.
+  root_.Simplify(&pool_);
+  BuildIndexes();
+}
+
+void World::SetBrickDimension(int dimension) {
+  assert(dimension <= kMaxDimension - Block::kBrickDimension);
+  // Converting visits every block, which would read all of a mapped image.
+  if ((dimension < 0 ? -1 : dimension) == brick_dimension_) {
+    return;
+  }
+  brick_dimension_ = dimension < 0 ? -1 : dimension;
+  Block old_root = root_.Share(&pool_);
+  ConvertBricks(&root_, 0);
+  RecordChanges(old_root);
+  old_root.Release(&pool_);
+  BuildIndexes();
+}
+
+void World::SetIndexed(bool indexed) {
+  indexed_ = indexed;
+  if (indexed_) {
+    index_.Build(root_);
+  } else {
+    index_.Clear();
+  }
+}
+
+void World::SetUsesWideTree(bool uses_wide_tree) {
+  uses_wide_tree_ = uses_wide_tree;
+  if (uses_wide_tree_) {
+    wide_tree_.Build(root_);
+  } else {
+    wide_tree_.Clear();
+  }
+}
+
+const Block *World::FindBlock(LocationalCode code, int *dimension) const {
+  assert(indexed_);
+  const Block *block = index_.FindDeepest(code, dimension);
+  if (block && block->is_brick() && *dimension < code.dimension()) {
+    return GetVoxelBlock(*block, code, dimension);
+  }
+  // A block that isn't a leaf means that the path leads to a missing child.
+  if (!block || (*dimension < code.dimension() && !block->is_leaf())) {
+    return nullptr;
+  }
+  return block;
+}
+
+bool World::GetCode(float x, float y, float z, int dimension,
+                    LocationalCode *code) const {
+  assert(dimension >= 0 && dimension <= kMaxDimension);
+  if (x < 0.0f || y < 0.0f || z < 0.0f ||
+      x >= size_ || y >= size_ || z >= size_) {
+    return false;
+  }
+
+  // Convert to integer coordinates once, after which the path through the
+  // octree is exact at every dimension.
+  double scale = static_cast<double>(1u << dimension) / size_;
+  uint32_t max_coordinate = (1u << dimension) - 1;
+  uint32_t ix = static_cast<uint32_t>(x * scale);
+  uint32_t iy = static_cast<uint32_t>(y * scale);
+  uint32_t iz = static_cast<uint32_t>(z * scale);
+  *code = LocationalCode::FromCoordinates(
+      ix < max_coordinate ? ix : max_coordinate,
+      iy < max_coordinate ? iy : max_coordinate,
+      iz < max_coordinate ? iz : max_coordinate, dimension);
+  return true;
+}
+
+const Block *World::GetBlock(LocationalCode code, int *dimension) const {
+  if (uses_wide_tree_) {
+    const Block *block = wide_tree_.GetBlock(root_, code, dimension);
+    if (block && block->is_brick() && *dimension < code.dimension()) {
+      return GetVoxelBlock(*block, code, dimension);
+    }
+    return block;
+  }
+
+  int code_dimension = code.dimension();
+  const Block *block = &root_;
+  int i = 0;
+  for (; i < code_dimension && !block->is_leaf(); ++i) {
+    if (block->is_brick()) {
+      *dimension = i;
+      return GetVoxelBlock(*block, code, dimension);
+    }
+    block = block->child(code.child_index(i, code_dimension));
+    if (!block) {
+      return nullptr;
+    }
+  }
+  *dimension = i;
+  return block;
+}
+
+const Block *World::GetBlock(float x, float y, float z,
+                             int *dimension) const {
+  LocationalCode code;
+  if (!GetCode(x, y, z, kMaxDimension, &code)) {
+    return nullptr;
+  }
+  return GetBlock(code, dimension);
+}
+
+void World::SetBlock(LocationalCode code, int color) {
+  int dimension = code.dimension();
+  assert(dimension <= kMaxDimension);
+  if (indexed_) {
+    int existing_dimension;
+    const Block *existing_block = GetBlock(code, &existing_dimension);
+    if (existing_block && existing_dimension == dimension) {
+      index_.RemoveSubtree(*existing_block, code);
+    }
+  }
+
+  Block old_root = root_.Share(&pool_);
+  int edit_dimension = GetEditDimension(dimension);
+  Block *path[kMaxDimension + 1];
+  path[0] = &root_;
+  for (int i = 0; i < edit_dimension; ++i) {
+    path[i + 1] =
+        path[i]->AddChild(code.child_index(i, dimension), &pool_);
+  }
+
+  if (edit_dimension < dimension) {
+    SetVoxels(path[edit_dimension], code, AddColor(color));
+  } else {
+    path[dimension]->SetValue(AddColor(color), &pool_);
+  }
+
+  // The rest of the tree is already as simple as it gets, so only the blocks
+  // along the path need to be simplified, deepest first.
+  for (int i = edit_dimension - 1; i >= 0; --i) {
+    path[i]->SimplifyChildren(&pool_);
+  }
+  RecordChanges(old_root);
+  old_root.Release(&pool_);
+
+  UpdateIndexes(code);
+}
+
+void World::SetBlock(float x, float y, float z, int dimension, int color) {
+  LocationalCode code;
+  if (GetCode(x, y, z, dimension, &code)) {
+    SetBlock(code, color);
+  }
+}
+
+void World::FillBox(const glm::uvec3 &min, const glm::uvec3 &max,
+                    int dimension, int color) {
+  assert(dimension >= 0 && dimension <= kMaxDimension);
+  uint32_t size = 1u << dimension;
+  glm::uvec3 box_min = min;
+  glm::uvec3 box_max = glm::min(max, glm::uvec3(size));
+  if (box_min.x >= box_max.x || box_min.y >= box_max.y ||
+      box_min.z >= box_max.z) {
+    return;
+  }
+  // Boxes below the voxels of bricks are rounded out to whole voxels.
+  int voxel_dimension = brick_dimension_ + Block::kBrickDimension;
+  if (has_bricks() && dimension > voxel_dimension) {
+    uint32_t scale = 1u << (dimension - voxel_dimension);
+    box_min /= scale;
+    box_max = (box_max + (scale - 1)) / scale;
+    dimension = voxel_dimension;
+    size = 1u << dimension;
+  }
+
+  // Everything that changes is below the smallest block containing the box.
+  LocationalCode first = LocationalCode::FromCoordinates(
+      box_min.x, box_min.y, box_min.z, dimension);
+  LocationalCode last = LocationalCode::FromCoordinates(
+      box_max.x - 1, box_max.y - 1, box_max.z - 1, dimension);
+  while (first != last) {
+    first = first.parent();
+    last = last.parent();
+  }
+  if (indexed_) {
+    int existing_dimension;
+    const Block *existing_block = GetBlock(first, &existing_dimension);
+    if (existing_block && existing_dimension == first.dimension()) {
+      index_.RemoveSubtree(*existing_block, first);
+    }
+  }
+
+  Block old_root = root_.Share(&pool_);
+  FillBlock(&root_, 0, glm::uvec3(0), size, box_min, box_max,
+            AddColor(color));
+  RecordChanges(old_root);
+  old_root.Release(&pool_);
+
+  UpdateIndexes(first);
+}
+
+void World::FillBox(const glm::vec3 &min, const glm::vec3 &max,
+                    int dimension, int color) {
+  assert(dimension >= 0 && dimension <= kMaxDimension);
+  float scale = static_cast<float>(1u << dimension) / size_;
+  glm::vec3 block_min = glm::floor(glm::max(min, glm::vec3(0.0f)) * scale);
+  glm::vec3 block_max = glm::ceil(glm::min(max, glm::vec3(size_)) * scale);
+  if (block_min.x >= block_max.x || block_min.y >= block_max.y ||
+      block_min.z >= block_max.z) {
+    return;
+  }
+  FillBox(glm::uvec3(block_min), glm::uvec3(block_max), dimension, color);
+}
+
+void World::BuildIndexes() {
+  if (indexed_) {
+    index_.Build(root_);
+  }
+  if (uses_wide_tree_) {
+    wide_tree_.Build(root_);
+  }
+}
+
+void World::UpdateIndexes(LocationalCode code) {
+  if (indexed_) {
+    index_.UpdatePath(root_, code);
+  }
+  if (uses_wide_tree_) {
+    wide_tree_.UpdatePath(root_, code);
+  }
+}
+
+void World::RecordChanges(const Block &old_root) {
+  ++generation_;
+  RecordDifferences(old_root, root_, LocationalCode());
+}
+
+void World::RecordDifferences(const Block &old_block, const Block &new_block,
+                              LocationalCode code) {
+  // Blocks that are still shared are unchanged, along with their subtrees.
+  if (old_block.IsIdentical(new_block)) {
+    return;
+  }
+  if (old_block.is_leaf() || old_block.is_brick() ||
+      new_block.is_leaf() || new_block.is_brick()) {
+    RecordChange(code);
+    return;
+  }
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    const Block *old_child = old_block.child(i);
+    const Block *new_child = new_block.child(i);
+    if (old_child || new_child) {
+      RecordDifferences(old_child ? *old_child : Block(),
+                        new_child ? *new_child : Block(), code.child(i));
+    }
+  }
+}
+
+void World::RecordChange(LocationalCode code) {
+  // A change of the whole world contains every other change.
+  if (!changes_.empty() && changes_.front().code == LocationalCode()) {
+    changes_.front().generation = generation_;
+    return;
+  }
+  if (code == LocationalCode()) {
+    changes_.clear();
+  }
+  changes_.push_back(MakeChange(code, generation_));
+  if (changes_.size() >= kMaxChanges) {
+    MergeChanges();
+  }
+}
+
+WorldChange World::MakeChange(LocationalCode code,
+                              uint64_t generation) const {
+  uint32_t x;
+  uint32_t y;
+  uint32_t z;
+  code.GetCoordinates(&x, &y, &z);
+  float block_size = size_ / static_cast<float>(1u << code.dimension());
+  WorldChange change;
+  change.code = code;
+  change.min = glm::vec3(x, y, z) * block_size;
+  change.max = change.min + block_size;
+  change.generation = generation;
+  return change;
+}
+
+void World::MergeChanges() {
+  // Merging keeps the changed regions as small as the count allows, so that
+  // listeners like the journal still only see the blocks that changed.
+  std::map<uint64_t, uint64_t> generations;
+  int dimension = 0;
+  for (const WorldChange &change : changes_) {
+    dimension = std::max(dimension, change.code.dimension());
+  }
+  if (dimension == 0) {
+    return;
+  }
+  while (dimension > 0) {
+    generations.clear();
+    for (const WorldChange &change : changes_) {
+      LocationalCode code = change.code;
+      while (code.dimension() >= dimension) {
+        code = code.parent();
+      }
+      uint64_t &generation = generations[code.value()];
+      generation = std::max(generation, change.generation);
+    }
+    --dimension;
+    if (generations.size() <= kMaxChanges / 2) {
+      break;
+    }
+  }
+  changes_.clear();
+  for (const auto &entry : generations) {
+    changes_.push_back(MakeChange(LocationalCode(entry.first),
+                                  entry.second));
+  }
+}
+
+uint16_t World::AddColor(int color) {
+  uint16_t index = palette_.Add(color);
+  AddVoxelBlocks();
+  return index;
+}
+
+void World::AddVoxelBlocks() {
+  while (voxel_blocks_.size() < static_cast<size_t>(palette_.size())) {
+    voxel_blocks_.push_back(
+        Block(static_cast<uint16_t>(voxel_blocks_.size())));
+  }
+}
+
+const Block *World::GetVoxelBlock(const Block &brick, LocationalCode code,
+                                  int *dimension) const {
+  glm::uvec3 corner;
+  uint32_t size;
+  int levels = GetVoxelCube(code, brick_dimension_, &corner, &size);
+  uint16_t value = brick.voxel(corner.x, corner.y, corner.z);
+  for (uint32_t z = corner.z; z < corner.z + size; ++z) {
+    for (uint32_t y = corner.y; y < corner.y + size; ++y) {
+      for (uint32_t x = corner.x; x < corner.x + size; ++x) {
+        // Voxels that differ are only smaller blocks inside the brick.
+        if (brick.voxel(x, y, z) != value) {
+          return &brick;
+        }
+      }
+    }
+  }
+  *dimension = brick_dimension_ + levels;
+  return &voxel_blocks_[value];
+}
+
+void World::SetVoxels(Block *brick, LocationalCode code, uint16_t value) {
+  glm::uvec3 corner;
+  uint32_t size;
+  GetVoxelCube(code, brick_dimension_, &corner, &size);
+  uint16_t *voxels = brick->MutableVoxels(&pool_);
+  for (uint32_t z = corner.z; z < corner.z + size; ++z) {
+    for (uint32_t y = corner.y; y < corner.y + size; ++y) {
+      for (uint32_t x = corner.x; x < corner.x + size; ++x) {
+        voxels[Block::GetVoxelIndex(x, y, z)] = value;
+      }
+    }
+  }
+  brick->SimplifyVoxels(&pool_);
+}
+
+void World::FillBlock(Block *block, int dimension, const glm::uvec3 &corner,
+                      uint32_t size, const glm::uvec3 &min,
+                      const glm::uvec3 &max, uint16_t value) {
+  if (corner.x >= min.x && corner.x + size <= max.x &&
+      corner.y >= min.y && corner.y + size <= max.y &&
+      corner.z >= min.z && corner.z + size <= max.z) {
+    block->SetValue(value, &pool_);
+    return;
+  }
+  if (block->is_leaf() && block->value() == value) {
+    return;
+  }
+  if (has_bricks() && dimension == brick_dimension_) {
+    FillVoxels(block, corner, size, min, max, value);
+    return;
+  }
+
+  uint32_t child_size = size / 2;
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    glm::uvec3 child_corner(corner.x + ChildOffsetX(i) * child_size,
+                            corner.y + ChildOffsetY(i) * child_size,
+                            corner.z + ChildOffsetZ(i) * child_size);
+    if (child_corner.x >= max.x || child_corner.x + child_size <= min.x ||
+        child_corner.y >= max.y || child_corner.y + child_size <= min.y ||
+        child_corner.z >= max.z || child_corner.z + child_size <= min.z) {
+      continue;
+    }
+    // Clearing a missing child doesn't change anything.
+    if (!value && !block->child(i) && !block->value()) {
+      continue;
+    }
+    FillBlock(block->AddChild(i, &pool_), dimension + 1, child_corner,
+              child_size, min, max, value);
+  }
+  block->SimplifyChildren(&pool_);
+}
+
+void World::FillVoxels(Block *brick, const glm::uvec3 &corner, uint32_t size,
+                       const glm::uvec3 &min, const glm::uvec3 &max,
+                       uint16_t value) {
+  uint32_t scale = Block::kBrickSize / size;
+  glm::uvec3 voxel_min = (glm::max(min, corner) - corner) * scale;
+  glm::uvec3 voxel_max =
+      (glm::min(max, corner + glm::uvec3(size)) - corner) * scale;
+  uint16_t *voxels = brick->MutableVoxels(&pool_);
+  for (uint32_t z = voxel_min.z; z < voxel_max.z; ++z) {
+    for (uint32_t y = voxel_min.y; y < voxel_max.y; ++y) {
+      for (uint32_t x = voxel_min.x; x < voxel_max.x; ++x) {
+        voxels[Block::GetVoxelIndex(x, y, z)] = value;
+      }
+    }
+  }
+  brick->SimplifyVoxels(&pool_);
+}
+
+void World::ConvertBricks(Block *block, int dimension) {
+  // Only descend into subtrees with blocks to convert, since descending
+  // copies shared blocks.
+  bool converts = !TraverseBlocks(
+      block, glm::vec3(0.0f), 1.0f,
+      [this, dimension](const TraversalNode<Block> &node) {
+        int node_dimension = dimension + node.depth;
+        if (node.block->is_brick()) {
+          return node_dimension == brick_dimension_
+                     ? TraversalResult::kSkipChildren
+                     : TraversalResult::kStop;
+        }
+        if (!node.block->is_leaf() && node_dimension == brick_dimension_) {
+          return TraversalResult::kStop;
+        }
+        return TraversalResult::kContinue;
+      });
+  if (!converts) {
+    return;
+  }
+
+  if (dimension == brick_dimension_) {
+    block->MutableVoxels(&pool_);
+    block->SimplifyVoxels(&pool_);
+    return;
+  }
+  block->ExpandVoxels(&pool_);
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    if (block->child(i)) {
+      ConvertBricks(block->AddChild(i, &pool_), dimension + 1);
+    }
+  }
+  block->SimplifyChildren(&pool_);
+}
@@ -0,0 +1,284 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WORLD_H_
+#define WORLD_H_
+
+#include <cstdint>
+#include <deque>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "block.h"
+#include "block_index.h"
+#include "block_pool.h"
+#include "locational_code.h"
+#include "palette.h"
+#include "wide_tree.h"
+#include "world_file.h"
+#include "world_image.h"
+
+// A region of the world whose blocks changed, given as the block that
+// contains it.
+struct WorldChange {
+  LocationalCode code;
+  // The bounds of the block in world coordinates.
+  glm::vec3 min;
+  glm::vec3 max;
+  // The generation of the world when the blocks changed.
+  uint64_t generation;
+};
+
+class WorldListener {
+ public:
+  // Called with the regions that changed since the last call. The regions
+  // don't overlap, and all blocks outside of them are the same as before.
+  virtual void WorldChanged(const std::vector<WorldChange> &changes) = 0;
+};
+
+// The block octree of a world together with the pool its blocks live in.
+// The world is a cube of the given size with its corner at the origin.
+//
+// The world records the regions changed by each edit, so that listeners
+// only need to update the affected parts of anything they derive from the
+// blocks. The regions are found by comparing the tree with its state before
+// the edit, which only descends into blocks that are no longer shared with
+// it, so this costs as much as the edit itself.
+class World {
+ public:
+  // The deepest dimension a block can be placed at.
+  static const int kMaxDimension = LocationalCode::kMaxDimension;
+
+  struct BlockEdit {
+    LocationalCode code;
+    int color;
+  };
+
+  explicit World(float size);
+  ~World();
+
+  float size() const { return size_; }
+  const Block &root() const { return root_; }
+  const BlockPool &pool() const { return pool_; }
+  // The colors of the blocks. Edits take colors and add them to the palette,
+  // while blocks store their index in it.
+  const Palette &palette() const { return palette_; }
+
+  // Every edit increments the generation of the world.
+  uint64_t generation() const { return generation_; }
+  // The regions changed since the listeners were last notified.
+  const std::vector<WorldChange> &changes() const { return changes_; }
+  bool has_changes() const { return !changes_.empty(); }
+
+  void AddListener(WorldListener *listener);
+  void RemoveListener(WorldListener *listener);
+  // Passes the changes to every listener and forgets them. Meant to be
+  // called once per frame, and changes inside other changes are merged into
+  // them first. Thousands of changes are merged into their parents as they
+  // are recorded, so they are passed as fewer, larger regions.
+  void NotifyListeners();
+
+  // Removes every block and color at once. Snapshots of the world are invalid
+  // afterwards.
+  void Clear();
+
+  // Saves the world to a file in the format described in world_file.h,
+  // compressed or not. Returns false if the file can't be written.
+  bool Save(const std::string &path,
+            WorldCompression compression = WorldCompression::kLz) const;
+  // Replaces the world with the one saved in a file, including its brick
+  // dimension. Returns false, leaving the world empty, if the file can't be
+  // read or isn't a valid world file. Snapshots of the world are invalid
+  // afterwards.
+  bool Load(const std::string &path);
+  // Loads a world from the rest of a stream instead.
+  bool Load(std::istream *stream);
+
+  // Saves the world to a file as an image, described in world_image.h,
+  // which loads much faster than the format of Save() but is larger and
+  // only readable on the same kind of machine. The file is replaced at
+  // once, so it can be the image the world is mapped from. Returns false if
+  // the file can't be written.
+  bool SaveImage(const std::string &path) const;
+  // Replaces the world with the one in an image, like Load(). The image is
+  // mapped into memory and its blocks are used in place until the world is
+  // cleared, loaded or defragmented, and edits copy the blocks they change
+  // into the pool. Only the parts of the image that are visited are read
+  // from disk, but an index or wide tree is built from every block as soon
+  // as the image is loaded, so the whole image is read when either is
+  // enabled.
+  bool LoadImage(const std::string &path);
+
+  // Returns a snapshot of the world that shares all of its blocks with the
+  // world. Edits copy the blocks along the edited path instead of changing
+  // shared blocks, so each snapshot only costs the blocks that have been
+  // edited since. Snapshots must be released with ReleaseSnapshot().
+  Block TakeSnapshot() {
+    return root_.Share(&pool_);
+  }
+  void ReleaseSnapshot(Block *snapshot) {
+    snapshot->Release(&pool_);
+  }
+  // Makes the world equal to a snapshot, which is still owned by the caller.
+  void RestoreSnapshot(const Block &snapshot);
+  // Takes and restores snapshots of the block with the given code instead
+  // of the whole world. A missing block is taken as an empty leaf, and a
+  // block inside a leaf as a leaf of the same value. The code can't be
+  // below the brick dimension.
+  Block TakeSnapshot(LocationalCode code);
+  void RestoreSnapshot(LocationalCode code, const Block &snapshot);
+  // Copies a tree from another pool into the pool of the world and returns
+  // it as a snapshot. The colors of the tree are looked up in the given
+  // palette and added to the palette of the world.
+  Block ImportSnapshot(const Block &tree, const Palette &palette);
+
+  // Rewrites the blocks into a fresh pool in depth-first order, so that
+  // blocks that are visited together are next to each other in memory, and
+  // frees the old pool, along with a mapped image. Blocks that were shared
+  // stay shared. The given snapshots are moved along, and any other snapshot
+  // is invalid afterwards.
+  void Defragment(const std::vector<Block *> &snapshots);
+
+  // When enabled, identical subtrees are stored only once and shared between
+  // all places they appear in, which makes repetitive worlds much smaller.
+  // Editing a shared subtree copies the blocks along the edited path.
+  // Enabling it deduplicates the blocks that aren't shared with a snapshot,
+  // and the rest as they are edited.
+  bool deduplicates() const { return pool_.deduplicates(); }
+  void SetDeduplicates(bool deduplicates);
+
+  // When set, blocks of the given dimension that have children are stored as
+  // bricks of the blocks Block::kBrickDimension levels below them, which is
+  // also the deepest dimension blocks can be set at. Edits below it change
+  // whole voxels. Negative when the world has no bricks. Setting the
+  // dimension the world already has does nothing.
+  int brick_dimension() const { return brick_dimension_; }
+  void SetBrickDimension(int dimension);
+
+  // When enabled, the world keeps a BlockIndex of all blocks up to date, so
+  // that FindBlock() can look up blocks without descending the tree.
+  bool indexed() const { return indexed_; }
+  void SetIndexed(bool indexed);
+  const BlockIndex &index() const { return index_; }
+
+  // When enabled, the world keeps a WideTree of all blocks up to date and
+  // GetBlock() descends it instead of the octree, which takes half as many
+  // steps. It's only slightly faster in sparse worlds, slower in dense
+  // ones, and every edit rebuilds its nodes along the edited path.
+  bool uses_wide_tree() const { return uses_wide_tree_; }
+  void SetUsesWideTree(bool uses_wide_tree);
+  const WideTree &wide_tree() const { return wide_tree_; }
+
+  // Returns the block with exactly the given code, or null if it doesn't
+  // exist. Requires the world to be indexed.
+  const Block *FindBlock(LocationalCode code) const {
+    assert(indexed_);
+    return index_.Find(code);
+  }
+  // Looks up the same block as GetBlock() through the index.
+  const Block *FindBlock(LocationalCode code, int *dimension) const;
+
+  // Gets the code of the block of the given dimension that contains the
+  // point. Returns false if the point is outside of the world.
+  bool GetCode(float x, float y, float z, int dimension,
+               LocationalCode *code) const;
+
+  // Returns the smallest block on the path to the code together with its
+  // dimension, or null if the path leads to a missing block. A voxel of a
+  // brick is returned as a leaf block with the value of the voxel.
+  const Block *GetBlock(LocationalCode code, int *dimension) const;
+  // Returns the smallest block containing the point together with its
+  // dimension, or null if the point is outside of the world.
+  const Block *GetBlock(float x, float y, float z, int *dimension) const;
+
+  void SetBlock(LocationalCode code, int color);
+  void SetBlock(float x, float y, float z, int dimension, int color);
+
+  // Sets every block of the given dimension inside the box, given in integer
+  // block coordinates with the maximum excluded. Blocks that are entirely
+  // inside the box are set as a whole, so only blocks along the boundary of
+  // the box are subdivided, and the tree is simplified in the same pass.
+  void FillBox(const glm::uvec3 &min, const glm::uvec3 &max, int dimension,
+               int color);
+  // Sets every block of the given dimension that overlaps the box, given in
+  // world coordinates.
+  void FillBox(const glm::vec3 &min, const glm::vec3 &max, int dimension,
+               int color);
+
+ private:
+  World(const World &) = delete;
+  World &operator=(const World &) = delete;
+
+  void BuildIndexes();
+  void UpdateIndexes(LocationalCode code);
+
+  // Records the regions where the tree differs from a copy of the root that
+  // was shared before an edit.
+  void RecordChanges(const Block &old_root);
+  void RecordDifferences(const Block &old_block, const Block &new_block,
+                         LocationalCode code);
+  void RecordChange(LocationalCode code);
+  WorldChange MakeChange(LocationalCode code, uint64_t generation) const;
+  // Merges the deepest changes into their parents until few enough are left.
+  void MergeChanges();
+
+  uint16_t AddColor(int color);
+  Block CopyRemapped(const Block &block,
+                     const std::vector<uint16_t> &indices);
+  void AddVoxelBlocks();
+  bool has_bricks() const { return brick_dimension_ >= 0; }
+  // Returns the dimension of the block an edit at the given dimension is
+  // applied to, which is the brick for edits below bricks.
+  int GetEditDimension(int dimension) const {
+    return has_bricks() && dimension > brick_dimension_ ? brick_dimension_
+                                                        : dimension;
+  }
+  const Block *GetVoxelBlock(const Block &brick, LocationalCode code,
+                             int *dimension) const;
+  void SetVoxels(Block *brick, LocationalCode code, uint16_t value);
+
+  void FillBlock(Block *block, int dimension, const glm::uvec3 &corner,
+                 uint32_t size, const glm::uvec3 &min, const glm::uvec3 &max,
+                 uint16_t value);
+  void FillVoxels(Block *brick, const glm::uvec3 &corner, uint32_t size,
+                  const glm::uvec3 &min, const glm::uvec3 &max,
+                  uint16_t value);
+  void ConvertBricks(Block *block, int dimension);
+
+  float size_;
+  Palette palette_;
+  BlockPool pool_;
+  // The image the blocks that aren't in the pool are mapped from, if any.
+  MappedFile image_;
+  Block root_;
+  int brick_dimension_;
+  // A leaf block for each color, returned for voxels of bricks.
+  std::deque<Block> voxel_blocks_;
+
+  bool indexed_;
+  BlockIndex index_;
+
+  bool uses_wide_tree_;
+  WideTree wide_tree_;
+
+  uint64_t generation_;
+  std::vector<WorldChange> changes_;
+  std::vector<WorldListener *> listeners_;
+};
+
+#endif  // WORLD_H_
@@ -0,0 +1,210 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "world_builder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "block_pool.h"
+#include "palette.h"
+
+namespace {
+
+// The pool and palette a thread builds blocks into.
+struct BuildWorker {
+  BuildWorker() : palette(), pool(&palette) {}
+
+  Palette palette;
+  BlockPool pool;
+};
+
+struct BlockBuild {
+  BlockBuild() : code(), worker(nullptr), tree(), built(false) {}
+
+  LocationalCode code;
+  BuildWorker *worker;
+  Block tree;
+  bool built;
+};
+
+// Returns the code of a block relative to an ancestor of the given
+// dimension.
+LocationalCode GetRelativeCode(LocationalCode code, int dimension,
+                               int ancestor_dimension) {
+  int levels = dimension - ancestor_dimension;
+  return LocationalCode(1ull << (3 * levels) |
+                        (code.value() & ((1ull << (3 * levels)) - 1)));
+}
+
+}  // namespace
+
+bool BuildWorldBlocks(World *world, const std::vector<LocationalCode> &codes,
+                      int dimension, const BlockBuildFunction &build_block) {
+  int brick_dimension = world->brick_dimension();
+  if (dimension > World::kMaxDimension ||
+      (brick_dimension >= 0 &&
+       dimension > brick_dimension + Block::kBrickDimension)) {
+    return false;
+  }
+  std::vector<BlockBuild> builds(codes.size());
+  for (size_t i = 0; i < codes.size(); ++i) {
+    int code_dimension = codes[i].dimension();
+    if (code_dimension > dimension ||
+        (brick_dimension >= 0 && code_dimension > brick_dimension)) {
+      return false;
+    }
+    builds[i].code = codes[i];
+  }
+
+  size_t num_workers = std::max<size_t>(
+      std::min<size_t>(builds.size(), std::thread::hardware_concurrency()),
+      1);
+  std::vector<std::unique_ptr<BuildWorker>> workers;
+  for (size_t i = 0; i < num_workers; ++i) {
+    workers.emplace_back(new BuildWorker);
+    workers.back()->pool.set_deduplicates(world->deduplicates());
+  }
+  std::atomic<size_t> next_build(0);
+  auto run_builds = [&](BuildWorker *worker) {
+    for (size_t i = next_build++; i < builds.size(); i = next_build++) {
+      BlockBuild &build = builds[i];
+      int build_dimension = build.code.dimension();
+      BlockBuilder builder(&worker->pool, &worker->palette,
+                           dimension - build_dimension,
+                           brick_dimension < 0
+                               ? -1
+                               : brick_dimension - build_dimension);
+      build.built = build_block(build.code, &builder);
+      build.tree = builder.Finish();
+      build.worker = worker;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_workers; ++i) {
+    threads.emplace_back(run_builds, workers[i].get());
+  }
+  run_builds(workers[0].get());
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  for (const BlockBuild &build : builds) {
+    if (!build.built) {
+      return false;
+    }
+  }
+  for (const BlockBuild &build : builds) {
+    Block snapshot =
+        world->ImportSnapshot(build.tree, build.worker->palette);
+    world->RestoreSnapshot(build.code, snapshot);
+    world->ReleaseSnapshot(&snapshot);
+  }
+  return true;
+}
+
+bool BuildWorldBlock(World *world, LocationalCode code, int dimension,
+                     const BlockBuildFunction &build_block) {
+  // Children below the brick dimension can't be restored on their own.
+  int code_dimension = code.dimension();
+  std::vector<LocationalCode> codes;
+  if (code_dimension < dimension &&
+      code_dimension != world->brick_dimension()) {
+    for (int i = 0; i < Block::kNumChildren; ++i) {
+      codes.push_back(code.child(i));
+    }
+  } else {
+    codes.push_back(code);
+  }
+  return BuildWorldBlocks(world, codes, dimension, build_block);
+}
+
+bool BuildWorldBlock(World *world, LocationalCode code, int dimension,
+                     const std::vector<World::BlockEdit> &voxels) {
+  return BuildWorldBlock(
+      world, code, dimension,
+      [&voxels, code, dimension](LocationalCode child,
+                                 BlockBuilder *builder) {
+        // The voxels of each child are a range of the sorted voxels. The
+        // ranges of the first and last children also take any voxels outside
+        // of the block, which are then rejected.
+        int child_dimension = child.dimension();
+        std::vector<World::BlockEdit>::const_iterator begin = voxels.begin();
+        std::vector<World::BlockEdit>::const_iterator end = voxels.end();
+        auto is_before = [](const World::BlockEdit &edit, uint64_t code) {
+          return edit.code.value() < code;
+        };
+        int index = child.value() & (Block::kNumChildren - 1);
+        bool first = child == code || index == 0;
+        bool last = child == code || index == Block::kNumChildren - 1;
+        if (!first) {
+          begin = std::lower_bound(
+              begin, end, child.first_descendant(dimension).value(),
+              is_before);
+        }
+        if (!last) {
+          end = std::lower_bound(
+              begin, end, child.last_descendant(dimension).value() + 1,
+              is_before);
+        }
+        LocationalCode first_code = child.first_descendant(dimension);
+        LocationalCode last_code = child.last_descendant(dimension);
+        for (auto it = begin; it != end; ++it) {
+          if (it->code.value() < first_code.value() ||
+              it->code.value() > last_code.value() ||
+              !builder->Add(GetRelativeCode(it->code, dimension,
+                                            child_dimension),
+                            it->color)) {
+            return false;
+          }
+        }
+        return true;
+      });
+}
+
+bool BuildWorldBlock(World *world, LocationalCode code, int dimension,
+                     const int *colors, const glm::uvec3 &size) {
+  int code_dimension = code.dimension();
+  uint32_t code_x;
+  uint32_t code_y;
+  uint32_t code_z;
+  code.GetCoordinates(&code_x, &code_y, &code_z);
+  return BuildWorldBlock(
+      world, code, dimension,
+      [=](LocationalCode child, BlockBuilder *builder) {
+        int child_dimension = child.dimension();
+        uint32_t x;
+        uint32_t y;
+        uint32_t z;
+        child.GetCoordinates(&x, &y, &z);
+        glm::uvec3 corner =
+            (glm::uvec3(x, y, z) -
+             glm::uvec3(code_x, code_y, code_z) *
+                 (1u << (child_dimension - code_dimension))) *
+            (1u << (dimension - child_dimension));
+        builder->AddGrid([=](const glm::uvec3 &voxel) {
+          glm::uvec3 position = corner + voxel;
+          if (position.x >= size.x || position.y >= size.y ||
+              position.z >= size.z) {
+            return 0;
+          }
+          return colors[position.x +
+                        size.x * (position.y + size.y * position.z)];
+        });
+        return true;
+      });
+}
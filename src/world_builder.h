@@ -0,0 +1,69 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WORLD_BUILDER_H_
+#define WORLD_BUILDER_H_
+
+#include <functional>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "block_builder.h"
+#include "locational_code.h"
+#include "world.h"
+
+// Builds blocks of a world from external voxel data with BlockBuilder, much
+// faster than setting the voxels one by one.
+//
+// Each block is built as a task of its own, and the tasks are spread over
+// threads that each build into a pool and palette of their own. The
+// finished blocks are then copied into the world like restored snapshots.
+//
+// The voxels are of a given dimension, which can be at most
+// Block::kBrickDimension below the brick dimension of the world, and the
+// blocks that are built can't be below the brick dimension. The builder of
+// each block takes codes relative to it, as described in block_builder.h.
+
+// Fills the builder of a block, given by its code in the world. Returns
+// false to leave the world as it is.
+typedef std::function<bool(LocationalCode block, BlockBuilder *builder)>
+    BlockBuildFunction;
+
+// Replaces the blocks of the world with the given codes, which can't
+// overlap, with blocks of the given dimension added by the function. Returns
+// false, leaving the world unchanged, if the function does for any of them
+// or if the dimensions don't fit the bricks of the world.
+bool BuildWorldBlocks(World *world, const std::vector<LocationalCode> &codes,
+                      int dimension, const BlockBuildFunction &build_block);
+
+// Replaces a single block the same way, building each of its children as a
+// task unless the block is at the brick dimension.
+bool BuildWorldBlock(World *world, LocationalCode code, int dimension,
+                     const BlockBuildFunction &build_block);
+
+// Builds the block from voxels given by their codes in the world, which
+// must be of the given dimension, inside the block and in increasing order.
+// Empty voxels can be left out. Returns false if the voxels aren't.
+bool BuildWorldBlock(World *world, LocationalCode code, int dimension,
+                     const std::vector<World::BlockEdit> &voxels);
+
+// Builds the block from a dense grid of colors with its corner at the
+// corner of the block, in voxels of the given dimension ordered by x, then y,
+// then z. Voxels outside of the grid are empty.
+bool BuildWorldBlock(World *world, LocationalCode code, int dimension,
+                     const int *colors, const glm::uvec3 &size);
+
+#endif  // WORLD_BUILDER_H_
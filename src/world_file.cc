@@ -0,0 +1,872 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "world_file.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "locational_code.h"
+#include "lz_codec.h"
+
+namespace {
+
+const char kMagic[] = {'S', 'B', 'W', 'F'};
+const size_t kBufferSize = 1 << 16;
+const uint8_t kBrickMask = 0xff;
+// Frames of compressed blocks are ended after the first block that makes
+// their streams this large together.
+const size_t kFrameSize = 1 << 18;
+// Streams of frames that are larger than a full frame and another block are
+// corrupt.
+const size_t kMaxFrameSize = kFrameSize + 2 * Block::kBrickVolume;
+
+// Returns the number of bits that values below the given number are written
+// with.
+int GetIndexBits(uint32_t num_values) {
+  int bits = 1;
+  while ((1u << bits) < num_values) {
+    ++bits;
+  }
+  return bits;
+}
+
+// How the parts of the blocks of a file are written.
+struct BlockEncoding {
+  // The first value of a leaf that isn't a palette index, which starts the
+  // definition of a shared block, followed by the value that refers to one.
+  uint32_t definition_value;
+  uint32_t reference_value;
+  // The number of bits of the palette indices of voxels, the values of
+  // leaves and the identifiers of shared blocks.
+  int voxel_bits;
+  int value_bits;
+  int reference_bits;
+  // The number of bytes of the values of leaves when compressed.
+  int value_bytes;
+  // The number of streams of each compressed frame.
+  int num_streams;
+};
+
+// Returns the encoding of the blocks of a file of the given version, with
+// the given number of shared blocks.
+BlockEncoding GetBlockEncoding(const Palette &palette, uint32_t version,
+                               uint32_t num_shared) {
+  BlockEncoding encoding;
+  uint32_t num_values = static_cast<uint32_t>(palette.size());
+  encoding.definition_value = num_values;
+  encoding.reference_value = num_values + 1;
+  encoding.voxel_bits = GetIndexBits(num_values);
+  if (version >= 3) {
+    num_values += 2;
+  }
+  encoding.value_bits = GetIndexBits(num_values);
+  encoding.reference_bits = GetIndexBits(num_shared);
+  encoding.value_bytes = (encoding.value_bits + 7) / 8;
+  encoding.num_streams = version >= 3 ? 4 : 3;
+  return encoding;
+}
+
+// Writes a stream of bits, lowest bit first, through a buffer.
+class BitWriter {
+ public:
+  explicit BitWriter(std::ostream *stream)
+      : stream_(stream), buffer_(kBufferSize), size_(0), bits_(0),
+        num_bits_(0) {}
+
+  void Write(uint32_t value, int num_bits) {
+    assert(num_bits <= 32 && (num_bits == 32 || value >> num_bits == 0));
+    bits_ |= static_cast<uint64_t>(value) << num_bits_;
+    num_bits_ += num_bits;
+    if (num_bits_ >= 32) {
+      WriteBytes(4);
+    }
+  }
+
+  // Pads the bits to a whole byte and writes out the buffer.
+  bool Finish() {
+    WriteBytes((num_bits_ + 7) / 8);
+    FlushBuffer();
+    stream_->flush();
+    return static_cast<bool>(*stream_);
+  }
+
+  // Writes bytes after the bits, which must end at a whole byte.
+  void WriteAligned(const uint8_t *data, size_t size) {
+    assert(num_bits_ % 8 == 0);
+    WriteBytes(num_bits_ / 8);
+    if (size_ + size > buffer_.size()) {
+      FlushBuffer();
+      if (size > buffer_.size()) {
+        stream_->write(reinterpret_cast<const char *>(data), size);
+        return;
+      }
+    }
+    std::memcpy(&buffer_[size_], data, size);
+    size_ += size;
+  }
+
+ private:
+  void WriteBytes(int num_bytes) {
+    if (size_ + num_bytes > buffer_.size()) {
+      FlushBuffer();
+    }
+    for (int i = 0; i < num_bytes; ++i) {
+      buffer_[size_++] = static_cast<char>(bits_ >> (8 * i));
+    }
+    bits_ = num_bytes < 8 ? bits_ >> (8 * num_bytes) : 0;
+    num_bits_ = num_bits_ > 8 * num_bytes ? num_bits_ - 8 * num_bytes : 0;
+  }
+
+  void FlushBuffer() {
+    stream_->write(buffer_.data(), size_);
+    size_ = 0;
+  }
+
+  std::ostream *stream_;
+  std::vector<char> buffer_;
+  size_t size_;
+  uint64_t bits_;
+  int num_bits_;
+};
+
+// Reads a stream of bits written by BitWriter. Reading past the end of the
+// stream returns zeros and sets the failed flag.
+class BitReader {
+ public:
+  explicit BitReader(std::istream *stream)
+      : stream_(stream), buffer_(kBufferSize), position_(0), size_(0),
+        bits_(0), num_bits_(0), failed_(false) {}
+
+  bool failed() const { return failed_; }
+
+  uint32_t Read(int num_bits) {
+    assert(num_bits <= 32);
+    if (num_bits_ < num_bits) {
+      Refill();
+      if (num_bits_ < num_bits) {
+        failed_ = true;
+        return 0;
+      }
+    }
+    uint32_t value =
+        static_cast<uint32_t>(bits_ & ((1ull << num_bits) - 1));
+    bits_ >>= num_bits;
+    num_bits_ -= num_bits;
+    return value;
+  }
+
+  // Reads a number of values of the same number of bits, refilling the bits
+  // only once for as many values as fit into them.
+  void ReadValues(uint16_t *values, int num_values, int num_bits) {
+    assert(num_bits <= 16);
+    uint64_t mask = (1ull << num_bits) - 1;
+    while (num_values > 0) {
+      Refill();
+      int count = std::min(num_values, num_bits_ / num_bits);
+      if (count == 0) {
+        failed_ = true;
+        std::fill(values, values + num_values, 0);
+        return;
+      }
+      for (int i = 0; i < count; ++i) {
+        values[i] = static_cast<uint16_t>(bits_ & mask);
+        bits_ >>= num_bits;
+      }
+      num_bits_ -= count * num_bits;
+      values += count;
+      num_values -= count;
+    }
+  }
+
+  // Reads bytes after the bits read so far, which must end at a whole byte.
+  // Returns false and sets the failed flag if the stream ends first.
+  bool ReadAligned(uint8_t *data, size_t size) {
+    assert(num_bits_ % 8 == 0);
+    for (; size > 0 && num_bits_ > 0; --size) {
+      *data++ = static_cast<uint8_t>(Read(8));
+    }
+    size_t buffered = std::min(size, size_ - position_);
+    std::memcpy(data, &buffer_[position_], buffered);
+    position_ += buffered;
+    size -= buffered;
+    if (size > 0) {
+      stream_->read(reinterpret_cast<char *>(data + buffered), size);
+      if (static_cast<size_t>(stream_->gcount()) != size) {
+        failed_ = true;
+      }
+    }
+    return !failed_;
+  }
+
+ private:
+  // Reads as many whole bytes as fit into the bits.
+  void Refill() {
+    while (num_bits_ <= 56) {
+      if (position_ == size_ && !FillBuffer()) {
+        return;
+      }
+      bits_ |= static_cast<uint64_t>(
+                   static_cast<unsigned char>(buffer_[position_++]))
+               << num_bits_;
+      num_bits_ += 8;
+    }
+  }
+
+  bool FillBuffer() {
+    stream_->read(buffer_.data(), buffer_.size());
+    size_ = static_cast<size_t>(stream_->gcount());
+    position_ = 0;
+    return size_ > 0;
+  }
+
+  std::istream *stream_;
+  std::vector<char> buffer_;
+  size_t position_;
+  size_t size_;
+  uint64_t bits_;
+  int num_bits_;
+  bool failed_;
+};
+
+// The streams the blocks of a compressed frame are split into.
+enum FrameStream {
+  kMaskStream,
+  kValueStream,
+  kVoxelStream,
+  kReferenceStream,
+  kNumFrameStreams
+};
+
+// Writes the masks, values, voxels and references of uncompressed blocks as
+// bits.
+class BitBlockWriter {
+ public:
+  BitBlockWriter(BitWriter *writer, const BlockEncoding &encoding)
+      : writer_(writer), encoding_(encoding) {}
+
+  void WriteMask(uint8_t mask) { writer_->Write(mask, 8); }
+
+  void WriteValue(uint32_t value) {
+    writer_->Write(value, encoding_.value_bits);
+  }
+
+  void WriteVoxels(const uint16_t *voxels) {
+    for (int i = 0; i < Block::kBrickVolume; ++i) {
+      writer_->Write(voxels[i], encoding_.voxel_bits);
+    }
+  }
+
+  void WriteReference(uint32_t id) {
+    writer_->Write(id, encoding_.reference_bits);
+  }
+
+  void EndBlock() {}
+  void Finish() {}
+
+ private:
+  BitWriter *writer_;
+  BlockEncoding encoding_;
+};
+
+// Writes the masks, values, voxels and references of blocks as compressed
+// frames.
+class FrameBlockWriter {
+ public:
+  FrameBlockWriter(BitWriter *writer, const BlockEncoding &encoding)
+      : writer_(writer), encoding_(encoding) {
+    for (std::vector<uint8_t> &stream : streams_) {
+      stream.reserve(kMaxFrameSize);
+    }
+  }
+
+  void WriteMask(uint8_t mask) { streams_[kMaskStream].push_back(mask); }
+
+  void WriteValue(uint32_t value) {
+    std::vector<uint8_t> &stream = streams_[kValueStream];
+    for (int i = 0; i < encoding_.value_bytes; ++i) {
+      stream.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+
+  void WriteVoxels(const uint16_t *voxels) {
+    std::vector<uint8_t> &stream = streams_[kVoxelStream];
+    uint64_t bits = 0;
+    int num_bits = 0;
+    for (int i = 0; i < Block::kBrickVolume; ++i) {
+      bits |= static_cast<uint64_t>(voxels[i]) << num_bits;
+      num_bits += encoding_.voxel_bits;
+      for (; num_bits >= 8; num_bits -= 8) {
+        stream.push_back(static_cast<uint8_t>(bits));
+        bits >>= 8;
+      }
+    }
+  }
+
+  void WriteReference(uint32_t id) {
+    std::vector<uint8_t> &stream = streams_[kReferenceStream];
+    for (int i = 0; i < 4; ++i) {
+      stream.push_back(static_cast<uint8_t>(id >> (8 * i)));
+    }
+  }
+
+  // Ends the frame if it is full, since frames hold whole blocks.
+  void EndBlock() {
+    size_t size = 0;
+    for (const std::vector<uint8_t> &stream : streams_) {
+      size += stream.size();
+    }
+    if (size >= kFrameSize) {
+      WriteFrame();
+    }
+  }
+
+  void Finish() {
+    if (!streams_[kMaskStream].empty()) {
+      WriteFrame();
+    }
+  }
+
+ private:
+  void WriteFrame() {
+    size_t max_size = 0;
+    for (const std::vector<uint8_t> &stream : streams_) {
+      max_size += LzCompressor::GetMaxCompressedSize(stream.size());
+    }
+    compressed_.resize(max_size);
+    size_t size = 0;
+    uint32_t compressed_sizes[kNumFrameStreams];
+    for (int i = 0; i < kNumFrameStreams; ++i) {
+      compressed_sizes[i] = static_cast<uint32_t>(compressor_.Compress(
+          streams_[i].data(), streams_[i].size(), &compressed_[size]));
+      size += compressed_sizes[i];
+    }
+
+    for (const std::vector<uint8_t> &stream : streams_) {
+      writer_->Write(static_cast<uint32_t>(stream.size()), 32);
+    }
+    for (uint32_t compressed_size : compressed_sizes) {
+      writer_->Write(compressed_size, 32);
+    }
+    writer_->WriteAligned(compressed_.data(), size);
+    for (std::vector<uint8_t> &stream : streams_) {
+      stream.clear();
+    }
+  }
+
+  BitWriter *writer_;
+  BlockEncoding encoding_;
+  LzCompressor compressor_;
+  std::vector<uint8_t> streams_[kNumFrameStreams];
+  std::vector<uint8_t> compressed_;
+};
+
+// Reads the masks, values, voxels and references of uncompressed blocks.
+// Reading past the end of the stream returns zeros and sets the failed flag.
+class BitBlockReader {
+ public:
+  BitBlockReader(BitReader *reader, const BlockEncoding &encoding)
+      : reader_(reader), encoding_(encoding) {}
+
+  bool failed() const { return reader_->failed(); }
+
+  uint8_t ReadMask() { return static_cast<uint8_t>(reader_->Read(8)); }
+  uint32_t ReadValue() { return reader_->Read(encoding_.value_bits); }
+
+  void ReadVoxels(uint16_t *voxels) {
+    reader_->ReadValues(voxels, Block::kBrickVolume, encoding_.voxel_bits);
+  }
+
+  uint32_t ReadReference() { return reader_->Read(encoding_.reference_bits); }
+
+ private:
+  BitReader *reader_;
+  BlockEncoding encoding_;
+};
+
+// Reads the masks, values, voxels and references of blocks from compressed
+// frames, reading the next frame at the first mask past the end of the
+// current one. Reading past the end of the frames or the streams of a frame
+// returns zeros and sets the failed flag.
+class FrameBlockReader {
+ public:
+  FrameBlockReader(BitReader *reader, const BlockEncoding &encoding)
+      : reader_(reader), encoding_(encoding), positions_(), failed_(false) {}
+
+  bool failed() const { return failed_; }
+
+  uint8_t ReadMask() {
+    if (positions_[kMaskStream] == streams_[kMaskStream].size() &&
+        !ReadFrame()) {
+      failed_ = true;
+      return 0;
+    }
+    return streams_[kMaskStream][positions_[kMaskStream]++];
+  }
+
+  uint32_t ReadValue() {
+    return ReadBytes(kValueStream, encoding_.value_bytes);
+  }
+
+  void ReadVoxels(uint16_t *voxels) {
+    int voxel_bits = encoding_.voxel_bits;
+    const uint8_t *data =
+        Read(kVoxelStream, Block::kBrickVolume / 8 * voxel_bits);
+    if (!data) {
+      return;
+    }
+    uint64_t bits = 0;
+    int num_bits = 0;
+    uint32_t mask = (1u << voxel_bits) - 1;
+    for (int i = 0; i < Block::kBrickVolume; ++i) {
+      for (; num_bits < voxel_bits; num_bits += 8) {
+        bits |= static_cast<uint64_t>(*data++) << num_bits;
+      }
+      voxels[i] = static_cast<uint16_t>(bits & mask);
+      bits >>= voxel_bits;
+      num_bits -= voxel_bits;
+    }
+  }
+
+  uint32_t ReadReference() { return ReadBytes(kReferenceStream, 4); }
+
+ private:
+  // Returns the next bytes of a stream of the current frame, or null if
+  // there aren't enough.
+  const uint8_t *Read(FrameStream stream, size_t size) {
+    if (streams_[stream].size() - positions_[stream] < size) {
+      failed_ = true;
+      return nullptr;
+    }
+    const uint8_t *data = &streams_[stream][positions_[stream]];
+    positions_[stream] += size;
+    return data;
+  }
+
+  // Returns the next little-endian number of the given number of bytes of a
+  // stream of the current frame, or zero if there aren't enough.
+  uint32_t ReadBytes(FrameStream stream, int size) {
+    const uint8_t *data = Read(stream, size);
+    uint32_t value = 0;
+    for (int i = 0; data && i < size; ++i) {
+      value |= static_cast<uint32_t>(data[i]) << (8 * i);
+    }
+    return value;
+  }
+
+  // Reads the streams of the next frame, which are empty if the file
+  // doesn't have them.
+  bool ReadFrame() {
+    int num_streams = encoding_.num_streams;
+    uint32_t sizes[kNumFrameStreams] = {};
+    uint32_t compressed_sizes[kNumFrameStreams] = {};
+    for (int i = 0; i < num_streams; ++i) {
+      sizes[i] = reader_->Read(32);
+    }
+    for (int i = 0; i < num_streams; ++i) {
+      compressed_sizes[i] = reader_->Read(32);
+    }
+    if (reader_->failed() || sizes[kMaskStream] == 0) {
+      return false;
+    }
+    size_t compressed_size = 0;
+    for (int i = 0; i < kNumFrameStreams; ++i) {
+      // The values and voxels of a frame belong to its blocks.
+      if (positions_[i] != streams_[i].size() ||
+          sizes[i] > kMaxFrameSize ||
+          compressed_sizes[i] >
+              LzCompressor::GetMaxCompressedSize(kMaxFrameSize)) {
+        return false;
+      }
+      compressed_size += compressed_sizes[i];
+    }
+
+    compressed_.resize(compressed_size);
+    if (!reader_->ReadAligned(compressed_.data(), compressed_size)) {
+      return false;
+    }
+    const uint8_t *data = compressed_.data();
+    for (int i = 0; i < kNumFrameStreams; ++i) {
+      streams_[i].resize(sizes[i]);
+      positions_[i] = 0;
+      if (!LzDecompress(data, compressed_sizes[i], streams_[i].data(),
+                        sizes[i])) {
+        return false;
+      }
+      data += compressed_sizes[i];
+    }
+    return true;
+  }
+
+  BitReader *reader_;
+  BlockEncoding encoding_;
+  std::vector<uint8_t> streams_[kNumFrameStreams];
+  size_t positions_[kNumFrameStreams];
+  std::vector<uint8_t> compressed_;
+  bool failed_;
+};
+
+// Returns what a block refers to, its run of children or its voxels, which
+// is the same for blocks that share them. Returns null for a leaf.
+const void *GetContents(const Block &block) {
+  if (block.is_brick()) {
+    return block.voxels();
+  }
+  for (int i = 0; i < Block::kNumChildren; ++i) {
+    if (const Block *child = block.child(i)) {
+      return child;
+    }
+  }
+  return nullptr;
+}
+
+// The number of blocks of a tree that refer to each run or brick.
+typedef std::unordered_map<const void *, uint32_t> ReferenceCounts;
+
+// Counts the blocks that refer to each run or brick of a tree, descending
+// into each of them only once. Returns the number of runs and bricks that
+// are shared.
+uint32_t CountReferences(const Block &block, ReferenceCounts *counts) {
+  const void *contents = GetContents(block);
+  if (!contents) {
+    return 0;
+  }
+  uint32_t &count = (*counts)[contents];
+  if (++count > 1) {
+    return count == 2 ? 1 : 0;
+  }
+  uint32_t num_shared = 0;
+  if (!block.is_brick()) {
+    for (int i = 0; i < Block::kNumChildren; ++i) {
+      if (const Block *child = block.child(i)) {
+        num_shared += CountReferences(*child, counts);
+      }
+    }
+  }
+  return num_shared;
+}
+
+// Writes blocks in pre-order. A block that shares its children or voxels
+// with another one is written in full where it first appears, and as a
+// reference to it everywhere else.
+template <typename BlockWriter>
+class WorldWriter {
+ public:
+  WorldWriter(BlockWriter *writer, const BlockEncoding &encoding,
+              const ReferenceCounts &counts)
+      : writer_(writer), encoding_(encoding), counts_(counts) {}
+
+  void WriteBlock(const Block &block) {
+    const void *contents = GetContents(block);
+    if (contents && counts_.at(contents) > 1) {
+      writer_->WriteMask(0);
+      auto it = ids_.find(contents);
+      if (it != ids_.end()) {
+        writer_->WriteValue(encoding_.reference_value);
+        writer_->WriteReference(it->second);
+        writer_->EndBlock();
+        return;
+      }
+      writer_->WriteValue(encoding_.definition_value);
+      WriteContents(block);
+      // Shared blocks are numbered once they're written, after the ones
+      // they have.
+      ids_.emplace(contents, static_cast<uint32_t>(ids_.size()));
+      return;
+    }
+    WriteContents(block);
+  }
+
+ private:
+  void WriteContents(const Block &block) {
+
+    if (block.is_brick()) {
+      writer_->WriteMask(kBrickMask);
+      writer_->WriteVoxels(block.voxels());
+      writer_->EndBlock();
+    } else if (block.is_leaf()) {
+      writer_->WriteMask(0);
+      writer_->WriteValue(block.value());
+      writer_->EndBlock();
+    } else {
+      writer_->WriteMask(block.child_mask());
+      writer_->EndBlock();
+      for (int i = 0; i < Block::kNumChildren; ++i) {
+        if (const Block *child = block.child(i)) {
+          WriteBlock(*child);
+        }
+      }
+    }
+  }
+
+  BlockWriter *writer_;
+  BlockEncoding encoding_;
+  const ReferenceCounts &counts_;
+  // The identifiers of the shared runs and bricks written so far.
+  std::unordered_map<const void *, uint32_t> ids_;
+};
+
+template <typename BlockWriter>
+void WriteBlocks(const Block &root, const BlockEncoding &encoding,
+                 const ReferenceCounts &counts, BlockWriter *writer) {
+  WorldWriter<BlockWriter> world_writer(writer, encoding, counts);
+  world_writer.WriteBlock(root);
+  writer->Finish();
+}
+
+template <typename BlockReader>
+class WorldReader {
+ public:
+  WorldReader(BlockReader *reader, BlockPool *pool, const Palette &palette,
+              int brick_dimension, const BlockEncoding &encoding,
+              uint32_t num_shared)
+      : reader_(reader), pool_(pool), palette_(palette),
+        brick_dimension_(brick_dimension), encoding_(encoding),
+        num_shared_(num_shared), max_dimension_(0), read_brick_(false) {}
+
+  ~WorldReader() {
+    for (SharedBlock &shared : shared_) {
+      shared.block.Release(pool_);
+    }
+  }
+
+  bool ReadBlock(Block *block, int dimension) {
+    uint8_t mask = reader_->ReadMask();
+    if (mask) {
+      return ReadChildren(block, mask, dimension);
+    }
+    uint32_t value = reader_->ReadValue();
+    if (reader_->failed()) {
+      return false;
+    }
+    if (value < static_cast<uint32_t>(palette_.size())) {
+      block->SetValue(static_cast<uint16_t>(value), pool_);
+      max_dimension_ = std::max(max_dimension_, dimension);
+      return true;
+    }
+
+    if (value == encoding_.definition_value) {
+      // Shared blocks are never leaves, and are only defined once.
+      mask = reader_->ReadMask();
+      if (!mask || shared_.size() == num_shared_) {
+        return false;
+      }
+      int max_dimension = max_dimension_;
+      bool read_brick = read_brick_;
+      max_dimension_ = dimension;
+      read_brick_ = false;
+      if (!ReadChildren(block, mask, dimension)) {
+        return false;
+      }
+      shared_.push_back(SharedBlock{block->Share(pool_),
+                                    max_dimension_ - dimension, read_brick_});
+      max_dimension_ = std::max(max_dimension_, max_dimension);
+      read_brick_ = read_brick_ || read_brick;
+      return true;
+    }
+
+    if (value == encoding_.reference_value) {
+      uint32_t id = reader_->ReadReference();
+      if (reader_->failed() || id >= shared_.size()) {
+        return false;
+      }
+      // Shared blocks can be referred to at other dimensions than where
+      // they were defined, as long as their bricks stay at the brick
+      // dimension and their other blocks above it.
+      const SharedBlock &shared = shared_[id];
+      int max_dimension = dimension + shared.height;
+      int limit = brick_dimension_ >= 0 ? brick_dimension_
+                                        : LocationalCode::kMaxDimension;
+      if (max_dimension > limit ||
+          (shared.has_brick && max_dimension != brick_dimension_)) {
+        return false;
+      }
+      *block = shared.block.Share(pool_);
+      max_dimension_ = std::max(max_dimension_, max_dimension);
+      read_brick_ = read_brick_ || shared.has_brick;
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  // A block defined as shared, which is kept until the end of the file
+  // along with the number of dimensions it spans below itself and whether
+  // it has bricks.
+  struct SharedBlock {
+    Block block;
+    int height;
+    bool has_brick;
+  };
+
+  // Reads the children or voxels of a block with the given mask.
+  bool ReadChildren(Block *block, uint8_t mask, int dimension) {
+    if (dimension == brick_dimension_) {
+      if (mask != kBrickMask) {
+        return false;
+      }
+      uint16_t *voxels = block->MutableVoxels(pool_);
+      reader_->ReadVoxels(voxels);
+      if (reader_->failed()) {
+        return false;
+      }
+      uint16_t max_voxel = 0;
+      for (int i = 0; i < Block::kBrickVolume; ++i) {
+        max_voxel = std::max(max_voxel, voxels[i]);
+      }
+      if (max_voxel >= palette_.size()) {
+        return false;
+      }
+      block->SimplifyVoxels(pool_);
+      max_dimension_ = std::max(max_dimension_, dimension);
+      read_brick_ = true;
+      return true;
+    }
+
+    if (dimension == LocationalCode::kMaxDimension) {
+      return false;
+    }
+    Block *children = block->SetChildren(mask, pool_);
+    int num_children = Block::CountChildren(mask);
+    for (int i = 0; i < num_children; ++i) {
+      if (!ReadBlock(&children[i], dimension + 1)) {
+        return false;
+      }
+    }
+    block->SimplifyChildren(pool_);
+    return true;
+  }
+
+  BlockReader *reader_;
+  BlockPool *pool_;
+  const Palette &palette_;
+  int brick_dimension_;
+  BlockEncoding encoding_;
+  uint32_t num_shared_;
+  std::vector<SharedBlock> shared_;
+  // The deepest dimension of the blocks read so far, and whether any of
+  // them were bricks, which are reset while reading a shared block.
+  int max_dimension_;
+  bool read_brick_;
+};
+
+template <typename BlockReader>
+bool ReadBlocks(BlockReader *reader, BlockPool *pool, const Palette &palette,
+                Block *root, int brick_dimension,
+                const BlockEncoding &encoding, uint32_t num_shared) {
+  WorldReader<BlockReader> world_reader(reader, pool, palette,
+                                        brick_dimension, encoding,
+                                        num_shared);
+  return world_reader.ReadBlock(root, 0);
+}
+
+}  // namespace
+
+bool WriteWorld(const Block &root, const Palette &palette,
+                int brick_dimension, WorldCompression compression,
+                std::ostream *stream) {
+  BitWriter writer(stream);
+  for (char c : kMagic) {
+    writer.Write(static_cast<uint8_t>(c), 8);
+  }
+  writer.Write(kWorldFileVersion, 32);
+  writer.Write(static_cast<uint32_t>(compression), 32);
+  writer.Write(static_cast<uint32_t>(brick_dimension), 32);
+  writer.Write(static_cast<uint32_t>(palette.size()), 32);
+  for (int i = 1; i < palette.size(); ++i) {
+    writer.Write(static_cast<uint32_t>(palette.color(i)), 32);
+  }
+  ReferenceCounts counts;
+  uint32_t num_shared = CountReferences(root, &counts);
+  writer.Write(num_shared, 32);
+
+  BlockEncoding encoding =
+      GetBlockEncoding(palette, kWorldFileVersion, num_shared);
+  if (compression == WorldCompression::kLz) {
+    FrameBlockWriter block_writer(&writer, encoding);
+    WriteBlocks(root, encoding, counts, &block_writer);
+  } else {
+    BitBlockWriter block_writer(&writer, encoding);
+    WriteBlocks(root, encoding, counts, &block_writer);
+  }
+  return writer.Finish();
+}
+
+bool ReadWorld(std::istream *stream, BlockPool *pool, Palette *palette,
+               Block *root, int *brick_dimension) {
+  BitReader reader(stream);
+  for (char c : kMagic) {
+    if (reader.Read(8) != static_cast<uint8_t>(c)) {
+      return false;
+    }
+  }
+  uint32_t version = reader.Read(32);
+  if (version < 1 || version > kWorldFileVersion) {
+    return false;
+  }
+  WorldCompression compression = WorldCompression::kNone;
+  if (version >= 2) {
+    compression = static_cast<WorldCompression>(reader.Read(32));
+    if (compression != WorldCompression::kNone &&
+        compression != WorldCompression::kLz) {
+      return false;
+    }
+  }
+  *brick_dimension = static_cast<int32_t>(reader.Read(32));
+  if (*brick_dimension < -1 ||
+      *brick_dimension >
+          LocationalCode::kMaxDimension - Block::kBrickDimension) {
+    return false;
+  }
+  uint32_t palette_size = reader.Read(32);
+  if (palette_size < 1 || palette_size > Palette::kMaxSize) {
+    return false;
+  }
+  // Colors are unique, so they get the same indices as when written.
+  for (uint32_t i = 1; i < palette_size; ++i) {
+    int color = static_cast<int>(reader.Read(32));
+    if (palette->Add(color) != i) {
+      return false;
+    }
+  }
+  uint32_t num_shared = version >= 3 ? reader.Read(32) : 0;
+  if (reader.failed()) {
+    return false;
+  }
+
+  // Files of version 3 share the blocks that were shared when written, so
+  // they're read without looking up every run and brick in the pool, which
+  // would mostly find nothing. Blocks that are edited later are interned
+  // as usual.
+  bool deduplicates = pool->deduplicates();
+  if (version >= 3) {
+    pool->set_deduplicates(false);
+  }
+  BlockEncoding encoding = GetBlockEncoding(*palette, version, num_shared);
+  bool read;
+  if (compression == WorldCompression::kLz) {
+    FrameBlockReader block_reader(&reader, encoding);
+    read = ReadBlocks(&block_reader, pool, *palette, root, *brick_dimension,
+                      encoding, num_shared);
+  } else {
+    BitBlockReader block_reader(&reader, encoding);
+    read = ReadBlocks(&block_reader, pool, *palette, root, *brick_dimension,
+                      encoding, num_shared);
+  }
+  pool->set_deduplicates(deduplicates);
+  return read;
+}
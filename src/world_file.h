@@ -0,0 +1,96 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WORLD_FILE_H_
+#define WORLD_FILE_H_
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+#include "block.h"
+#include "block_pool.h"
+#include "palette.h"
+
+// The binary file format of a world. All numbers are little-endian, and the
+// file consists of:
+//
+//   magic            4 bytes   "SBWF"
+//   version          uint32    kWorldFileVersion
+//   compression      uint32    a WorldCompression, from version 2
+//   brick dimension  int32     -1 when the world has no bricks
+//   palette size     uint32    including the empty color
+//   colors           uint32    for every color after the empty one
+//   shared blocks    uint32    the number of them, from version 3
+//   blocks                     the root block
+//
+// Without compression, the blocks are a stream of bits in pre-order,
+// starting at the lowest bit of each byte and padded to a whole byte at the
+// end. Every block starts with an 8-bit child mask and is followed
+// by its existing children in index order. A leaf has a zero mask followed
+// by its value, a palette index in as many bits as the largest value needs.
+// A brick has a mask with all bits set and is followed by the palette
+// indices of its voxels in memory order, in as many bits as the largest
+// index of the palette needs.
+//
+// Blocks that share their children or voxels in the written tree are
+// written in full once. Where such a block first appears, it's preceded by
+// a leaf with the value one past the last palette index, and it's numbered
+// in the order these definitions end. Everywhere else, it's replaced by a
+// leaf with the value two past the last palette index, followed by its
+// number in as many bits as the largest number needs. Version 1 and 2 files
+// have no such blocks and write shared subtrees out in full wherever they
+// appear.
+//
+// With compression, the blocks are split into frames of whole blocks in
+// pre-order, each of which holds four streams compressed separately with
+// the codec of lz_codec.h, since they repeat in different ways: the masks
+// in bytes, the values of the leaves in as few little-endian bytes as the
+// largest value needs, the voxels of the bricks packed as bits like above,
+// which makes each brick a whole number of bytes, and the numbers of the
+// shared blocks referred to as uint32. A frame consists of:
+//
+//   sizes            uint32    of each stream, decompressed
+//   compressed sizes uint32    of each stream
+//   streams          bytes     the masks, values, voxels and references
+//
+// and the frames end at the end of the root block. Version 2 files have no
+// stream of references, and version 1 files have no compression field and
+// are read as uncompressed.
+static const uint32_t kWorldFileVersion = 3;
+
+enum class WorldCompression : uint32_t {
+  kNone = 0,
+  // Compressed into frames as described above, which makes files of smooth
+  // terrain about a third smaller and files of random voxels a seventh
+  // smaller, and loads them about as fast.
+  kLz = 1,
+};
+
+// Writes a world to a stream. Returns false if writing fails.
+bool WriteWorld(const Block &root, const Palette &palette,
+                int brick_dimension, WorldCompression compression,
+                std::ostream *stream);
+
+// Reads a world from a stream into an empty palette and a root block,
+// allocating the blocks from an empty pool. The blocks are simplified as
+// they are read, as if they had been edited, except that blocks of version
+// 3 files are only shared as they were when written rather than
+// deduplicated. Returns false if reading fails or the stream isn't a valid
+// world file, in which case the blocks read so far are left in the pool.
+bool ReadWorld(std::istream *stream, BlockPool *pool, Palette *palette,
+               Block *root, int *brick_dimension);
+
+#endif  // WORLD_FILE_H_
@@ -0,0 +1,224 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "world_image.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "block_pool.h"
+#include "locational_code.h"
+
+namespace {
+
+const char kMagic[] = {'S', 'B', 'W', 'I'};
+
+struct ImageHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t layout;
+  int32_t brick_dimension;
+  uint32_t palette_size;
+  uint32_t padding;
+  uint64_t image_offset;
+  uint64_t image_size;
+};
+
+// Describes the layout of the blocks, so that images written by a machine
+// with a different one are rejected. The top byte ends up at the bottom in
+// the other byte order.
+uint32_t GetLayout() {
+  return 0xb0000000u | static_cast<uint32_t>(sizeof(Block)) << 12 |
+         static_cast<uint32_t>(BlockPool::kMinImageBytes);
+}
+
+uint64_t GetColorsEnd(uint32_t palette_size) {
+  return sizeof(ImageHeader) + sizeof(uint32_t) * (palette_size - 1);
+}
+
+}  // namespace
+
+MappedFile::MappedFile()
+    : data_(nullptr), size_(0)
+#ifdef _WIN32
+      , mapping_(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string &path) {
+  Close();
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+  // The mapping keeps the file open by itself.
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping) {
+    return false;
+  }
+  void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!data) {
+    CloseHandle(mapping);
+    return false;
+  }
+  data_ = static_cast<const char *>(data);
+  size_ = static_cast<size_t>(size.QuadPart);
+  mapping_ = mapping;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (!data_) {
+    return;
+  }
+  UnmapViewOfFile(data_);
+  CloseHandle(mapping_);
+  data_ = nullptr;
+  size_ = 0;
+  mapping_ = nullptr;
+}
+
+#else
+
+bool MappedFile::Open(const std::string &path) {
+  Close();
+  int file = open(path.c_str(), O_RDONLY);
+  if (file < 0) {
+    return false;
+  }
+  struct stat status;
+  if (fstat(file, &status) != 0 || status.st_size <= 0) {
+    close(file);
+    return false;
+  }
+  size_t size = static_cast<size_t>(status.st_size);
+  // The mapping keeps the file open by itself.
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = static_cast<const char *>(data);
+  size_ = size;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (!data_) {
+    return;
+  }
+  munmap(const_cast<char *>(data_), size_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+#endif
+
+bool WriteWorldImage(const Block &root, const Palette &palette,
+                     int brick_dimension, std::ostream *stream) {
+  std::streampos start = stream->tellp();
+  ImageHeader header = ImageHeader();
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kWorldImageVersion;
+  header.layout = GetLayout();
+  header.brick_dimension = brick_dimension;
+  header.palette_size = static_cast<uint32_t>(palette.size());
+  uint64_t colors_end = GetColorsEnd(header.palette_size);
+  header.image_offset = (colors_end + kWorldImageAlignment - 1) /
+                        kWorldImageAlignment * kWorldImageAlignment;
+  stream->write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (int i = 1; i < palette.size(); ++i) {
+    uint32_t color = static_cast<uint32_t>(palette.color(i));
+    stream->write(reinterpret_cast<const char *>(&color), sizeof(color));
+  }
+  const char padding[kWorldImageAlignment] = {};
+  stream->write(padding, header.image_offset - colors_end);
+  if (!BlockPool::WriteImage(root, stream)) {
+    return false;
+  }
+
+  // Fill in the size now that the blocks are written.
+  std::streampos end = stream->tellp();
+  header.image_size =
+      static_cast<uint64_t>(end - start) - header.image_offset;
+  stream->seekp(start);
+  stream->write(reinterpret_cast<const char *>(&header), sizeof(header));
+  stream->seekp(end);
+  stream->flush();
+  return static_cast<bool>(*stream);
+}
+
+const Block *ReadWorldImage(const MappedFile &file, Palette *palette,
+                            int *brick_dimension) {
+  if (!file.is_open() || file.size() < sizeof(ImageHeader)) {
+    return nullptr;
+  }
+  ImageHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kWorldImageVersion || header.layout != GetLayout()) {
+    return nullptr;
+  }
+  if (header.brick_dimension < -1 ||
+      header.brick_dimension >
+          LocationalCode::kMaxDimension - Block::kBrickDimension) {
+    return nullptr;
+  }
+  if (header.palette_size < 1 || header.palette_size > Palette::kMaxSize) {
+    return nullptr;
+  }
+  if (header.image_offset < GetColorsEnd(header.palette_size) ||
+      header.image_offset % kWorldImageAlignment != 0 ||
+      header.image_size < BlockPool::kMinImageBytes ||
+      header.image_offset + header.image_size != file.size()) {
+    return nullptr;
+  }
+
+  // Colors are unique, so they get the same indices as when written.
+  const char *colors = file.data() + sizeof(ImageHeader);
+  for (uint32_t i = 1; i < header.palette_size; ++i) {
+    uint32_t color;
+    std::memcpy(&color, colors + sizeof(color) * (i - 1), sizeof(color));
+    if (palette->Add(static_cast<int>(color)) != i) {
+      return nullptr;
+    }
+  }
+  *brick_dimension = header.brick_dimension;
+  return BlockPool::GetImageRoot(file.data() + header.image_offset);
+}
@@ -0,0 +1,92 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WORLD_IMAGE_H_
+#define WORLD_IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "block.h"
+#include "palette.h"
+
+// A world image is a file with the blocks of a world in the same layout as
+// a BlockPool keeps them in memory. Blocks refer to their children by
+// offsets rather than pointers, so an image can be used in place wherever
+// it's mapped. Opening one only maps it and checks its header, and the
+// pages are read from disk as the blocks on them are visited. The pool
+// copies the blocks of an image before changing them, so the file itself
+// never changes.
+//
+// Unlike the format of world_file.h, images are neither compact nor
+// portable, since the blocks are stored in the byte order and layout of the
+// machine that wrote them. The file consists of:
+//
+//   magic            4 bytes   "SBWI"
+//   version          uint32    kWorldImageVersion
+//   layout           uint32    the sizes of a block and of the smallest
+//                              image, and a byte order mark
+//   brick dimension  int32     -1 when the world has no bricks
+//   palette size     uint32    including the empty color
+//   padding          4 bytes
+//   image offset     uint64    where the blocks start
+//   image size       uint64
+//   colors           uint32    for every color after the empty one
+//   blocks                     written by BlockPool::WriteImage(), aligned
+//                              to kWorldImageAlignment
+static const uint32_t kWorldImageVersion = 1;
+static const size_t kWorldImageAlignment = 16;
+
+// A whole file mapped read only into memory.
+class MappedFile {
+ public:
+  MappedFile();
+  ~MappedFile();
+
+  // Maps a file, unmapping the previous one. Returns false if the file
+  // can't be mapped.
+  bool Open(const std::string &path);
+  void Close();
+
+  bool is_open() const { return data_ != nullptr; }
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data_;
+  size_t size_;
+#ifdef _WIN32
+  void *mapping_;
+#endif
+};
+
+// Writes a world to a stream as an image. The stream must be seekable.
+// Returns false if writing fails.
+bool WriteWorldImage(const Block &root, const Palette &palette,
+                     int brick_dimension, std::ostream *stream);
+
+// Checks the header of a mapped image and reads its palette into an empty
+// one. Returns the root block of the world inside the image, which stays
+// valid while the file is mapped, or null if the file isn't a valid image
+// for this machine. The blocks themselves are trusted without being read.
+const Block *ReadWorldImage(const MappedFile &file, Palette *palette,
+                            int *brick_dimension);
+
+#endif  // WORLD_IMAGE_H_
@@ -0,0 +1,630 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "world_journal.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "block_traversal.h"
+#include "file_utilities.h"
+#include "world_file.h"
+
+namespace {
+
+const char kBaseMagic[] = {'S', 'B', 'W', 'B'};
+const char kSegmentMagic[] = {'S', 'B', 'W', 'J'};
+const uint8_t kBrickMask = 0xff;
+// How long records can wait before they are synced to disk.
+const int kSyncIntervalMs = 100;
+// The size of the segments since the base that starts a compaction.
+const size_t kCompactionBytes = 16 * 1024 * 1024;
+
+// Gives an existing file a second name, which keeps the contents when the
+// file is replaced under the first name. Returns false if it can't, such as
+// where the system has no hard links.
+bool LinkFile(const std::string &path, const std::string &link_path) {
+#ifdef _WIN32
+  return false;
+#else
+  std::remove(link_path.c_str());
+  return link(path.c_str(), link_path.c_str()) == 0;
+#endif
+}
+
+// Writes what has been written to a file through to the disk.
+bool SyncFile(FILE *file) {
+  if (std::fflush(file) != 0) {
+    return false;
+  }
+#ifdef _WIN32
+  return _commit(_fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
+}
+
+uint32_t GetChecksum(const char *data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+template <typename T>
+void AppendValue(std::string *data, T value) {
+  data->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Reads the header of a base up to the world. Returns false if it isn't
+// valid.
+bool ReadBaseHeader(std::istream *stream, uint32_t *first_segment,
+                    uint8_t *kind) {
+  char magic[sizeof(kBaseMagic)];
+  uint32_t version;
+  return stream->read(magic, sizeof(magic)) &&
+         std::memcmp(magic, kBaseMagic, sizeof(magic)) == 0 &&
+         ReadValue(stream, &version) && version == kWorldJournalVersion &&
+         ReadValue(stream, first_segment) && ReadValue(stream, kind);
+}
+
+bool IsValidCode(LocationalCode code) {
+  int dimension = code.dimension();
+  return dimension <= LocationalCode::kMaxDimension &&
+         code.value() >> (3 * dimension) == 1;
+}
+
+}  // namespace
+
+const char WorldJournal::kBaseFileName[] = "base";
+const char WorldJournal::kSegmentFileName[] = "journal.";
+const char WorldJournal::kImageFileName[] = "image.";
+
+WorldJournal::WorldJournal(World *world)
+    : world_(world), directory_(), segment_(0), first_segment_(0),
+      num_segment_bytes_(0), base_generation_(0), num_colors_(0),
+      writing_thread_(), mutex_(), condition_(), chunks_(), compaction_(),
+      failed_(false), stopping_(false), file_(nullptr), file_segment_(0) {}
+
+WorldJournal::~WorldJournal() {
+  Stop();
+}
+
+bool WorldJournal::Recover(const std::string &directory) {
+  Stop();
+  directory_ = directory;
+  uint32_t first_segment = 0;
+  uint8_t kind = kWorldBase;
+  std::ifstream file(GetBasePath(), std::ios::binary);
+  if (!file || !ReadBaseHeader(&file, &first_segment, &kind) ||
+      !(kind == kImageBase
+            ? world_->LoadImage(GetImagePath(first_segment))
+            : kind == kWorldBase && world_->Load(&file))) {
+    directory_.clear();
+    world_->Clear();
+    return false;
+  }
+  file.close();
+
+  // The base keeps the indices of its colors, so the records refer to the
+  // same palette as the world.
+  Palette palette = world_->palette();
+  for (uint32_t segment = first_segment; ReplaySegment(segment, &palette);
+       ++segment) {
+  }
+  directory_.clear();
+  Open(directory, std::string());
+  return true;
+}
+
+void WorldJournal::Start(const std::string &directory,
+                         const std::string &image_path) {
+  Stop();
+  MakeDirectory(directory);
+  Open(directory, image_path);
+}
+
+bool WorldJournal::Stop() {
+  if (!is_open()) {
+    return true;
+  }
+  // Record the changes the listeners haven't been notified of yet.
+  WorldChanged(world_->changes());
+  world_->RemoveListener(this);
+  FinishCompaction();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+  writing_thread_.join();
+
+  directory_.clear();
+  chunks_.clear();
+  return !failed_;
+}
+
+void WorldJournal::Update() {
+  if (!is_open()) {
+    return;
+  }
+  bool requested;
+  bool done;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    requested = compaction_.requested;
+    done = compaction_.done;
+  }
+  if (requested && done) {
+    ReleaseCompaction();
+  } else if (!requested && num_segment_bytes_ >= kCompactionBytes) {
+    Compact();
+  }
+}
+
+void WorldJournal::Compact() {
+  if (!is_open()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (compaction_.requested) {
+      return;
+    }
+  }
+  ++segment_;
+  BeginCompaction();
+}
+
+void WorldJournal::FinishCompaction() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!compaction_.requested) {
+      return;
+    }
+    condition_.wait(lock, [this] { return compaction_.done; });
+  }
+  ReleaseCompaction();
+}
+
+void WorldJournal::WorldChanged(const std::vector<WorldChange> &changes) {
+  // A change of the whole world is recorded as a tree of all of it, which
+  // starts a compaction once it's large.
+  for (const WorldChange &change : changes) {
+    if (change.generation <= base_generation_) {
+      continue;
+    }
+    AppendColors();
+    AppendBlock(change.code);
+  }
+}
+
+std::string WorldJournal::GetBasePath() const {
+  return directory_ + "/" + kBaseFileName;
+}
+
+std::string WorldJournal::GetSegmentPath(uint32_t segment) const {
+  return directory_ + "/" + kSegmentFileName + std::to_string(segment);
+}
+
+std::string WorldJournal::GetImagePath(uint32_t first_segment) const {
+  return directory_ + "/" + kImageFileName + std::to_string(first_segment);
+}
+
+bool WorldJournal::SegmentExists(uint32_t segment) const {
+  return static_cast<bool>(std::ifstream(GetSegmentPath(segment)));
+}
+
+uint32_t WorldJournal::FindFirstSegment() const {
+  std::ifstream file(GetBasePath(), std::ios::binary);
+  uint32_t first_segment;
+  uint8_t kind;
+  if (!file || !ReadBaseHeader(&file, &first_segment, &kind)) {
+    return 0;
+  }
+  return first_segment;
+}
+
+bool WorldJournal::ReplaySegment(uint32_t segment, Palette *palette) {
+  std::string data;
+  if (!ReadFile(GetSegmentPath(segment), &data)) {
+    return false;
+  }
+  size_t position = sizeof(kSegmentMagic);
+  uint32_t version;
+  int32_t brick_dimension;
+  if (data.compare(0, sizeof(kSegmentMagic), kSegmentMagic,
+                   sizeof(kSegmentMagic)) != 0 ||
+      !ReadValue(data, &position, data.size(), &version) ||
+      version != kWorldJournalVersion ||
+      !ReadValue(data, &position, data.size(), &brick_dimension) ||
+      brick_dimension != world_->brick_dimension()) {
+    return false;
+  }
+
+  BlockPool pool(palette);
+  while (position < data.size()) {
+    size_t start = position;
+    uint8_t type;
+    uint32_t size;
+    uint32_t checksum;
+    if (!ReadValue(data, &position, data.size(), &type) ||
+        !ReadValue(data, &position, data.size(), &size) ||
+        data.size() - position < size) {
+      break;
+    }
+    size_t end = position + size;
+    if (!ReadValue(data, &end, data.size(), &checksum) ||
+        GetChecksum(&data[start], end - start - sizeof(checksum)) !=
+            checksum ||
+        !ReplayRecord(type, data, position, end - sizeof(checksum), palette,
+                      &pool)) {
+      break;
+    }
+    position = end;
+  }
+  return true;
+}
+
+bool WorldJournal::ReplayRecord(uint8_t type, const std::string &data,
+                                size_t position, size_t end,
+                                Palette *palette, BlockPool *pool) {
+  if (type == kColorsRecord) {
+    uint32_t first_index;
+    if (!ReadValue(data, &position, end, &first_index) ||
+        first_index != static_cast<uint32_t>(palette->size())) {
+      return false;
+    }
+    int color;
+    while (ReadValue(data, &position, end, &color)) {
+      int index = palette->size();
+      if (palette->Add(color) != index) {
+        return false;
+      }
+    }
+    return position == end;
+  }
+
+  uint64_t value;
+  if (!ReadValue(data, &position, end, &value)) {
+    return false;
+  }
+  LocationalCode code(value);
+  if (!IsValidCode(code)) {
+    return false;
+  }
+  if (type == kLeafRecord) {
+    uint16_t index;
+    if (!ReadValue(data, &position, end, &index) || position != end ||
+        index >= palette->size()) {
+      return false;
+    }
+    world_->SetBlock(code, palette->color(index));
+    return true;
+  }
+  if (type != kTreeRecord || (world_->brick_dimension() >= 0 &&
+                               code.dimension() > world_->brick_dimension())) {
+    return false;
+  }
+  Block tree;
+  if (!ReplayTree(data, &position, end, *palette, pool, &tree,
+                  code.dimension()) ||
+      position != end) {
+    tree.Release(pool);
+    return false;
+  }
+  Block snapshot = world_->ImportSnapshot(tree, *palette);
+  tree.Release(pool);
+  world_->RestoreSnapshot(code, snapshot);
+  world_->ReleaseSnapshot(&snapshot);
+  return true;
+}
+
+bool WorldJournal::ReplayTree(const std::string &data, size_t *position,
+                              size_t end, const Palette &palette,
+                              BlockPool *pool, Block *block, int dimension) {
+  uint8_t mask;
+  if (!ReadValue(data, position, end, &mask)) {
+    return false;
+  }
+  if (!mask) {
+    uint16_t index;
+    if (!ReadValue(data, position, end, &index) || index >= palette.size()) {
+      return false;
+    }
+    block->SetValue(index, pool);
+    return true;
+  }
+
+  if (dimension == world_->brick_dimension()) {
+    if (mask != kBrickMask) {
+      return false;
+    }
+    uint16_t *voxels = block->MutableVoxels(pool);
+    for (int i = 0; i < Block::kBrickVolume; ++i) {
+      if (!ReadValue(data, position, end, &voxels[i]) ||
+          voxels[i] >= palette.size()) {
+        return false;
+      }
+    }
+    block->SimplifyVoxels(pool);
+    return true;
+  }
+
+  if (dimension == LocationalCode::kMaxDimension) {
+    return false;
+  }
+  Block *children = block->SetChildren(mask, pool);
+  int num_children = Block::CountChildren(mask);
+  for (int i = 0; i < num_children; ++i) {
+    if (!ReplayTree(data, position, end, palette, pool, &children[i],
+                    dimension + 1)) {
+      return false;
+    }
+  }
+  block->SimplifyChildren(pool);
+  return true;
+}
+
+void WorldJournal::Open(const std::string &directory,
+                        const std::string &image_path) {
+  directory_ = directory;
+  // Segments before the first one are left over from a crash after a new
+  // base was written.
+  uint32_t first_segment = FindFirstSegment();
+  uint32_t end_segment = first_segment;
+  while (SegmentExists(end_segment)) {
+    ++end_segment;
+  }
+  uint32_t old_segment = first_segment;
+  while (old_segment > 0 && SegmentExists(old_segment - 1)) {
+    --old_segment;
+  }
+  RemoveSegments(old_segment, first_segment);
+
+  first_segment_ = first_segment;
+  segment_ = end_segment;
+  failed_ = false;
+  stopping_ = false;
+  compaction_ = Compaction();
+  writing_thread_ = std::thread(&WorldJournal::RunWritingThread, this);
+  world_->AddListener(this);
+  BeginCompaction(image_path);
+}
+
+void WorldJournal::BeginCompaction(const std::string &image_path) {
+  StartSegment();
+  base_generation_ = world_->generation();
+  num_segment_bytes_ = 0;
+  num_colors_ = world_->palette().size();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    compaction_.root = world_->TakeSnapshot();
+    compaction_.palette = world_->palette();
+    compaction_.brick_dimension = world_->brick_dimension();
+    compaction_.image_path = image_path;
+    compaction_.first_segment = segment_;
+    compaction_.old_first_segment = first_segment_;
+    compaction_.requested = true;
+    compaction_.done = false;
+    compaction_.written = false;
+  }
+  condition_.notify_all();
+}
+
+void WorldJournal::ReleaseCompaction() {
+  world_->ReleaseSnapshot(&compaction_.root);
+  if (compaction_.written) {
+    first_segment_ = compaction_.first_segment;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  compaction_.requested = false;
+}
+
+void WorldJournal::StartSegment() {
+  Chunk chunk;
+  chunk.segment = segment_;
+  chunk.data.append(kSegmentMagic, sizeof(kSegmentMagic));
+  AppendValue(&chunk.data, kWorldJournalVersion);
+  AppendValue(&chunk.data, static_cast<int32_t>(world_->brick_dimension()));
+  std::lock_guard<std::mutex> lock(mutex_);
+  chunks_.push_back(std::move(chunk));
+}
+
+void WorldJournal::AppendRecord(RecordType type,
+                                const std::string &contents) {
+  std::string record;
+  AppendValue(&record, static_cast<uint8_t>(type));
+  AppendValue(&record, static_cast<uint32_t>(contents.size()));
+  record += contents;
+  AppendValue(&record, GetChecksum(record.data(), record.size()));
+  num_segment_bytes_ += record.size();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (chunks_.empty() || chunks_.back().segment != segment_) {
+    Chunk chunk;
+    chunk.segment = segment_;
+    chunks_.push_back(std::move(chunk));
+  }
+  chunks_.back().data += record;
+}
+
+void WorldJournal::AppendColors() {
+  const Palette &palette = world_->palette();
+  if (palette.size() == num_colors_) {
+    return;
+  }
+  std::string contents;
+  AppendValue(&contents, static_cast<uint32_t>(num_colors_));
+  for (int i = num_colors_; i < palette.size(); ++i) {
+    AppendValue(&contents, palette.color(static_cast<uint16_t>(i)));
+  }
+  num_colors_ = palette.size();
+  AppendRecord(kColorsRecord, contents);
+}
+
+void WorldJournal::AppendBlock(LocationalCode code) {
+  std::string contents;
+  AppendValue(&contents, code.value());
+  int dimension;
+  const Block *block = world_->GetBlock(code, &dimension);
+  if (!block || dimension < code.dimension() || block->is_leaf()) {
+    AppendValue(&contents, block ? block->value() : Palette::kEmptyIndex);
+    AppendRecord(kLeafRecord, contents);
+    return;
+  }
+
+  TraverseBlocks(
+      block, glm::vec3(0.0f), 1.0f,
+      [&contents](const TraversalNode<const Block> &node) {
+        const Block &block = *node.block;
+        if (block.is_brick()) {
+          AppendValue(&contents, kBrickMask);
+          const uint16_t *voxels = block.voxels();
+          for (int i = 0; i < Block::kBrickVolume; ++i) {
+            AppendValue(&contents, voxels[i]);
+          }
+        } else if (block.is_leaf()) {
+          AppendValue(&contents, static_cast<uint8_t>(0));
+          AppendValue(&contents, block.value());
+        } else {
+          AppendValue(&contents, block.child_mask());
+        }
+        return TraversalResult::kContinue;
+      });
+  AppendRecord(kTreeRecord, contents);
+}
+
+void WorldJournal::RunWritingThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    condition_.wait_for(
+        lock, std::chrono::milliseconds(kSyncIntervalMs), [this] {
+          return stopping_ || (compaction_.requested && !compaction_.done);
+        });
+    std::deque<Chunk> chunks;
+    chunks.swap(chunks_);
+    bool compacting = compaction_.requested && !compaction_.done;
+    bool stopping = stopping_;
+    lock.unlock();
+
+    // The snapshot of a requested compaction isn't touched until it's done.
+    bool written = WriteChunks(chunks);
+    bool base_written = compacting && WriteBase(compaction_);
+
+    lock.lock();
+    if (!written || (compacting && !base_written)) {
+      failed_ = true;
+    }
+    if (compacting) {
+      compaction_.done = true;
+      compaction_.written = base_written;
+      condition_.notify_all();
+    }
+    if (stopping) {
+      break;
+    }
+  }
+  lock.unlock();
+
+  if (file_) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+bool WorldJournal::WriteChunks(const std::deque<Chunk> &chunks) {
+  bool written = true;
+  for (const Chunk &chunk : chunks) {
+    if (file_ && file_segment_ != chunk.segment) {
+      written = SyncFile(file_) && written;
+      std::fclose(file_);
+      file_ = nullptr;
+    }
+    if (!file_) {
+      file_ = std::fopen(GetSegmentPath(chunk.segment).c_str(), "ab");
+      file_segment_ = chunk.segment;
+      if (!file_) {
+        written = false;
+        continue;
+      }
+    }
+    if (std::fwrite(chunk.data.data(), 1, chunk.data.size(), file_) !=
+        chunk.data.size()) {
+      written = false;
+    }
+  }
+  if (file_ && !chunks.empty()) {
+    written = SyncFile(file_) && written;
+  }
+  return written;
+}
+
+bool WorldJournal::WriteBase(const Compaction &compaction) {
+  std::string path = GetBasePath();
+  std::string new_path = path + ".new";
+  {
+    std::ofstream file(new_path, std::ios::binary);
+    file.write(kBaseMagic, sizeof(kBaseMagic));
+    WriteValue(&file, kWorldJournalVersion);
+    WriteValue(&file, compaction.first_segment);
+    // Linking the image only adds a name to it, while writing the world
+    // reads every block.
+    bool linked = !compaction.image_path.empty() &&
+                  LinkFile(compaction.image_path,
+                           GetImagePath(compaction.first_segment));
+    WriteValue(&file, static_cast<uint8_t>(linked ? kImageBase
+                                                  : kWorldBase));
+    if (!file ||
+        (!linked && !WriteWorld(compaction.root, compaction.palette,
+                                compaction.brick_dimension,
+                                WorldCompression::kLz, &file))) {
+      file.close();
+      std::remove(new_path.c_str());
+      return false;
+    }
+  }
+  FILE *file = std::fopen(new_path.c_str(), "r+b");
+  bool synced = file && SyncFile(file);
+  if (file) {
+    std::fclose(file);
+  }
+  if (!synced) {
+    std::remove(new_path.c_str());
+    return false;
+  }
+  if (!ReplaceFile(new_path, path)) {
+    return false;
+  }
+  RemoveSegments(compaction.old_first_segment, compaction.first_segment);
+  return true;
+}
+
+void WorldJournal::RemoveSegments(uint32_t first_segment,
+                                  uint32_t end_segment) const {
+  for (uint32_t segment = first_segment; segment < end_segment; ++segment) {
+    std::remove(GetSegmentPath(segment).c_str());
+    std::remove(GetImagePath(segment).c_str());
+  }
+}
@@ -0,0 +1,234 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WORLD_JOURNAL_H_
+#define WORLD_JOURNAL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block.h"
+#include "block_pool.h"
+#include "locational_code.h"
+#include "palette.h"
+#include "world.h"
+
+// Keeps a world on disk as it's edited, as a base world file and a journal
+// of the edits since, so that nothing is lost beyond the last fraction of a
+// second when the game crashes and saving never rewrites the whole world.
+//
+// A journal is a directory with a base and the segments of the journal
+// after it, named kSegmentFileName followed by their number. Numbers are in
+// the byte order of the machine. The base, named kBaseFileName, consists of
+//
+//   magic            4 bytes   "SBWB"
+//   version          uint32    kWorldJournalVersion
+//   first segment    uint32    the first one that isn't in the base
+//   kind             uint8     a BaseKind
+//   world                      in the format of world_file.h
+//
+// where a base of kind kImageBase leaves out the world and keeps it in an
+// image (world_image.h) instead, named kImageFileName followed by the first
+// segment. The image is a hard link to the image the world was loaded
+// from, so starting to journal a world that was just loaded doesn't write
+// all of it again, and saving over the original leaves the link as it was.
+//
+// while a segment starts with
+//
+//   magic            4 bytes   "SBWJ"
+//   version          uint32    kWorldJournalVersion
+//   brick dimension  int32     of the world the records apply to
+//
+// and is followed by records, each of which is
+//
+//   type             uint8     a RecordType
+//   size             uint32    of the contents
+//   contents         bytes
+//   checksum         uint32    FNV-1a of the type, size and contents
+//
+// so that a record torn by a crash ends the segment. The journal listens to
+// the changes of the world and records the contents of each changed block
+// once per notification: a leaf as its code, which includes its dimension,
+// and palette index, and anything else as a tree of masks and indices in
+// pre-order like in world files. The colors the indices refer to are
+// recorded as they are added to the palette.
+//
+// Records are only encoded on the thread that edits the world. A background
+// thread appends them to the current segment and syncs it to disk every
+// tenth of a second, so frames never wait for the disk. Once the segments
+// since the base grow too large, the current state of the world is folded
+// into a new base: a new segment is started, the background thread writes a
+// snapshot of the world as the new base, which names that segment as its
+// first, and then removes the older segments. A crash at any point leaves a
+// base and the segments after it.
+static const uint32_t kWorldJournalVersion = 2;
+
+class WorldJournal : public WorldListener {
+ public:
+  static const char kBaseFileName[];
+  static const char kSegmentFileName[];
+  static const char kImageFileName[];
+
+  explicit WorldJournal(World *world);
+  ~WorldJournal();
+
+  // Replaces the world with the one kept in a journal directory, replaying
+  // the records of each segment after the base up to the first invalid one,
+  // and keeps journaling it there. Returns false, leaving the world empty
+  // and the journal closed, if there is no base or it can't be read.
+  bool Recover(const std::string &directory);
+  // Starts journaling the world as it is into a directory, which is created
+  // if it's missing, replacing the world kept there. Failing to write shows
+  // up when the journal is stopped. A world that is the same as the image it
+  // was just loaded from can give the path of the image, which is then
+  // linked as the base instead of being written, where the system allows.
+  void Start(const std::string &directory,
+             const std::string &image_path = std::string());
+  // Writes out the remaining records and stops journaling. Must be called
+  // before the world is cleared, loaded or defragmented. Returns false if
+  // any record or base couldn't be written since the journal was started.
+  bool Stop();
+  bool is_open() const { return !directory_.empty(); }
+
+  // Releases the snapshot of a finished compaction and starts another one
+  // if the segments have grown too large. Meant to be called once per
+  // frame.
+  void Update();
+  // Folds the journal into a new base in the background.
+  void Compact();
+  // Waits for the base being written, if any, and releases its snapshot so
+  // that the world can be defragmented.
+  void FinishCompaction();
+
+  // The bytes recorded since the last base.
+  size_t num_segment_bytes() const { return num_segment_bytes_; }
+  uint32_t segment() const { return segment_; }
+
+  virtual void WorldChanged(const std::vector<WorldChange> &changes);
+
+ private:
+  enum BaseKind : uint8_t {
+    kWorldBase = 0,
+    kImageBase = 1,
+  };
+
+  enum RecordType : uint8_t {
+    // The colors added to the palette since the last colors record.
+    kColorsRecord = 1,
+    // A leaf: its code and palette index.
+    kLeafRecord = 2,
+    // A block with children: its code and its tree of masks and indices.
+    kTreeRecord = 3,
+  };
+
+  // Bytes to append to a segment, created if this is its first chunk.
+  struct Chunk {
+    uint32_t segment;
+    std::string data;
+  };
+
+  // A snapshot of the world to write as the base, which the background
+  // thread only reads.
+  struct Compaction {
+    Compaction()
+        : root(), palette(), brick_dimension(-1), image_path(),
+          first_segment(0), old_first_segment(0), requested(false),
+          done(false), written(false) {}
+
+    Block root;
+    Palette palette;
+    int brick_dimension;
+    // An image of the snapshot to link as the base instead, if any.
+    std::string image_path;
+    // The first segment after the new base and after the old one, which
+    // is removed along with the segments up to the new one.
+    uint32_t first_segment;
+    uint32_t old_first_segment;
+    bool requested;
+    bool done;
+    bool written;
+  };
+
+  WorldJournal(const WorldJournal &) = delete;
+  WorldJournal &operator=(const WorldJournal &) = delete;
+
+  std::string GetBasePath() const;
+  std::string GetSegmentPath(uint32_t segment) const;
+  std::string GetImagePath(uint32_t first_segment) const;
+  bool SegmentExists(uint32_t segment) const;
+  // Returns the first segment after the base, or zero without a base.
+  uint32_t FindFirstSegment() const;
+  // Replays the valid records of a segment. Returns false if the segment
+  // is missing or its header is invalid.
+  bool ReplaySegment(uint32_t segment, Palette *palette);
+  bool ReplayRecord(uint8_t type, const std::string &data, size_t position,
+                    size_t end, Palette *palette, BlockPool *pool);
+  bool ReplayTree(const std::string &data, size_t *position, size_t end,
+                  const Palette &palette, BlockPool *pool, Block *block,
+                  int dimension);
+
+  // Opens the journal on a new segment after the existing ones and folds
+  // the world into a new base, linked from the given image if any.
+  void Open(const std::string &directory, const std::string &image_path);
+  // Starts a new segment and a compaction that writes the world as the base
+  // before it, or links the given image of the world as the base.
+  void BeginCompaction(const std::string &image_path = std::string());
+  void ReleaseCompaction();
+  void StartSegment();
+  void AppendRecord(RecordType type, const std::string &contents);
+  void AppendColors();
+  void AppendBlock(LocationalCode code);
+
+  void RunWritingThread();
+  // Appends chunks to their segments and syncs them. Returns false if
+  // writing fails.
+  bool WriteChunks(const std::deque<Chunk> &chunks);
+  bool WriteBase(const Compaction &compaction);
+  // Removes the segments in the range along with the images of bases that
+  // started at them.
+  void RemoveSegments(uint32_t first_segment, uint32_t end_segment) const;
+
+  World *world_;
+  std::string directory_;
+  uint32_t segment_;
+  uint32_t first_segment_;
+  size_t num_segment_bytes_;
+  // Changes up to this generation are in the base.
+  uint64_t base_generation_;
+  // The colors of the palette of the world that have been recorded.
+  int num_colors_;
+
+  // Shared with the writing thread.
+  std::thread writing_thread_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<Chunk> chunks_;
+  Compaction compaction_;
+  bool failed_;
+  bool stopping_;
+
+  // Only used by the writing thread.
+  FILE *file_;
+  uint32_t file_segment_;
+};
+
+#endif  // WORLD_JOURNAL_H_
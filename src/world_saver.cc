@@ -0,0 +1,170 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "world_saver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <ostream>
+#include <streambuf>
+#include <utility>
+
+#include "file_utilities.h"
+#include "world_image.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double GetMilliseconds(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// Passes everything written through to another buffer, counting the bytes
+// as they go so that other threads can follow along.
+class CountingBuffer : public std::streambuf {
+ public:
+  CountingBuffer(std::streambuf *buffer, std::atomic<size_t> *count)
+      : buffer_(buffer), count_(count) {}
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      return traits_type::not_eof(c);
+    }
+    ++*count_;
+    return buffer_->sputc(traits_type::to_char_type(c));
+  }
+
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    std::streamsize written = buffer_->sputn(data, size);
+    *count_ += static_cast<size_t>(written);
+    return written;
+  }
+
+  pos_type seekoff(off_type offset, std::ios_base::seekdir direction,
+                   std::ios_base::openmode mode) override {
+    return buffer_->pubseekoff(offset, direction, mode);
+  }
+
+  pos_type seekpos(pos_type position, std::ios_base::openmode mode) override {
+    return buffer_->pubseekpos(position, mode);
+  }
+
+  int sync() override { return buffer_->pubsync(); }
+
+ private:
+  std::streambuf *buffer_;
+  std::atomic<size_t> *count_;
+};
+
+}  // namespace
+
+WorldSaver::WorldSaver(World *world)
+    : world_(world), estimated_bytes_(0), last_stats_(), snapshot_(),
+      palette_(), stats_(), saving_thread_(), num_bytes_written_(0),
+      done_(false) {}
+
+WorldSaver::~WorldSaver() {
+  Wait();
+}
+
+bool WorldSaver::Save(const std::string &path) {
+  if (is_saving()) {
+    return false;
+  }
+  Clock::time_point start = Clock::now();
+  snapshot_ = world_->TakeSnapshot();
+  palette_ = world_->palette();
+
+  if (last_stats_.succeeded) {
+    estimated_bytes_ = last_stats_.num_bytes;
+  } else {
+    estimated_bytes_ = world_->pool().num_used_bytes();
+  }
+  stats_ = Stats();
+  stats_.generation = world_->generation();
+  num_bytes_written_ = 0;
+  done_ = false;
+  saving_thread_ = std::thread(&WorldSaver::RunSavingThread, this, path,
+                               world_->brick_dimension());
+  stats_.start_ms = GetMilliseconds(start);
+  return true;
+}
+
+bool WorldSaver::Wait() {
+  if (!is_saving()) {
+    return true;
+  }
+  Finish();
+  return last_stats_.succeeded;
+}
+
+bool WorldSaver::Update() {
+  if (!is_saving() || !done_) {
+    return false;
+  }
+  Finish();
+  return true;
+}
+
+float WorldSaver::progress() const {
+  if (!is_saving()) {
+    return 1.0f;
+  }
+  if (done_) {
+    return 1.0f;
+  }
+  // The estimate may be off either way, so stop short of done until it is.
+  float progress = static_cast<float>(num_bytes_written_) /
+                   static_cast<float>(std::max<size_t>(estimated_bytes_, 1));
+  return std::min(progress, 0.99f);
+}
+
+void WorldSaver::RunSavingThread(std::string path, int brick_dimension) {
+  Clock::time_point start = Clock::now();
+  // Write to a new file and move it into place, since the old one may be
+  // mapped and a failed save shouldn't lose it.
+  std::string new_path = path + ".new";
+  bool written;
+  {
+    std::ofstream file(new_path, std::ios::binary);
+    CountingBuffer buffer(file.rdbuf(), &num_bytes_written_);
+    std::ostream stream(&buffer);
+    written = file && WriteWorldImage(snapshot_, palette_, brick_dimension,
+                                      &stream);
+    file.close();
+    written = written && file;
+  }
+  if (written) {
+    written = ReplaceFile(new_path, path);
+  } else {
+    std::remove(new_path.c_str());
+  }
+
+  stats_.num_bytes = num_bytes_written_;
+  stats_.write_ms = GetMilliseconds(start);
+  stats_.succeeded = written;
+  done_ = true;
+}
+
+void WorldSaver::Finish() {
+  saving_thread_.join();
+  world_->ReleaseSnapshot(&snapshot_);
+  last_stats_ = stats_;
+}
@@ -0,0 +1,99 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WORLD_SAVER_H_
+#define WORLD_SAVER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "block.h"
+#include "palette.h"
+#include "world.h"
+
+// Saves a world as an image (world_image.h) on a background thread while it
+// keeps being edited.
+//
+// A save starts at a frame boundary by taking a snapshot of the world and a
+// copy of its palette, which costs about as much as publishing a snapshot.
+// The saving thread then writes that snapshot while edits copy the blocks
+// they change instead of changing them, so the file holds the world exactly
+// as it was when the save started. The snapshot is released by the editing
+// thread once it's written, freeing the blocks edits replaced meanwhile.
+class WorldSaver {
+ public:
+  // How a save went.
+  struct Stats {
+    Stats()
+        : generation(0), num_bytes(0), start_ms(0.0), write_ms(0.0),
+          succeeded(false) {}
+
+    // The generation of the world that was saved.
+    uint64_t generation;
+    size_t num_bytes;
+    // The time the editing thread spent starting the save.
+    double start_ms;
+    // The time the saving thread spent writing the snapshot.
+    double write_ms;
+    bool succeeded;
+  };
+
+  explicit WorldSaver(World *world);
+  // Waits for a running save.
+  ~WorldSaver();
+
+  // Starts saving the world as it is now to a file, which is replaced once
+  // the whole image is written. Returns false if a save is still running.
+  // The world can't be cleared or loaded until the save is finished.
+  bool Save(const std::string &path);
+  // Waits for a running save to finish. Returns false if it failed.
+  bool Wait();
+  // Finishes a save whose thread is done. Returns true if one was, after
+  // which last_stats() describes it. Meant to be called once per frame.
+  bool Update();
+
+  bool is_saving() const { return saving_thread_.joinable(); }
+  // An estimate of how much of the running save is written, from 0 to 1,
+  // based on the size of the previous save, or on the memory the blocks of
+  // the world take before the first one.
+  float progress() const;
+  size_t num_bytes_written() const { return num_bytes_written_; }
+  const Stats &last_stats() const { return last_stats_; }
+
+ private:
+  WorldSaver(const WorldSaver &) = delete;
+  WorldSaver &operator=(const WorldSaver &) = delete;
+
+  void RunSavingThread(std::string path, int brick_dimension);
+  void Finish();
+
+  World *world_;
+  size_t estimated_bytes_;
+  Stats last_stats_;
+
+  // Shared with the saving thread, which only reads the snapshot and touches
+  // stats_ until done_ is set.
+  Block snapshot_;
+  Palette palette_;
+  Stats stats_;
+  std::thread saving_thread_;
+  std::atomic<size_t> num_bytes_written_;
+  std::atomic<bool> done_;
+};
+
+#endif  // WORLD_SAVER_H_
@@ -0,0 +1,553 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "world_streamer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#include "block_traversal.h"
+#include "file_utilities.h"
+#include "world_file.h"
+#include "world_image.h"
+
+namespace {
+
+// The number of levels of a region that its placeholder keeps, and how
+// solid the blocks at the bottom have to be to become solid leaves.
+const int kPlaceholderLevels = 2;
+const float kPlaceholderOccupancy = 0.5f;
+// Regions are loaded up to this many player sizes away, unless they are
+// smaller than this fraction of the player size.
+const float kLoadDistance = 16.0f;
+const float kMinRegionSize = 0.25f;
+
+const char kIndexMagic[] = {'S', 'B', 'W', 'R'};
+const uint32_t kIndexVersion = 1;
+
+}  // namespace
+
+const char WorldStreamer::kTopFileName[] = "top.sbi";
+const char WorldStreamer::kIndexFileName[] = "regions";
+
+WorldStreamer::WorldStreamer(World *world, size_t memory_budget)
+    : world_(world), memory_budget_(memory_budget), directory_(),
+      region_dimension_(0), region_brick_dimension_(-1),
+      deduplicates_(false), regions_(), num_loaded_regions_(0),
+      num_loaded_bytes_(0), num_updates_(0),
+      loading_thread_(), mutex_(), condition_(), requests_(),
+      loaded_regions_(), stopping_(false) {}
+
+WorldStreamer::~WorldStreamer() {
+  Close();
+}
+
+bool WorldStreamer::WriteRegions(const World &world, int region_dimension,
+                                 const std::string &directory) {
+  assert(region_dimension >= 0 &&
+         (world.brick_dimension() < 0 ||
+          region_dimension <= world.brick_dimension()));
+  MakeDirectory(directory);
+
+  std::set<uint64_t> codes;
+  bool written = true;
+  float size = static_cast<float>(1u << region_dimension);
+  TraverseBlocks(
+      &world.root(), glm::vec3(0.0f), size,
+      [&](const TraversalNode<const Block> &node) {
+        if (node.depth < region_dimension) {
+          return TraversalResult::kContinue;
+        }
+        if (!node.block->is_leaf()) {
+          LocationalCode code = LocationalCode::FromCoordinates(
+              static_cast<uint32_t>(node.corner.x),
+              static_cast<uint32_t>(node.corner.y),
+              static_cast<uint32_t>(node.corner.z), region_dimension);
+          codes.insert(code.value());
+          written = written && WriteRegion(world, directory,
+                                           region_dimension, code,
+                                           *node.block);
+        }
+        return TraversalResult::kSkipChildren;
+      });
+  return written && WriteTop(world, directory, region_dimension, codes);
+}
+
+bool WorldStreamer::Open(const std::string &directory) {
+  Close();
+
+  std::ifstream index(directory + "/" + kIndexFileName, std::ios::binary);
+  char magic[sizeof(kIndexMagic)];
+  uint32_t version;
+  int32_t region_dimension;
+  uint32_t num_regions;
+  if (!index.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), kIndexMagic) ||
+      !ReadValue(&index, &version) || version != kIndexVersion ||
+      !ReadValue(&index, &region_dimension) || region_dimension < 0 ||
+      region_dimension > World::kMaxDimension ||
+      !ReadValue(&index, &num_regions)) {
+    world_->Clear();
+    return false;
+  }
+  std::vector<LocationalCode> codes;
+  for (uint32_t i = 0; i < num_regions; ++i) {
+    uint64_t value;
+    if (!ReadValue(&index, &value) ||
+        LocationalCode(value).dimension() != region_dimension) {
+      world_->Clear();
+      return false;
+    }
+    codes.push_back(LocationalCode(value));
+  }
+
+  if (!world_->LoadImage(directory + "/" + kTopFileName)) {
+    return false;
+  }
+  int brick_dimension = world_->brick_dimension();
+  if (brick_dimension >= 0 && region_dimension > brick_dimension) {
+    world_->Clear();
+    return false;
+  }
+
+  directory_ = directory;
+  region_dimension_ = region_dimension;
+  region_brick_dimension_ =
+      brick_dimension >= 0 ? brick_dimension - region_dimension : -1;
+  deduplicates_ = world_->deduplicates();
+  for (LocationalCode code : codes) {
+    regions_[code.value()].placeholder = world_->TakeSnapshot(code);
+  }
+  stopping_ = false;
+  loading_thread_ = std::thread(&WorldStreamer::RunLoadingThread, this);
+  return true;
+}
+
+bool WorldStreamer::Close() {
+  if (!is_open()) {
+    return true;
+  }
+  StopLoadingThread();
+
+  // Write back the edited regions, then everything outside of them with
+  // placeholders that show the edits.
+  bool written = true;
+  std::set<uint64_t> codes;
+  for (auto &entry : regions_) {
+    LocationalCode code(entry.first);
+    codes.insert(entry.first);
+    Block current = world_->TakeSnapshot(code);
+    if (IsEdited(entry.second, current)) {
+      written = written && WriteRegion(*world_, directory_,
+                                       region_dimension_, code, current);
+    }
+    world_->ReleaseSnapshot(&current);
+  }
+  written = written && WriteTop(*world_, directory_, region_dimension_,
+                                codes);
+
+  for (auto &entry : regions_) {
+    world_->ReleaseSnapshot(&entry.second.placeholder);
+    world_->ReleaseSnapshot(&entry.second.tree);
+  }
+  regions_.clear();
+  directory_.clear();
+  num_loaded_regions_ = 0;
+  num_loaded_bytes_ = 0;
+  return written;
+}
+
+void WorldStreamer::Update(const glm::vec3 &position, float player_size) {
+  if (!is_open()) {
+    return;
+  }
+  ++num_updates_;
+
+  std::vector<std::unique_ptr<LoadedRegion>> loaded_regions;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    loaded_regions.swap(loaded_regions_);
+  }
+  for (const std::unique_ptr<LoadedRegion> &loaded_region : loaded_regions) {
+    Region &region = regions_[loaded_region->code.value()];
+    region.requested = false;
+    if (!loaded_region->read) {
+      region.failed = true;
+    } else if (!region.loaded) {
+      CopyIn(*loaded_region, &region);
+    }
+  }
+
+  // Find the wanted regions, nearest first.
+  std::vector<std::pair<float, uint64_t>> wanted_regions;
+  float region_size =
+      world_->size() / static_cast<float>(1u << region_dimension_);
+  if (region_size >= player_size * kMinRegionSize) {
+    float max_distance = player_size * kLoadDistance;
+    for (auto &entry : regions_) {
+      glm::vec3 corner = GetRegionCorner(LocationalCode(entry.first));
+      glm::vec3 nearest =
+          glm::clamp(position, corner, corner + region_size);
+      float distance = glm::distance(position, nearest);
+      if (distance <= max_distance) {
+        entry.second.last_wanted = num_updates_;
+        wanted_regions.push_back(std::make_pair(distance, entry.first));
+      }
+    }
+    std::sort(wanted_regions.begin(), wanted_regions.end());
+  }
+
+  EvictOverBudget();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (LocationalCode code : requests_) {
+      regions_[code.value()].requested = false;
+    }
+    requests_.clear();
+    for (const std::pair<float, uint64_t> &wanted_region : wanted_regions) {
+      if (num_loaded_bytes_ >= memory_budget_) {
+        break;
+      }
+      Region &region = regions_[wanted_region.second];
+      if (!region.loaded && !region.requested && !region.failed) {
+        requests_.push_back(LocationalCode(wanted_region.second));
+        region.requested = true;
+      }
+    }
+  }
+  condition_.notify_one();
+}
+
+void WorldStreamer::LoadNow(const glm::vec3 &min, const glm::vec3 &max) {
+  if (!is_open()) {
+    return;
+  }
+  float region_size =
+      world_->size() / static_cast<float>(1u << region_dimension_);
+  for (auto &entry : regions_) {
+    Region &region = entry.second;
+    if (region.loaded || region.failed) {
+      continue;
+    }
+    LocationalCode code(entry.first);
+    glm::vec3 corner = GetRegionCorner(code);
+    if (glm::any(glm::lessThanEqual(max, corner)) ||
+        glm::any(glm::greaterThanEqual(min, corner + region_size))) {
+      continue;
+    }
+    std::unique_ptr<LoadedRegion> loaded_region = ReadRegion(code);
+    if (loaded_region->read) {
+      CopyIn(*loaded_region, &region);
+      region.last_wanted = num_updates_;
+    } else {
+      region.failed = true;
+    }
+  }
+}
+
+void WorldStreamer::GetSnapshots(std::vector<Block *> *snapshots) {
+  for (auto &entry : regions_) {
+    snapshots->push_back(&entry.second.placeholder);
+    snapshots->push_back(&entry.second.tree);
+  }
+}
+
+std::string WorldStreamer::GetRegionPath(const std::string &directory,
+                                         LocationalCode code) {
+  std::ostringstream path;
+  path << directory << "/" << std::hex << code.value() << ".sbw";
+  return path.str();
+}
+
+bool WorldStreamer::WriteRegion(const World &world,
+                                const std::string &directory,
+                                int region_dimension, LocationalCode code,
+                                const Block &block) {
+  int brick_dimension = world.brick_dimension();
+  if (brick_dimension >= 0) {
+    brick_dimension -= region_dimension;
+  }
+  std::string path = GetRegionPath(directory, code);
+  std::string new_path = path + ".new";
+  {
+    std::ofstream file(new_path, std::ios::binary);
+    if (!file ||
+        !WriteWorld(block, world.palette(), brick_dimension,
+                    WorldCompression::kLz, &file)) {
+      file.close();
+      std::remove(new_path.c_str());
+      return false;
+    }
+  }
+  return ReplaceFile(new_path, path);
+}
+
+bool WorldStreamer::WriteTop(const World &world,
+                             const std::string &directory,
+                             int region_dimension,
+                             const std::set<uint64_t> &codes) {
+  Palette palette = world.palette();
+  BlockPool pool(&palette);
+  pool.set_deduplicates(world.deduplicates());
+  BlockPool::CopyMap copies;
+  Block top = BuildTop(world, world.root(), LocationalCode(),
+                       region_dimension, codes, &pool, &palette, &copies);
+
+  std::string path = directory + "/" + kTopFileName;
+  std::string new_path = path + ".new";
+  {
+    std::ofstream file(new_path, std::ios::binary);
+    if (!file || !WriteWorldImage(top, palette, world.brick_dimension(),
+                                  &file)) {
+      file.close();
+      std::remove(new_path.c_str());
+      return false;
+    }
+  }
+  if (!ReplaceFile(new_path, path)) {
+    return false;
+  }
+
+  path = directory + "/" + kIndexFileName;
+  new_path = path + ".new";
+  {
+    std::ofstream file(new_path, std::ios::binary);
+    file.write(kIndexMagic, sizeof(kIndexMagic));
+    WriteValue(&file, kIndexVersion);
+    WriteValue(&file, static_cast<int32_t>(region_dimension));
+    WriteValue(&file, static_cast<uint32_t>(codes.size()));
+    for (uint64_t code : codes) {
+      WriteValue(&file, code);
+    }
+    if (!file) {
+      file.close();
+      std::remove(new_path.c_str());
+      return false;
+    }
+  }
+  return ReplaceFile(new_path, path);
+}
+
+Block WorldStreamer::BuildTop(const World &world, const Block &block,
+                              LocationalCode code, int region_dimension,
+                              const std::set<uint64_t> &codes,
+                              BlockPool *pool, Palette *palette,
+                              BlockPool::CopyMap *copies) {
+  if (code.dimension() == region_dimension) {
+    if (codes.count(code.value())) {
+      return BuildPlaceholder(world.pool(), block, kPlaceholderLevels, pool,
+                              palette);
+    }
+    return pool->CopyTree(block, copies);
+  }
+  if (block.is_leaf()) {
+    return Block(block.value());
+  }
+  if (block.is_brick()) {
+    return pool->CopyTree(block, copies);
+  }
+
+  Block top;
+  Block *children = top.SetChildren(block.child_mask(), pool);
+  for (int i = 0, position = 0; i < Block::kNumChildren; ++i) {
+    const Block *child = block.child(i);
+    if (child) {
+      children[position++] =
+          BuildTop(world, *child, code.child(i), region_dimension, codes,
+                   pool, palette, copies);
+    }
+  }
+  top.SimplifyChildren(pool);
+  return top;
+}
+
+Block WorldStreamer::BuildPlaceholder(const BlockPool &source,
+                                      const Block &block, int levels,
+                                      BlockPool *pool, Palette *palette) {
+  if (block.is_leaf()) {
+    return Block(block.value());
+  }
+  if (levels == 0 || block.is_brick()) {
+    BlockAggregate aggregate = source.GetAggregate(block);
+    if (aggregate.occupancy < kPlaceholderOccupancy) {
+      return Block();
+    }
+    return Block(palette->Add(aggregate.color));
+  }
+
+  Block placeholder;
+  Block *children = placeholder.SetChildren(block.child_mask(), pool);
+  for (int i = 0, position = 0; i < Block::kNumChildren; ++i) {
+    const Block *child = block.child(i);
+    if (child) {
+      children[position++] =
+          BuildPlaceholder(source, *child, levels - 1, pool, palette);
+    }
+  }
+  placeholder.SimplifyChildren(pool);
+  return placeholder;
+}
+
+std::unique_ptr<WorldStreamer::LoadedRegion> WorldStreamer::ReadRegion(
+    LocationalCode code) const {
+  std::unique_ptr<LoadedRegion> loaded_region(new LoadedRegion());
+  loaded_region->code = code;
+  loaded_region->pool.set_deduplicates(deduplicates_);
+  std::ifstream file(GetRegionPath(directory_, code), std::ios::binary);
+  int brick_dimension;
+  if (file &&
+      ReadWorld(&file, &loaded_region->pool, &loaded_region->palette,
+                &loaded_region->root, &brick_dimension) &&
+      brick_dimension == region_brick_dimension_) {
+    loaded_region->read = true;
+    loaded_region->bytes = loaded_region->pool.num_used_bytes();
+  }
+  return loaded_region;
+}
+
+void WorldStreamer::RunLoadingThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    condition_.wait(lock, [this] { return stopping_ || !requests_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    LocationalCode code = requests_.front();
+    requests_.pop_front();
+    lock.unlock();
+    std::unique_ptr<LoadedRegion> loaded_region = ReadRegion(code);
+    lock.lock();
+    loaded_regions_.push_back(std::move(loaded_region));
+  }
+}
+
+void WorldStreamer::StopLoadingThread() {
+  if (!loading_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    requests_.clear();
+  }
+  condition_.notify_all();
+  loading_thread_.join();
+  loaded_regions_.clear();
+}
+
+glm::vec3 WorldStreamer::GetRegionCorner(LocationalCode code) const {
+  uint32_t x;
+  uint32_t y;
+  uint32_t z;
+  code.GetCoordinates(&x, &y, &z);
+  float region_size =
+      world_->size() / static_cast<float>(1u << region_dimension_);
+  return glm::vec3(x, y, z) * region_size;
+}
+
+bool WorldStreamer::IsEdited(const Region &region,
+                             const Block &current) const {
+  // A loaded region can be edited into the same blocks as its placeholder,
+  // such as when it's emptied and its placeholder is an empty leaf.
+  return region.loaded ? !current.IsIdentical(region.tree)
+                       : !current.IsIdentical(region.placeholder);
+}
+
+void WorldStreamer::CopyIn(const LoadedRegion &loaded_region,
+                           Region *region) {
+  LocationalCode code = loaded_region.code;
+  Block current = world_->TakeSnapshot(code);
+  if (!current.IsIdentical(region->placeholder)) {
+    // The placeholder was replaced while the region was loading, by an
+    // edit or by undoing to before an eviction. The blocks in the world
+    // win, and are written back so that the file matches them.
+    if (WriteRegion(*world_, directory_, region_dimension_, code,
+                    current)) {
+      region->tree = current;
+      region->loaded = true;
+      // The loaded blocks stand in for the size of the ones kept.
+      region->bytes = loaded_region.bytes;
+      region->last_wanted = num_updates_;
+      ++num_loaded_regions_;
+      num_loaded_bytes_ += region->bytes;
+    } else {
+      world_->ReleaseSnapshot(&current);
+      region->failed = true;
+    }
+    return;
+  }
+  world_->ReleaseSnapshot(&current);
+
+  region->tree =
+      world_->ImportSnapshot(loaded_region.root, loaded_region.palette);
+  world_->RestoreSnapshot(code, region->tree);
+  region->loaded = true;
+  region->bytes = loaded_region.bytes;
+  region->last_wanted = num_updates_;
+  ++num_loaded_regions_;
+  num_loaded_bytes_ += region->bytes;
+}
+
+bool WorldStreamer::Evict(LocationalCode code, Region *region) {
+  Block current = world_->TakeSnapshot(code);
+  if (IsEdited(*region, current)) {
+    if (!WriteRegion(*world_, directory_, region_dimension_, code,
+                     current)) {
+      world_->ReleaseSnapshot(&current);
+      return false;
+    }
+    // The old placeholder doesn't show the edits.
+    Palette palette = world_->palette();
+    BlockPool pool(&palette);
+    Block placeholder = BuildPlaceholder(world_->pool(), current,
+                                         kPlaceholderLevels, &pool,
+                                         &palette);
+    world_->ReleaseSnapshot(&region->placeholder);
+    region->placeholder = world_->ImportSnapshot(placeholder, palette);
+  }
+  world_->ReleaseSnapshot(&current);
+
+  world_->RestoreSnapshot(code, region->placeholder);
+  world_->ReleaseSnapshot(&region->tree);
+  region->tree = Block();
+  region->loaded = false;
+  --num_loaded_regions_;
+  num_loaded_bytes_ -= region->bytes;
+  region->bytes = 0;
+  return true;
+}
+
+void WorldStreamer::EvictOverBudget() {
+  while (num_loaded_bytes_ > memory_budget_) {
+    // Regions that are still wanted stay, even over the budget.
+    std::map<uint64_t, Region>::iterator least_recent = regions_.end();
+    for (auto it = regions_.begin(); it != regions_.end(); ++it) {
+      const Region &region = it->second;
+      if (region.loaded && region.last_wanted < num_updates_ &&
+          (least_recent == regions_.end() ||
+           region.last_wanted < least_recent->second.last_wanted)) {
+        least_recent = it;
+      }
+    }
+    if (least_recent == regions_.end() ||
+        !Evict(LocationalCode(least_recent->first), &least_recent->second)) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,199 @@
+// Copyright (C) 2020 Carl Enlund
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WORLD_STREAMER_H_
+#define WORLD_STREAMER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "block.h"
+#include "block_pool.h"
+#include "locational_code.h"
+#include "palette.h"
+#include "world.h"
+
+// Streams the subtrees of a world that doesn't fit in memory from disk.
+//
+// A streamed world is a directory with a file for every region, a subtree of a
+// fixed dimension, in the compressed format of world_file.h and named after the
+// code of the region. The rest of the world is stored as an image in which each
+// region is replaced by a placeholder: a copy of its top few levels where the
+// smallest blocks are leaves with the mean color of the blocks they stand for,
+// if they are mostly solid. Placeholders are drawn and hit by ray casts like
+// any other block, so the world looks coarser instead of missing while regions
+// load.
+//
+// A background thread loads the regions near the player, as long as they
+// aren't too small to matter at the size of the player, into pools of its
+// own. The world copies them in once they are loaded, replacing their
+// placeholders. Once the loaded regions take more memory than the budget,
+// the least recently wanted ones are replaced by placeholders again, and
+// written back first if they were edited.
+//
+// A region counts as edited when its blocks are neither the ones that
+// were loaded nor its placeholder, however it got there, so undoing across
+// loads and evictions never loses edits.
+class WorldStreamer {
+ public:
+  // The file of the parts of the world outside of regions.
+  static const char kTopFileName[];
+  // The file listing the regions.
+  static const char kIndexFileName[];
+
+  WorldStreamer(World *world, size_t memory_budget);
+  ~WorldStreamer();
+
+  // Writes a world as a streamed world into a directory, which is created
+  // if it's missing, with a region for every block of the given dimension
+  // that has children. The dimension can't be below the brick dimension.
+  // Returns false if writing fails.
+  static bool WriteRegions(const World &world, int region_dimension,
+                           const std::string &directory);
+
+  // Replaces the world with the streamed world in a directory, starting
+  // with the placeholders of all regions. Returns false, leaving the world
+  // empty, if it can't be read. Snapshots of the world are invalid
+  // afterwards.
+  bool Open(const std::string &directory);
+  // Writes back the edited regions and everything outside of them, and
+  // stops streaming. The world keeps its blocks. Must be called before the
+  // world is cleared or loaded. Returns false if writing fails.
+  bool Close();
+  bool is_open() const { return !directory_.empty(); }
+
+  // Copies in the regions that finished loading, evicts regions over the
+  // budget and asks for the regions near the given point, in world
+  // coordinates, that aren't too small for the given player size. Meant to
+  // be called once per frame.
+  void Update(const glm::vec3 &position, float player_size);
+  // Loads the regions overlapping a box right away, so that edits inside
+  // the box apply to their blocks rather than to their placeholders.
+  void LoadNow(const glm::vec3 &min, const glm::vec3 &max);
+
+  // Adds the snapshots the streamer keeps of the world, for defragmenting
+  // the world along with them.
+  void GetSnapshots(std::vector<Block *> *snapshots);
+
+  int region_dimension() const { return region_dimension_; }
+  size_t memory_budget() const { return memory_budget_; }
+  size_t num_regions() const { return regions_.size(); }
+  size_t num_loaded_regions() const { return num_loaded_regions_; }
+  // The bytes the loaded regions took in the pools they were loaded into.
+  size_t num_loaded_bytes() const { return num_loaded_bytes_; }
+
+ private:
+  struct Region {
+    Region()
+        : placeholder(), tree(), loaded(false), requested(false),
+          failed(false), bytes(0), last_wanted(0) {}
+
+    // Both are snapshots shared with the world. The tree is empty unless
+    // the region is loaded.
+    Block placeholder;
+    Block tree;
+    bool loaded;
+    // Set while the region waits for or is being read by the loading
+    // thread.
+    bool requested;
+    // Set once the file of the region turned out to be unreadable.
+    bool failed;
+    size_t bytes;
+    // The last update in which the region was wanted.
+    uint64_t last_wanted;
+  };
+
+  // A region read by the loading thread.
+  struct LoadedRegion {
+    LoadedRegion()
+        : code(), read(false), palette(), pool(&palette), root(), bytes(0) {}
+
+    LocationalCode code;
+    // False if the file couldn't be read.
+    bool read;
+    Palette palette;
+    BlockPool pool;
+    Block root;
+    size_t bytes;
+  };
+
+  WorldStreamer(const WorldStreamer &) = delete;
+  WorldStreamer &operator=(const WorldStreamer &) = delete;
+
+  static std::string GetRegionPath(const std::string &directory,
+                                   LocationalCode code);
+  static bool WriteRegion(const World &world, const std::string &directory,
+                          int region_dimension, LocationalCode code,
+                          const Block &block);
+  static bool WriteTop(const World &world, const std::string &directory,
+                       int region_dimension,
+                       const std::set<uint64_t> &codes);
+  static Block BuildTop(const World &world, const Block &block,
+                        LocationalCode code, int region_dimension,
+                        const std::set<uint64_t> &codes, BlockPool *pool,
+                        Palette *palette, BlockPool::CopyMap *copies);
+  static Block BuildPlaceholder(const BlockPool &source, const Block &block,
+                                int levels, BlockPool *pool,
+                                Palette *palette);
+
+  // Reads a region. Safe to call on any thread.
+  std::unique_ptr<LoadedRegion> ReadRegion(LocationalCode code) const;
+  void RunLoadingThread();
+  void StopLoadingThread();
+
+  glm::vec3 GetRegionCorner(LocationalCode code) const;
+  // Returns true if the blocks of a region differ from the ones that were
+  // loaded, or from its placeholder while it isn't loaded.
+  bool IsEdited(const Region &region, const Block &current) const;
+  void CopyIn(const LoadedRegion &loaded_region, Region *region);
+  // Replaces a region with its placeholder. Returns false, keeping the
+  // region, if it was edited and can't be written back.
+  bool Evict(LocationalCode code, Region *region);
+  void EvictOverBudget();
+
+  World *world_;
+  size_t memory_budget_;
+  std::string directory_;
+  int region_dimension_;
+  // The brick dimension of the world relative to the regions.
+  int region_brick_dimension_;
+  bool deduplicates_;
+  std::map<uint64_t, Region> regions_;
+  size_t num_loaded_regions_;
+  size_t num_loaded_bytes_;
+  uint64_t num_updates_;
+
+  // Shared with the loading thread.
+  std::thread loading_thread_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  // The codes of the regions to load, nearest first.
+  std::deque<LocationalCode> requests_;
+  std::vector<std::unique_ptr<LoadedRegion>> loaded_regions_;
+  bool stopping_;
+};
+
+#endif  // WORLD_STREAMER_H_